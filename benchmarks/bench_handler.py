@@ -0,0 +1,20 @@
+#
+# Handlers used by the benchmarks
+#
+
+counters = {}
+payloads = {}
+
+def process_data_logic(key, messages, parameters):
+    counters[key] = counters.get(key, 0) + 1
+    # handlers usually read a few of the messages
+    messages.get('k0')
+    if key.startswith('payload:'):
+        payload = payloads.get(key)
+        if payload is None:
+            payload = payloads[key] = 'x' * int(key[8:])
+        return payload
+    return key.upper()
+
+def upper(s):
+    return s.upper()
@@ -0,0 +1,58 @@
+#ifndef _BENCH_TOOLS_H_
+#define _BENCH_TOOLS_H_
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "benchmark/benchmark.h"
+
+//
+// Python must find the benchmark handler modules, the path is taken
+// once by the first pool initializing python.
+//
+inline void bench_python_path()
+{
+    setenv("PYTHONPATH", BENCH_MODULE_PATH, 0);
+}
+
+//
+// Latency samples taken by one benchmark thread
+//
+struct BenchLatency
+{
+    void start() {
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+    }
+
+    void stop() {
+        struct timespec t1;
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        samples_us.push_back((t1.tv_sec - t0.tv_sec) * 1e6 +
+                             (t1.tv_nsec - t0.tv_nsec) / 1e3);
+    }
+
+    double percentile(double p) {
+        if (samples_us.empty()) {
+            return 0.0;
+        }
+
+        size_t n = (size_t)(p / 100.0 * (samples_us.size() - 1));
+        std::nth_element(samples_us.begin(), samples_us.begin() + n, samples_us.end());
+        return samples_us[n];
+    }
+
+    // per thread percentiles averaged over the threads of the run
+    void report(benchmark::State& state) {
+        state.counters["p50_us"] = benchmark::Counter(percentile(50.0), benchmark::Counter::kAvgThreads);
+        state.counters["p99_us"] = benchmark::Counter(percentile(99.0), benchmark::Counter::kAvgThreads);
+    }
+
+    struct timespec t0;
+    std::vector<double> samples_us;
+};
+
+#endif /* _BENCH_TOOLS_H_ */
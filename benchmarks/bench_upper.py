@@ -0,0 +1,6 @@
+#
+# The least a handler does, for the cost of the call path alone
+#
+
+def process_data_logic(key, messages, parameters):
+    return key.upper()
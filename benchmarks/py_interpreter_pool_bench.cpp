@@ -0,0 +1,157 @@
+#include <map>
+#include <string>
+
+#include "config.h"
+
+#include "py_python.h"
+#include <pthread.h>
+#include <sched.h>
+
+#include "benchmark/benchmark.h"
+#include "bench_tools.h"
+#include "lock_guard.h"
+#include "py_interpreter_pool.h"
+#include "py_interpreter_pool_guard.h"
+
+using namespace std;
+
+#define BENCH_POOL_SIZE 64
+#define BENCH_MAX_THREADS 64
+
+//
+// Pools are shared by all the threads of a benchmark and live until
+// the end of the run, one per sharding setup.
+//
+static PyInterpreterPool& bench_pool(unsigned int shards_no)
+{
+    static pthread_mutex_t m = PTHREAD_MUTEX_INITIALIZER;
+    static map<unsigned int, PyInterpreterPool*> pools;
+
+    LockGuard<pthread_mutex_t> g(&m);
+
+    map<unsigned int, PyInterpreterPool*>::iterator it = pools.find(shards_no);
+    if (it != pools.end()) {
+        return *it->second;
+    }
+
+    bench_python_path();
+    PyInterpreterPool* pool = new PyInterpreterPool(BENCH_POOL_SIZE, shards_no);
+    pool->start("bench_handler", "upper");
+    pools[shards_no] = pool;
+
+    return *pool;
+}
+
+//
+// Contention on the free lists: every thread books and releases an
+// interpreter as fast as it can. Argument is the number of shards,
+// SHARD_PER_CPU meaning one per online cpu.
+//
+static void BM_PoolAllocDealloc(benchmark::State& state)
+{
+    PyInterpreterPool& pool = bench_pool(state.range(0));
+
+    for (auto _ : state) {
+        PyInterpreterLease lease = pool.alloc();
+        benchmark::DoNotOptimize(pool.get_handler(lease));
+        pool.dealloc(lease);
+    }
+
+    state.SetItemsProcessed(state.iterations());
+    state.counters["shards"] = benchmark::Counter(pool.shards(), benchmark::Counter::kAvgThreads);
+}
+
+BENCHMARK(BM_PoolAllocDealloc)
+    ->Arg(1)
+    ->Arg(SHARD_PER_CPU)
+    ->ThreadRange(1, BENCH_MAX_THREADS)
+    ->UseRealTime();
+
+//
+// Cost of entering and leaving an interpreter with the guard: booking
+// it, taking the GIL and swapping the thread state, without a call
+//
+static void BM_PoolGuard(benchmark::State& state)
+{
+    PyInterpreterPool& pool = bench_pool(SHARD_PER_CPU);
+
+    for (auto _ : state) {
+        PyInterpreterPoolGuard ipg(pool);
+        benchmark::DoNotOptimize(ipg.handler);
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_PoolGuard)
+    ->ThreadRange(1, BENCH_MAX_THREADS)
+    ->UseRealTime();
+
+#define BENCH_STARTUP_POOL_SIZE 16
+
+static void bench_pool_ready(void* arg, size_t size)
+{
+    __atomic_store_n((bool*)arg, true, __ATOMIC_RELEASE);
+}
+
+//
+// Time until the pool takes traffic, all the interpreters made at
+// start or only the first one of a progressive pool. Time until all
+// of them are there is counted apart. Arguments are 1 if progressive
+// and 1 if the handler modules are preloaded.
+//
+static void BM_PoolStartup(benchmark::State& state)
+{
+    bench_pool(1);
+
+    BenchLatency ready_latency;
+    for (auto _ : state) {
+        bool ready = false;
+        PyInterpreterScaling scaling(BENCH_STARTUP_POOL_SIZE, BENCH_STARTUP_POOL_SIZE);
+        scaling.progressive = state.range(0) != 0;
+        scaling.on_ready = bench_pool_ready;
+        scaling.ready_arg = &ready;
+        ready_latency.start();
+        PyInterpreterPool* pool = new PyInterpreterPool(scaling);
+        pool->preload_modules(state.range(1) != 0);
+        pool->start("bench_handler", "upper");
+
+        state.PauseTiming();
+        while (!__atomic_load_n(&ready, __ATOMIC_ACQUIRE)) {
+            sched_yield();
+        }
+
+        ready_latency.stop();
+        delete pool;
+        state.ResumeTiming();
+    }
+
+    state.counters["ready_ms"] = ready_latency.percentile(50.0) / 1000.0;
+}
+
+BENCHMARK(BM_PoolStartup)
+    ->Args({0, 0})
+    ->Args({0, 1})
+    ->Args({1, 1})
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+//
+// Cost of timing one step: two clock reads and the record to the
+// histogram of the calling thread, as done on every call
+//
+static void BM_MetricsRecord(benchmark::State& state)
+{
+    static PyMetrics metrics;
+
+    for (auto _ : state) {
+        unsigned long started_ns = PyMetrics_Clock();
+        metrics.record(METRIC_HANDLER, PyMetrics_Clock() - started_ns);
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_MetricsRecord)
+    ->ThreadRange(1, BENCH_MAX_THREADS)
+    ->UseRealTime();
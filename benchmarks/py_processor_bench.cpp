@@ -0,0 +1,223 @@
+#include <map>
+#include <string>
+
+#include "config.h"
+
+#include "py_python.h"
+#include <pthread.h>
+
+#include "benchmark/benchmark.h"
+#include "bench_tools.h"
+#include "lock_guard.h"
+#include "py_processor.h"
+
+using namespace std;
+
+#define BENCH_PROCESSOR_POOL_SIZE 16
+#define BENCH_PROCESSOR_THREADS 8
+
+//
+// Processors live until the end of the run, one per reuse policy and
+// marshalling
+//
+static PyProcessor& bench_processor(PyInterpreterReusePolicy policy,
+                                    PyProcessorMarshalling marshalling = MARSHAL_DICT)
+{
+    static pthread_mutex_t m = PTHREAD_MUTEX_INITIALIZER;
+    static map<pair<int, int>, PyProcessor*> processors;
+
+    LockGuard<pthread_mutex_t> g(&m);
+
+    pair<int, int> key(policy, marshalling);
+    map<pair<int, int>, PyProcessor*>::iterator it = processors.find(key);
+    if (it != processors.end()) {
+        return *it->second;
+    }
+
+    bench_python_path();
+    PyProcessor* processor = new PyProcessor("bench_handler",
+                                             BENCH_PROCESSOR_POOL_SIZE,
+                                             DEFAULT_POOL_SHARDS,
+                                             policy,
+                                             marshalling);
+    processors[key] = processor;
+
+    return *processor;
+}
+
+//
+// Latency of a whole Process call under a reuse policy of the pool
+//
+static void BM_ProcessReusePolicy(benchmark::State& state)
+{
+    PyProcessor& processor = bench_processor((PyInterpreterReusePolicy)state.range(0));
+    MapString2String messages;
+    MultimapString2String parameters;
+    messages["name"] = "value";
+    parameters.insert(make_pair(string("name"), string("value")));
+    BenchLatency latency;
+
+    for (auto _ : state) {
+        latency.start();
+        benchmark::DoNotOptimize(processor.Process("key", messages, parameters));
+        latency.stop();
+    }
+
+    state.SetItemsProcessed(state.iterations());
+    latency.report(state);
+}
+
+BENCHMARK(BM_ProcessReusePolicy)
+    ->ArgName("policy")
+    ->Arg(REUSE_FIFO)
+    ->Arg(REUSE_LIFO)
+    ->Arg(REUSE_AFFINITY)
+    ->Threads(1)
+    ->Threads(BENCH_PROCESSOR_THREADS)
+    ->UseRealTime();
+
+//
+// Cost per request of a batch of the given size against single calls
+//
+static void BM_ProcessBatch(benchmark::State& state)
+{
+    PyProcessor& processor = bench_processor(REUSE_FIFO);
+    MapString2String messages;
+    MultimapString2String parameters;
+    messages["name"] = "value";
+    parameters.insert(make_pair(string("name"), string("value")));
+    PyProcessorRequests requests(state.range(0),
+                                 PyProcessorRequest("key", messages, parameters));
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(processor.ProcessBatch(requests));
+    }
+
+    state.SetItemsProcessed(state.iterations() * requests.size());
+}
+
+BENCHMARK(BM_ProcessBatch)
+    ->ArgName("batch")
+    ->RangeMultiplier(8)
+    ->Range(1, 4096)
+    ->Threads(1)
+    ->Threads(BENCH_PROCESSOR_THREADS)
+    ->UseRealTime();
+
+//
+// Cost of passing maps of the given size and value length to a handler
+// reading one value: copied to dicts or wrapped in views. The time
+// spent making the arguments alone is taken from the metrics.
+//
+static void BM_ProcessMarshalling(benchmark::State& state)
+{
+    PyProcessor& processor = bench_processor(REUSE_FIFO,
+                                             (PyProcessorMarshalling)state.range(0));
+    MapString2String messages;
+    MultimapString2String parameters;
+    for (int i = 0; i < state.range(1); i++) {
+        string k = "k" + lexical_cast<string>(i);
+        messages[k] = string(state.range(2), 'v');
+        parameters.insert(make_pair(k, string(state.range(2), 'p')));
+    }
+
+    PyInterpreterPoolMetrics before = processor.Metrics();
+    unsigned long count = before.histograms[METRIC_MARSHAL].count;
+    unsigned long sum = before.histograms[METRIC_MARSHAL].sum;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(processor.Process("key", messages, parameters));
+    }
+
+    PyInterpreterPoolMetrics after = processor.Metrics();
+    count = after.histograms[METRIC_MARSHAL].count - count;
+    sum = after.histograms[METRIC_MARSHAL].sum - sum;
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * state.range(1) * 2 * state.range(2));
+    state.counters["marshal_ns"] = count ? (double)sum / count : 0.0;
+}
+
+BENCHMARK(BM_ProcessMarshalling)
+    ->ArgNames({"marshalling", "entries", "length"})
+    ->ArgsProduct({{MARSHAL_DICT, MARSHAL_VIEW}, {1, 16, 256, 4096}, {8, 256, 4096}})
+    ->UseRealTime();
+
+enum BenchResultSink
+{
+    SINK_RETURN,
+    SINK_BUFFER,
+    SINK_READER
+};
+
+static void bench_read(const char* data, size_t size, void* arg)
+{
+    *(size_t*)arg += size;
+}
+
+//
+// Cost of taking a large result: returned, put in a reused buffer or
+// read in place
+//
+static void BM_ProcessResultSink(benchmark::State& state)
+{
+    PyProcessor& processor = bench_processor(REUSE_FIFO);
+    MapString2String messages;
+    MultimapString2String parameters;
+    string key = "payload:" + lexical_cast<string>(state.range(1));
+    string output;
+    size_t read = 0;
+
+    for (auto _ : state) {
+        switch (state.range(0)) {
+        case SINK_RETURN:
+            benchmark::DoNotOptimize(processor.Process(key, messages, parameters));
+            break;
+        case SINK_BUFFER:
+            processor.Process(key, messages, parameters, output);
+            break;
+        default:
+            processor.Process(key, messages, parameters, bench_read, &read);
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * state.range(1));
+}
+
+BENCHMARK(BM_ProcessResultSink)
+    ->ArgNames({"sink", "bytes"})
+    ->ArgsProduct({{SINK_RETURN, SINK_BUFFER, SINK_READER}, {1024, 4 << 20}})
+    ->UseRealTime();
+
+//
+// Latency of a whole Process call with a handler doing next to
+// nothing, the cost of the path from the client to python and back
+//
+static void BM_ProcessUpper(benchmark::State& state)
+{
+    static PyProcessor* processor = NULL;
+    static pthread_mutex_t m = PTHREAD_MUTEX_INITIALIZER;
+    {
+        LockGuard<pthread_mutex_t> g(&m);
+        if (!processor) {
+            bench_python_path();
+            processor = new PyProcessor("bench_upper", BENCH_PROCESSOR_POOL_SIZE);
+        }
+    }
+
+    MapString2String messages;
+    MultimapString2String parameters;
+    BenchLatency latency;
+
+    for (auto _ : state) {
+        latency.start();
+        benchmark::DoNotOptimize(processor->Process("key", messages, parameters));
+        latency.stop();
+    }
+
+    state.SetItemsProcessed(state.iterations());
+    latency.report(state);
+}
+
+BENCHMARK(BM_ProcessUpper)
+    ->ThreadRange(1, BENCH_PROCESSOR_POOL_SIZE)
+    ->UseRealTime();
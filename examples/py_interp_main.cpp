@@ -1,6 +1,320 @@
 #include <iostream>
+#include <string>
+#include <vector>
+
+#include "config.h"
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lexical_cast.h"
+#include "py_metrics.h"
+#include "py_processor.h"
+
+using namespace std;
+
+#define DEFAULT_THREADS 4
+#define DEFAULT_DURATION_S 10
+#define DEFAULT_ENTRIES 16
+#define DEFAULT_LENGTH 32
+#define FOOTPRINT_MODULES 5
+
+/*
+ * What is driven and how hard
+ */
+struct LoadSettings
+{
+    LoadSettings():
+        module_name(""),
+        identifier("key"),
+        backend(BACKEND_INTERPRETERS),
+        marshalling(MARSHAL_DICT),
+        threads(DEFAULT_THREADS),
+        pool_size(0),
+        workers(1),
+        requests(0),
+        duration_s(DEFAULT_DURATION_S),
+        entries(DEFAULT_ENTRIES),
+        parameters(0),
+        length(DEFAULT_LENGTH),
+        timeout_ms(0),
+        footprint(false) {}
+
+    string module_name;
+    string identifier;
+    PyProcessorBackend backend;
+    PyProcessorMarshalling marshalling;
+    unsigned int threads;
+    unsigned int pool_size;
+    unsigned int workers;
+    unsigned long requests;
+    unsigned int duration_s;
+    unsigned int entries;
+    unsigned int parameters;
+    unsigned int length;
+    unsigned int timeout_ms;
+    bool footprint;
+};
+
+/*
+ * One client thread with the latencies of its calls
+ */
+struct LoadClient
+{
+    LoadClient(): processor(NULL), settings(NULL), issued(NULL), stopped(NULL),
+                  deadline_ns(0), done(0), errors(0) {}
+
+    pthread_t thread;
+    PyProcessor* processor;
+    const LoadSettings* settings;
+    unsigned long* issued;
+    bool* stopped;
+    unsigned long deadline_ns;
+    unsigned long done;
+    unsigned long errors;
+    PyHistogram latency;
+};
+
+static void usage(const char* name)
+{
+    cerr << "Usage: " << name << " -m module [options]\n"
+         << "Calls " << PYTHON_DATA_HANDLER << " of the module from client threads and\n"
+         << "reports the throughput and the latencies.\n"
+         << "  -m module      python module of the handler\n"
+         << "  -P path        directory of the module, added to PYTHONPATH\n"
+         << "  -t threads     client threads (" << DEFAULT_THREADS << ")\n"
+         << "  -s size        interpreters of the pool, or of each worker\n"
+         << "                 (as many as the threads)\n"
+         << "  -b backend     interpreters, workers or zygote (interpreters)\n"
+         << "  -w workers     worker processes of the workers backends (1)\n"
+         << "  -v             pass the maps as views instead of dicts\n"
+         << "  -n requests    stop after that many requests in total\n"
+         << "  -d seconds     stop after that time (" << DEFAULT_DURATION_S << ")\n"
+         << "  -e entries     entries of the message map (" << DEFAULT_ENTRIES << ")\n"
+         << "  -q entries     entries of the parameter multimap (0)\n"
+         << "  -l length      length of the values of the maps (" << DEFAULT_LENGTH << ")\n"
+         << "  -i identifier  the key passed to the handler (key)\n"
+         << "  -T ms          cancel the calls running longer, interpreters only\n"
+         << "  -f             report the memory held by the interpreters at the end\n";
+}
+
+static unsigned long number(const char* name, const char* value)
+{
+    char* end = NULL;
+    unsigned long n = strtoul(value, &end, 10);
+    if (!*value || *end) {
+        throw invalid_argument(string("Not a number for ") + name + ": " + value);
+    }
+
+    return n;
+}
+
+static PyProcessorBackend backend(const string& value)
+{
+    if (value == "interpreters") {
+        return BACKEND_INTERPRETERS;
+    } else if (value == "workers") {
+        return BACKEND_WORKERS;
+    } else if (value == "zygote") {
+        return BACKEND_ZYGOTE;
+    }
+
+    throw invalid_argument("Unknown backend: " + value);
+}
+
+/*
+ * Settings from the command line, false if the usage is to be shown
+ */
+static bool parse(int argn, char** argv, LoadSettings& s)
+{
+    int c = 0;
+    while ((c = getopt(argn, argv, "m:P:t:s:b:w:vn:d:e:q:l:i:T:fh")) != -1) {
+        switch (c) {
+        case 'm': s.module_name = optarg; break;
+        case 'P': {
+            const char* path = getenv("PYTHONPATH");
+            string value = path && *path ? string(optarg) + ":" + path : string(optarg);
+            setenv("PYTHONPATH", value.c_str(), 1);
+            break;
+        }
+        case 't': s.threads = number("threads", optarg); break;
+        case 's': s.pool_size = number("size", optarg); break;
+        case 'b': s.backend = backend(optarg); break;
+        case 'w': s.workers = number("workers", optarg); break;
+        case 'v': s.marshalling = MARSHAL_VIEW; break;
+        case 'n': s.requests = number("requests", optarg); break;
+        case 'd': s.duration_s = number("seconds", optarg); break;
+        case 'e': s.entries = number("entries", optarg); break;
+        case 'q': s.parameters = number("parameters", optarg); break;
+        case 'l': s.length = number("length", optarg); break;
+        case 'i': s.identifier = optarg; break;
+        case 'T': s.timeout_ms = number("timeout", optarg); break;
+        case 'f': s.footprint = true; break;
+        default: return false;
+        }
+    }
+
+    if (s.module_name.empty() || s.threads == 0) {
+        return false;
+    }
+
+    if (s.pool_size == 0) {
+        s.pool_size = s.threads;
+    }
+
+    return true;
+}
+
+/*
+ * Calls until the requests are all issued, the time is over or the run is stopped
+ */
+static void* drive(void* arg)
+{
+    LoadClient* c = (LoadClient*)arg;
+    const LoadSettings& s = *c->settings;
+    MapString2String messages;
+    MultimapString2String parameters;
+    for (unsigned int i = 0; i < s.entries; i++) {
+        messages["k" + lexical_cast<string>(i)] = string(s.length, 'v');
+    }
+
+    for (unsigned int i = 0; i < s.parameters; i++) {
+        parameters.insert(make_pair("p" + lexical_cast<string>(i), string(s.length, 'p')));
+    }
+
+    string output;
+    while (!__atomic_load_n(c->stopped, __ATOMIC_RELAXED)) {
+        if (s.requests) {
+            if (__atomic_add_fetch(c->issued, 1, __ATOMIC_RELAXED) > s.requests) {
+                break;
+            }
+        } else if (PyMetrics_Clock() >= c->deadline_ns) {
+            break;
+        }
+
+        unsigned long started_ns = PyMetrics_Clock();
+        try {
+            c->processor->Process(DEFAULT_HANDLER, s.identifier, messages, parameters, output,
+                                  s.timeout_ms * 1000000ul);
+            c->latency.record(PyMetrics_Clock() - started_ns);
+            c->done++;
+        } catch (exception& e) {
+            if (c->errors++ == 0) {
+                cerr << "Error: " << e.what() << endl;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static void report(const char* name, const PyHistogram& h)
+{
+    printf("%-14s count %10lu  p50 %10.1f  p99 %10.1f  p999 %10.1f  max %10.1f us\n",
+           name, h.count,
+           h.percentile(50) / 1e3, h.percentile(99) / 1e3,
+           h.percentile(99.9) / 1e3, h.max / 1e3);
+}
+
+/*
+ * Each interpreter, then the modules held in most copies
+ */
+static void report(const PyPoolFootprint& f)
+{
+    for (size_t i = 0; i < f.interpreters.size(); i++) {
+        const PyInterpreterFootprint& fi = f.interpreters[i];
+        printf("%-14s %-4u objects %10lu  %10.1f kB  modules %zu\n", "interpreter",
+               fi.lease, fi.objects, fi.bytes / 1e3, fi.modules.size());
+    }
+
+    printf("%-14s objects %10lu  %10.1f kB  duplicated imports %.1f kB  handler data %.1f kB\n",
+           "footprint", f.objects, f.bytes / 1e3, f.duplicated_bytes / 1e3, f.handler_bytes / 1e3);
+    for (size_t i = 0; i < f.duplicated.size() && i < FOOTPRINT_MODULES; i++) {
+        const PyModuleDuplication& d = f.duplicated[i];
+        printf("%-14s %-24s copies %4u  %10.1f kB  duplicated %10.1f kB\n", "module",
+               d.name.c_str(), d.copies, d.bytes / 1e3, d.duplicated_bytes / 1e3);
+    }
+}
 
 int main(int argn, char** argv)
 {
-	return 0;
+    LoadSettings s;
+    try {
+        if (!parse(argn, argv, s)) {
+            usage(argv[0]);
+            return 2;
+        }
+
+        PyProcessor* processor = NULL;
+        if (s.backend == BACKEND_INTERPRETERS) {
+            processor = new PyProcessor(s.module_name, s.pool_size, DEFAULT_POOL_SHARDS,
+                                        REUSE_FIFO, s.marshalling);
+        } else {
+            processor = new PyProcessor(s.module_name, s.backend, s.workers, s.pool_size);
+        }
+
+        unsigned long issued = 0;
+        bool stopped = false;
+        unsigned long started_ns = PyMetrics_Clock();
+        vector<LoadClient> clients(s.threads);
+        for (unsigned int i = 0; i < s.threads; i++) {
+            clients[i].processor = processor;
+            clients[i].settings = &s;
+            clients[i].issued = &issued;
+            clients[i].stopped = &stopped;
+            clients[i].deadline_ns = started_ns + s.duration_s * 1000000000ul;
+            int rc = pthread_create(&clients[i].thread, NULL, drive, &clients[i]);
+            if (rc != 0) {
+                // the clients already started still call the processor
+                __atomic_store_n(&stopped, true, __ATOMIC_RELAXED);
+                for (unsigned int j = 0; j < i; j++) {
+                    pthread_join(clients[j].thread, NULL);
+                }
+
+                delete processor;
+                throw runtime_error(string("pthread_create: ") + strerror(rc));
+            }
+        }
+
+        PyHistogram latency;
+        unsigned long done = 0;
+        unsigned long errors = 0;
+        for (unsigned int i = 0; i < s.threads; i++) {
+            pthread_join(clients[i].thread, NULL);
+            latency.add(clients[i].latency);
+            done += clients[i].done;
+            errors += clients[i].errors;
+        }
+
+        double seconds = (PyMetrics_Clock() - started_ns) / 1e9;
+        PyInterpreterPoolMetrics m = processor->Metrics();
+
+        printf("module %s, %u threads, %lu calls of %u entries and %u parameters of %u bytes\n",
+               s.module_name.c_str(), s.threads, done, s.entries, s.parameters, s.length);
+        printf("%-14s %.0f/s in %.2f s, %lu errors\n", "throughput", done / seconds, seconds, errors);
+        report("latency", latency);
+        if (s.backend == BACKEND_INTERPRETERS) {
+            printf("%-14s size %u  busy %u  waits %lu  timeouts %lu  expired %lu  recycled %lu\n",
+                   "pool", m.pool.size, m.pool.busy, m.pool.waits, m.pool.timeouts,
+                   m.pool.expired, m.pool.recycled);
+            report("alloc wait", m.histograms[METRIC_ALLOC_WAIT]);
+            report("gil acquire", m.histograms[METRIC_GIL_ACQUIRE]);
+            report("marshal", m.histograms[METRIC_MARSHAL]);
+            report("handler", m.histograms[METRIC_HANDLER]);
+            if (s.footprint) {
+                report(processor->Footprint());
+            }
+        }
+
+        delete processor;
+
+        return errors ? 1 : 0;
+    } catch (exception& e) {
+        cerr << "Error: " << e.what() << endl;
+    }
+
+    return 1;
 }
@@ -0,0 +1,95 @@
+#ifndef _ALIGNED_ALLOCATOR_H_
+#define _ALIGNED_ALLOCATOR_H_
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+//
+// Memory for the types aligned on a cache line. Neither new nor
+// std::allocator honour an alignment above the one of the platform
+// before C++17, the memory is then taken from posix_memalign.
+//
+template <typename T> struct AlignedAllocator
+{
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+
+    template <typename U> struct rebind
+    {
+        typedef AlignedAllocator<U> other;
+    };
+
+    AlignedAllocator() {}
+    template <typename U> AlignedAllocator(const AlignedAllocator<U>&) {}
+
+    pointer address(reference x) const { return &x; }
+    const_pointer address(const_reference x) const { return &x; }
+
+    pointer allocate(size_type n, const void* = 0) {
+        void* mem = NULL;
+        if (n > max_size() || posix_memalign(&mem, __alignof__(T), n * sizeof(T)) != 0) {
+            throw std::bad_alloc();
+        }
+
+        return static_cast<pointer>(mem);
+    }
+
+    void deallocate(pointer p, size_type) {
+        free(p);
+    }
+
+    size_type max_size() const {
+        return size_type(-1) / sizeof(T);
+    }
+
+    void construct(pointer p, const T& value) {
+        new (p) T(value);
+    }
+
+    void destroy(pointer p) {
+        p->~T();
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const AlignedAllocator<T>&, const AlignedAllocator<U>&)
+{
+    return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const AlignedAllocator<T>&, const AlignedAllocator<U>&)
+{
+    return false;
+}
+
+template <typename T> T* aligned_new()
+{
+    AlignedAllocator<T> a;
+    T* p = a.allocate(1);
+    try {
+        new (p) T();
+    } catch (...) {
+        a.deallocate(p, 1);
+        throw;
+    }
+
+    return p;
+}
+
+template <typename T> void aligned_delete(T* p)
+{
+    if (p) {
+        AlignedAllocator<T> a;
+        a.destroy(p);
+        a.deallocate(p, 1);
+    }
+}
+
+#endif /* _ALIGNED_ALLOCATOR_H_ */
@@ -0,0 +1,133 @@
+#ifndef _PY_COROUTINE_H_
+#define _PY_COROUTINE_H_
+
+//
+// Awaitables for C++20 coroutines. The library itself does not need
+// C++20, they are defined here inline for the clients built with it.
+//
+#if defined(__cpp_impl_coroutine)
+
+#include <coroutine>
+#include <string>
+
+#include "config.h"
+
+#include "py_interpreter_pool.h"
+#include "py_interpreter_pool_guard.h"
+#include "py_processor.h"
+#include "py_worker_pool.h"
+
+//
+// Result of co_await pool.acquire(): the lease of a free interpreter,
+// to be released with dealloc(). With no interpreter free the
+// coroutine is suspended and resumed by the dealloc() handing one off,
+// in the thread calling it.
+//
+struct PyInterpreterAwaitable
+{
+    PyInterpreterAwaitable(PyInterpreterPool& p): pool(p) {}
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    bool await_suspend(std::coroutine_handle<> h) {
+        handle = h;
+        waiter.resume = resume;
+        waiter.arg = this;
+        return pool.alloc_async(waiter);
+    }
+
+    PyInterpreterLease await_resume() const noexcept {
+        return waiter.lease;
+    }
+
+    static void resume(void* arg, PyInterpreterLease lease) {
+        ((PyInterpreterAwaitable*)arg)->handle.resume();
+    }
+
+    PyInterpreterPool& pool;
+    PyInterpreterWaiter waiter;
+    std::coroutine_handle<> handle;
+};
+
+inline PyInterpreterAwaitable PyInterpreterPool::acquire()
+{
+    return PyInterpreterAwaitable(*this);
+}
+
+//
+// Result of co_await processor.ProcessAsync(...): the content returned
+// by the handler. Only the wait for an interpreter is asynchronous,
+// the handler runs in the thread resuming the coroutine. The errors
+// are thrown as by Process. The maps are not copied, they must live
+// until the end of the co_await.
+//
+struct PyProcessAwaitable
+{
+    PyProcessAwaitable(PyProcessor& p,
+                       const std::string& i,
+                       const MapString2String& m,
+                       const MultimapString2String& pm,
+                       unsigned long t):
+        processor(p), identifier(i), messages(m), parameters(pm),
+        timeout_ns(t) {}
+
+    bool await_ready() const noexcept {
+        // the workers are not leased here
+        return !processor.ip.get();
+    }
+
+    bool await_suspend(std::coroutine_handle<> h) {
+        handle = h;
+        waiter.resume = resume;
+        waiter.arg = this;
+        return processor.ip->alloc_async(waiter);
+    }
+
+    std::string await_resume() {
+        if (!processor.ip.get()) {
+            return processor.wp->process(identifier, messages, parameters,
+                                         timeout_ns);
+        }
+
+        std::string content;
+        try {
+            PyInterpreterPoolGuard ipg(*processor.ip, waiter.lease);
+            ipg.set_timeout(timeout_ns);
+            content = processor.call(ipg, identifier, messages, parameters);
+        } catch (...) {
+            processor.ip->dealloc(waiter.lease);
+            throw;
+        }
+
+        processor.ip->dealloc(waiter.lease);
+        return content;
+    }
+
+    static void resume(void* arg, PyInterpreterLease lease) {
+        ((PyProcessAwaitable*)arg)->handle.resume();
+    }
+
+    PyProcessor& processor;
+    const std::string identifier;
+    const MapString2String& messages;
+    const MultimapString2String& parameters;
+    const unsigned long timeout_ns;
+    PyInterpreterWaiter waiter;
+    std::coroutine_handle<> handle;
+};
+
+inline PyProcessAwaitable
+PyProcessor::ProcessAsync(const std::string& identifier,
+                          const MapString2String& messages,
+                          const MultimapString2String& parameters,
+                          unsigned long timeout_ns)
+{
+    return PyProcessAwaitable(*this, identifier, messages, parameters,
+                              timeout_ns);
+}
+
+#endif /* __cpp_impl_coroutine */
+
+#endif /* _PY_COROUTINE_H_ */
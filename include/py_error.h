@@ -1,12 +1,21 @@
 #ifndef _PY_ERROR_H_
 #define _PY_ERROR_H_
 
+#include <stdexcept>
 #include <string>
 
-#include <python2.7/Python.h>
+#include "py_python.h"
 
 #define MAX_ERROR_MSG_LEN 256
 
+/*
+ * A call of a handler cancelled at its deadline
+ */
+struct PyTimeoutError: public std::runtime_error
+{
+    explicit PyTimeoutError(const std::string& msg): std::runtime_error(msg) {}
+};
+
 std::string sys_error_info(int rc, const std::string& msg);
 std::string error_info(const std::string& msg);
 
@@ -0,0 +1,104 @@
+#ifndef _PY_FOOTPRINT_H_
+#define _PY_FOOTPRINT_H_
+
+#include <string>
+#include <vector>
+
+#include "config.h"
+
+#include "py_python.h"
+
+/*
+ * Objects of one type, with their size in bytes as told by
+ * sys.getsizeof, the buffers they own included
+ */
+struct PyTypeFootprint
+{
+    PyTypeFootprint(): objects(0), bytes(0) {}
+
+    std::string name;
+    unsigned long objects;
+    unsigned long bytes;
+};
+
+/*
+ * A module of an interpreter: the entries and the size of its dict,
+ * and the objects reached from it first
+ */
+struct PyModuleFootprint
+{
+    PyModuleFootprint(): entries(0), dict_bytes(0), objects(0), bytes(0) {}
+
+    std::string name;
+    unsigned long entries;
+    unsigned long dict_bytes;
+    unsigned long objects;
+    unsigned long bytes;
+};
+
+typedef std::vector<PyTypeFootprint> PyTypeFootprints;
+typedef std::vector<PyModuleFootprint> PyModuleFootprints;
+
+/*
+ * What an interpreter holds, the types and the modules by bytes, the
+ * largest first
+ */
+struct PyInterpreterFootprint
+{
+    PyInterpreterFootprint(): lease(0), objects(0), bytes(0) {}
+
+    unsigned int lease;
+    unsigned long objects;
+    unsigned long bytes;
+    PyTypeFootprints types;
+    PyModuleFootprints modules;
+};
+
+/*
+ * A module loaded in more than one interpreter: its copies, their
+ * bytes and the bytes beyond the smallest copy
+ */
+struct PyModuleDuplication
+{
+    PyModuleDuplication(): copies(0), bytes(0), duplicated_bytes(0) {}
+
+    std::string name;
+    unsigned int copies;
+    unsigned long bytes;
+    unsigned long duplicated_bytes;
+};
+
+typedef std::vector<PyInterpreterFootprint> PyInterpreterFootprints;
+typedef std::vector<PyModuleDuplication> PyModuleDuplications;
+
+/*
+ * The interpreters of a pool with what is duplicated among them, the
+ * most duplicated bytes first. The bytes of the handler modules are
+ * the data kept by the handlers, the duplicated bytes of the others
+ * the cost of the imports made again in each interpreter.
+ */
+struct PyPoolFootprint
+{
+    PyPoolFootprint(): objects(0), bytes(0), duplicated_bytes(0), handler_bytes(0) {}
+
+    PyInterpreterFootprints interpreters;
+    PyModuleDuplications duplicated;
+    unsigned long objects;
+    unsigned long bytes;
+    unsigned long duplicated_bytes;
+    unsigned long handler_bytes;
+};
+
+/*
+ * The objects of the current interpreter are walked from its modules,
+ * each one is counted once, with the first module reaching it. The
+ * objects shared by the interpreters, as the builtin types, are
+ * counted in each one. It needs the GIL of the interpreter, held for
+ * the whole walk, and returns false with a python error set on
+ * failure. The pool summary is made of the footprints of all its
+ * interpreters and the names of its handler modules.
+ */
+bool PyFootprint_Take(PyInterpreterFootprint& footprint);
+void PyFootprint_Sum(PyPoolFootprint& footprint, const std::vector<std::string>& handler_modules);
+
+#endif /* _PY_FOOTPRINT_H_ */
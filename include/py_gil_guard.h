@@ -3,7 +3,7 @@
 
 #include "config.h"
 
-#include <python2.7/Python.h>
+#include "py_python.h"
 #include <pthread.h>
 
 #include "lock_guard.h"
@@ -11,24 +11,53 @@
 #include "py_interpreter_pool.h"
 #include "trace.h"
 
+//
+// Holds the GIL of the main interpreter or, given a thread state of
+// some interpreter, the GIL of that interpreter with it made current.
+// With a GIL per interpreter a thread state of this thread is made for
+// the time of the guard, otherwise the shared GIL is taken and the
+// given thread state swapped in.
+//
 struct PyGILGuard
 {
-    PyGILGuard(bool tbr = true): to_be_released(tbr) {
+    PyGILGuard(bool tbr = true): to_be_released(tbr), own_ts(NULL) {
         FRAME;
 
         INFO("GIL acquire");
         gstate = PyGILState_Ensure();
         INFO("GIL acquired");
         main_ts = PyThreadState_Get();
-        INFO("Saved main thread state: " + lexical_cast<string>(main_ts));
+        INFO("Saved main thread state: %#lx", main_ts);
+    }
+
+    PyGILGuard(PyInterpreterThreadStatePtr interpreter):
+        to_be_released(true), own_ts(NULL), main_ts(NULL), gstate(PyGILState_UNLOCKED) {
+        FRAME;
+
+#ifdef PY_OWN_GIL
+        own_ts = PyThreadState_New(PyThreadState_GetInterpreter(interpreter));
+        INFO("Interpreter GIL acquire");
+        PyEval_RestoreThread(own_ts);
+        INFO("Interpreter GIL acquired");
+#else
+        INFO("GIL acquire");
+        gstate = PyGILState_Ensure();
+        INFO("GIL acquired");
+        main_ts = PyThreadState_Swap(interpreter);
+        INFO("Thread state swap to: %#lx", interpreter);
+#endif
     }
 
     ~PyGILGuard() {
         FRAME;
 
-        if (to_be_released) {
+        if (own_ts) {
+            PyThreadState_Clear(own_ts);
+            PyThreadState_DeleteCurrent();
+            INFO("Interpreter GIL released");
+        } else if (to_be_released) {
             PyThreadState_Swap(main_ts);
-            INFO("Thread state swap to: " + lexical_cast<string>(main_ts));
+            INFO("Thread state swap to: %#lx", main_ts);
             INFO("GIL release");
             PyGILState_Release(gstate);
             INFO("GIL released");
@@ -36,6 +65,7 @@ struct PyGILGuard
     }
 
     bool to_be_released;
+    PyThreadStatePtr own_ts;
     PyThreadStatePtr main_ts;
     PyGILState_STATE gstate;
 };
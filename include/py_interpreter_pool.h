@@ -1,20 +1,39 @@
 #ifndef _PY_INTERPRETER_POOL_H_
 #define _PY_INTERPRETER_POOL_H_
 
-#include <deque>
-#include <map>
 #include <string>
 #include <vector>
 
 #include "config.h"
 
-#include <python2.7/Python.h>
+#include "py_python.h"
 #include <pthread.h>
 
+#include "aligned_allocator.h"
 #include "cxx_compatibility.h"
+#include "py_footprint.h"
+#include "py_metrics.h"
+#include "py_preload.h"
 
 #define DEFAULT_POOL_SIZE 50
+#define DEFAULT_POOL_SHARDS 1
+#define SHARD_PER_CPU 0
 #define MAX_TIMEOUT_NS 10000
+#define CACHE_LINE_SIZE 64
+#define DEFAULT_GROW_WAIT_NS 1000000
+#define DEFAULT_GROW_WAITERS 1
+#define DEFAULT_IDLE_MS 60000
+#define DEFAULT_SCALING_PERIOD_MS 100
+#define RELOAD_PERIOD_US 1000
+#define DEFAULT_RELOAD_TIMEOUT_NS 10000000000ul
+#define DEFAULT_HEAP_CHECK_CALLS 100
+#define WATCHDOG_PERIOD_US 10000
+#define NO_DEADLINE 0
+
+/*
+  Serializes python initialization and pool creation process wide
+*/
+extern pthread_mutex_t global_pool_mutex;
 
 /*
   Visible types of objects handled by class methods
@@ -24,65 +43,500 @@ typedef pthread_cond_t* PthreadCondPtr;
 typedef PyThreadState* PyInterpreterThreadStatePtr;
 typedef PyThreadState* PyThreadStatePtr;
 typedef PyObject* PyDataHandlerPtr;
+typedef unsigned int PyInterpreterLease;
+typedef unsigned int PyHandlerId;
+
+#define NO_LEASE ((PyInterpreterLease)-1)
+#define DEFAULT_HANDLER ((PyHandlerId)0)
+#define NO_SHARD ((unsigned int)-1)
+
+/*
+  Which free interpreter is handed out: the one released long ago
+  (round robin), the one released last, or the one the calling thread
+  used last, as long as it is free, else the one released last.
+*/
+enum PyInterpreterReusePolicy
+{
+    REUSE_FIFO,
+    REUSE_LIFO,
+    REUSE_AFFINITY
+};
+
+enum PyInterpreterSlotState
+{
+    SLOT_FREE,
+    SLOT_BUSY,
+    SLOT_EMPTY,
+    SLOT_QUARANTINED
+};
+
+/*
+  Called once the pool has all the interpreters of its lower bound,
+  with their number
+*/
+typedef void (*PyInterpreterReadyFn)(void* arg, size_t size);
+
+/*
+  When an interpreter is replaced by a new one: after max_calls calls,
+  once its heap has grown by more than max_heap_growth blocks since it
+  was made, looked at every heap_check_calls calls, or when a handler
+  fails in a way an interpreter may not survive, on_error. Zero turns
+  a limit off. The heap is the allocated blocks of the interpreter,
+  taken once its handlers are built. It is known only with a GIL, and
+  so an allocator, per interpreter, the heap limit is refused else.
+*/
+struct PyInterpreterRecycling
+{
+    PyInterpreterRecycling():
+        max_calls(0),
+        max_heap_growth(0),
+        heap_check_calls(DEFAULT_HEAP_CHECK_CALLS),
+        on_error(false) {}
+
+    unsigned long max_calls;
+    unsigned long max_heap_growth;
+    unsigned int heap_check_calls;
+    bool on_error;
+};
+
+/*
+  Bounds of an elastic pool and when it changes its size. It grows
+  while clients wait for interpreters longer than grow_wait_ns on
+  average, or at least grow_waiters of them wait, or some time out.
+  Interpreters free for idle_ms are ended, down to min_size. The
+  pool is checked every period_ms.
+
+  A progressive pool is started with one interpreter, the others up to
+  min_size are made in the background and booked as soon as each one
+  has its handler. The ready function, if any, is called when all of
+  them are there, in any case.
+
+  The interpreters are replaced as told by the recycling, whatever the
+  size of the pool.
+*/
+struct PyInterpreterScaling
+{
+    PyInterpreterScaling(unsigned int min = DEFAULT_POOL_SIZE,
+                         unsigned int max = DEFAULT_POOL_SIZE):
+        min_size(min),
+        max_size(max),
+        grow_wait_ns(DEFAULT_GROW_WAIT_NS),
+        grow_waiters(DEFAULT_GROW_WAITERS),
+        idle_ms(DEFAULT_IDLE_MS),
+        period_ms(DEFAULT_SCALING_PERIOD_MS),
+        progressive(false),
+        on_ready(NULL),
+        ready_arg(NULL) {}
+
+    unsigned int min_size;
+    unsigned int max_size;
+    unsigned int grow_wait_ns;
+    unsigned int grow_waiters;
+    unsigned int idle_ms;
+    unsigned int period_ms;
+    bool progressive;
+    PyInterpreterReadyFn on_ready;
+    void* ready_arg;
+    PyInterpreterRecycling recycling;
+};
+
+/*
+  Snapshot of the state of the pool and of the scaling counters
+*/
+struct PyInterpreterPoolStats
+{
+    unsigned int size;
+    unsigned int min_size;
+    unsigned int max_size;
+    unsigned int busy;
+    unsigned int waiting;
+    unsigned long waits;
+    unsigned long wait_ns;
+    unsigned long timeouts;
+    unsigned long grown;
+    unsigned long retired;
+    unsigned long recycled;
+    unsigned long expired;
+};
+
+/*
+  Counters of the pool with the histograms of the timings recorded by
+  its clients, in nanoseconds: waiting for an interpreter in alloc,
+  acquiring the GIL, making the arguments and running the handler
+*/
+struct PyInterpreterPoolMetrics
+{
+    PyInterpreterPoolStats pool;
+    unsigned int free;
+    PyHistogram histograms[METRICS_NO];
+};
+
+/*
+  A data handler: the module and the name of the callable in it. The
+  pool resolves all the handlers of its registry in each interpreter,
+  a handler is then taken by its index in the registry, its id.
+*/
+typedef std::pair<std::string, std::string> PyHandlerName;
+typedef std::vector<PyHandlerName> PyHandlerNames;
+
+/*
+  Called with an interpreter made current before it is ended, so that
+  the objects kept in it by the client are released
+*/
+typedef void (*PyInterpreterRetireFn)(void* arg, PyInterpreterLease lease);
+
+/*
+  One entry of the interpreter table. It keeps all the pool needs to
+  know about an interpreter in two cache lines. The first one has what
+  every call reads or writes: the thread state, the default data
+  handler, the booking state and the links of the free list threaded
+  through the table, the calls made by the current interpreter and the
+  deadline of the call going on, if any. The version is the one of
+  the code its handlers were made from. The second line has the rest:
+  the other handlers resolved in it, the heap size once built to tell
+  when it is to be recycled, and the thread running a watched call.
+  The deadline and that thread are written under the GIL of the
+  interpreter.
+*/
+struct PyInterpreterSlot
+{
+    PyInterpreterSlot():
+        interpreter(NULL),
+        handler(NULL),
+        released_ms(0),
+        calls(0),
+        deadline_ns(NO_DEADLINE),
+        state(SLOT_EMPTY),
+        shard(NO_SHARD),
+        prev(NO_LEASE),
+        next(NO_LEASE),
+        version(0),
+        recycle(false),
+        heap_base(0),
+        call_thread(0),
+        expired(false) {}
+
+    // hot
+    PyInterpreterThreadStatePtr interpreter;
+    PyDataHandlerPtr handler;
+    unsigned long released_ms;
+    unsigned long calls;
+    unsigned long deadline_ns;
+    PyInterpreterSlotState state;
+    unsigned int shard;
+    PyInterpreterLease prev;
+    PyInterpreterLease next;
+    unsigned int version;
+    bool recycle;
+
+    // cold
+    std::vector<PyDataHandlerPtr> handlers __attribute__((aligned(CACHE_LINE_SIZE)));
+    long heap_base;
+    unsigned long call_thread;
+    bool expired;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/*
+  A shard owns a part of the free interpreters with its own lock so
+  that callers running on different cores do not meet on one mutex.
+*/
+struct PyInterpreterShard
+{
+    PyInterpreterShard():
+        free_head(NO_LEASE),
+        free_tail(NO_LEASE),
+        free_count(0) {}
+
+    pthread_mutex_t mutex;
+    PyInterpreterLease free_head;
+    PyInterpreterLease free_tail;
+    unsigned int free_count;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+typedef void (*PyInterpreterResumeFn)(void* arg, PyInterpreterLease lease);
+
+/*
+  A client waiting for a free interpreter. It parks on its own
+  condition in the FIFO queue of the pool until a releasing client
+  hands a lease directly to it. An asynchronous client does not park,
+  the releasing client calls its resume function instead.
+*/
+struct PyInterpreterWaiter
+{
+    PyInterpreterWaiter():
+        resume(NULL),
+        arg(NULL),
+        lease(NO_LEASE),
+        prev(NULL),
+        next(NULL) {}
+
+    pthread_cond_t cond;
+    PyInterpreterResumeFn resume;
+    void* arg;
+    PyInterpreterLease lease;
+    PyInterpreterWaiter* prev;
+    PyInterpreterWaiter* next;
+};
+
+/*
+  Awaiting a lease in a coroutine, see py_coroutine.h
+*/
+struct PyInterpreterAwaitable;
 
 /*
   The calss manages a pool of python interpreters. The pool contains a
-  queue of initialized interpreter conxtexts. A client may take an
-  interpreter from free ones, use it and then return it to the free
-  pool. Booked interpreters are stored in a special queue. The context
-  of the interpreter contains thread state and the handle open
-  for this interpreter in this thread state.
+  table of initialized interpreter conxtexts, one slot each. A client
+  may take an interpreter from free ones getting a lease, the index of
+  the slot, use it and then return the lease to the pool. Free slots
+  are linked in a list threaded through the table so that both booking
+  and releasing are O(1). The context of the interpreter contains
+  thread state and the handle open for this interpreter in this
+  thread state.
+
+  In sharded mode the free list is split in several shards, one per
+  core by default. A client books from the shard of the core it runs
+  on and steals from the neighbours only when it is empty, the lease
+  is released to the shard of the releasing core. Only the clients
+  finding all shards empty meet on the pool mutex to wait.
+
+  Waiting clients are served in order: each one is queued and the
+  releasing client hands its interpreter to the oldest of them instead
+  of waking all of them up.
+
+  Coroutines do not wait at all: the asynchronous waiter is queued
+  the same way and resumed by the releasing client.
+
+  The reuse policy decides which free interpreter is booked. The warm
+  ones, LIFO or the last one used by the calling thread, have their
+  heap and handler code still in the cpu caches.
+
+  An elastic pool has a table of max_size slots with min_size of them
+  holding interpreters at start. A background thread adds interpreters
+  to empty slots while clients wait too long and ends the ones staying
+  free too long. Started progressively the same thread makes the
+  interpreters of the lower bound first.
+
+  The handler module and the modules it imports are read and compiled
+  once, by the first interpreter, the others run them from memory.
+
+  A registry of handlers, from one or more modules, may be given at
+  start. Every interpreter has all of them resolved so that one pool
+  serves many endpoints, each one calling its handler by id.
+
+  The handlers are reloaded from the current files while the pool
+  serves: the free interpreters are rebuilt one at a time, the busy
+  ones once released, so that the calls going on end on the code they
+  started with and at most one interpreter is out of service. The new
+  code is compiled once. Each interpreter tells the version of the
+  code it runs. An interpreter still busy at the timeout of the reload
+  fails it by a PyTimeoutError, it keeps the former code until the
+  next reload.
+
+  An interpreter to be recycled is not put back when released but
+  quarantined, out of the free lists. A background thread ends it and
+  makes a new one in its slot which then goes back to service. The
+  holder of a lease may ask for its interpreter to be recycled, the
+  pool guard does so when a call fails as told by the recycling. An
+  interpreter kept by its client is recycled once released.
+
+  The footprint of the pool tells what each interpreter holds, by type
+  and by module, and what is held in all of them. Each free one is
+  booked for the walk of its objects, the busy ones once released, up
+  to a timeout as for the reload.
+
+  A call may have a deadline. A watchdog thread, started by the first
+  one, sleeps until the earliest deadline. It raises SystemExit in the
+  thread running a call past its deadline and again at each period
+  until the call ends. The handler is then
+  unwound at its next bytecode, not in a blocking C function. The pool
+  guard reports such a call by a PyTimeoutError, the interpreter goes
+  back or is recycled on error as told by the recycling.
 */
 class PyInterpreterPool
 {
 public:
     // functions
-    PyInterpreterPool(int n = DEFAULT_POOL_SIZE);
+    PyInterpreterPool(int n = DEFAULT_POOL_SIZE,
+                      unsigned int shards_no = DEFAULT_POOL_SHARDS,
+                      PyInterpreterReusePolicy policy = REUSE_FIFO);
+    PyInterpreterPool(const PyInterpreterScaling& scaling,
+                      unsigned int shards_no = DEFAULT_POOL_SHARDS,
+                      PyInterpreterReusePolicy policy = REUSE_FIFO);
     ~PyInterpreterPool();
     void start(const std::string& mn, const std::string& dhn);
+    void start(const PyHandlerNames& names);
+    void on_retire(PyInterpreterRetireFn fn, void* arg);
+    void preload_modules(bool on);
     size_t size() const;
-    PyInterpreterThreadStatePtr alloc(unsigned int max_timeout_ns = MAX_TIMEOUT_NS);
-    PyInterpreterThreadStatePtr alloc(PyDataHandlerPtr& handler, unsigned int max_timeout_ns = MAX_TIMEOUT_NS);
-    void dealloc(PyInterpreterThreadStatePtr interpreter);
-    PyDataHandlerPtr get_handler(PyInterpreterThreadStatePtr interpreter);
+    size_t capacity() const;
+    size_t handlers() const;
+    PyInterpreterPoolStats stats() const;
+    PyInterpreterPoolMetrics metrics() const;
+    void record(PyMetric m, unsigned long ns);
+    unsigned int shards() const;
+    PyInterpreterReusePolicy reuse_policy() const;
+    PyInterpreterLease alloc(unsigned int max_timeout_ns = MAX_TIMEOUT_NS);
+    void dealloc(PyInterpreterLease lease);
+    bool alloc_async(PyInterpreterWaiter& w);
+    PyInterpreterAwaitable acquire();
+    PyInterpreterThreadStatePtr get_interpreter(PyInterpreterLease lease) const;
+    PyDataHandlerPtr get_handler(PyInterpreterLease lease) const;
+    PyDataHandlerPtr get_handler(PyInterpreterLease lease, PyHandlerId id) const;
+    void reload(unsigned long timeout_ns = DEFAULT_RELOAD_TIMEOUT_NS);
+    unsigned int version() const;
+    unsigned int get_version(PyInterpreterLease lease) const;
+    PyPoolFootprint footprint(unsigned long timeout_ns = DEFAULT_RELOAD_TIMEOUT_NS);
+    void recycle(PyInterpreterLease lease);
+    void called(PyInterpreterLease lease);
+    void failed(PyInterpreterLease lease);
+    void watch(PyInterpreterLease lease, unsigned long deadline_ns);
+    bool unwatch(PyInterpreterLease lease);
 
 private:
     // types
-    typedef std::deque<PyInterpreterThreadStatePtr> PyInterpreterThreadStatePtrQueue;
-    typedef PyInterpreterThreadStatePtrQueue::iterator PyInterpreterThreadStatePtrQueueIterator;
-    typedef PyInterpreterThreadStatePtrQueue::const_iterator PyInterpreterThreadStatePtrQueueConstIterator;
-    typedef std::vector<PyDataHandlerPtr> PyDataHandlers;
-    typedef std::map<PyInterpreterThreadStatePtr, PyDataHandlerPtr> PyInterpreterThreadStatePtrToDataHandlerPtrMap;
-    typedef PyInterpreterThreadStatePtrToDataHandlerPtrMap::iterator PyInterpreterThreadStatePtrToDataHandlerPtrMapIterator;
-    typedef PyInterpreterThreadStatePtrToDataHandlerPtrMap::const_iterator PyInterpreterThreadStatePtrToDataHandlerPtrMapConstIterator;
+    typedef std::vector<PyInterpreterSlot, AlignedAllocator<PyInterpreterSlot> > PyInterpreterSlots;
+    typedef std::vector<PyInterpreterShard, AlignedAllocator<PyInterpreterShard> > PyInterpreterShards;
+    typedef std::vector<std::pair<PyInterpreterLease, unsigned long> > PyExpiredCalls;
     // members
     static unsigned int global_pools_no;
     const unsigned int pool_size;
+    const PyInterpreterScaling scaling;
+    const PyInterpreterReusePolicy policy;
     const PthreadMutexPtr mutex;
-    const PthreadCondPtr not_empty_free_cond;
-    std::string module_name;
-    std::string data_handler_name;
-    PyInterpreterThreadStatePtrQueue free;
-    PyInterpreterThreadStatePtrQueue busy;
-    PyInterpreterThreadStatePtrToDataHandlerPtrMap handler;
+    pthread_condattr_t waiter_cond_attr;
+    pthread_key_t last_lease_key;
+    PyHandlerNames handler_names;
+    bool preload;
+    PyPreloadedModules preloaded;
+    PyInterpreterSlots slots;
+    mutable PyInterpreterShards shard;
+    unsigned int busy_count;
+    unsigned int waiting_count;
+    PyInterpreterWaiter* waiter_head;
+    PyInterpreterWaiter* waiter_tail;
+    unsigned int handlers_count;
+    unsigned int live_count;
+    unsigned long waits_count;
+    unsigned long wait_ns;
+    unsigned long timeouts_count;
+    unsigned long grown_count;
+    unsigned long retired_count;
+    unsigned long recycled_count;
+    unsigned long expired_count;
+    unsigned int code_version;
+    PyInterpreterRetireFn retire_fn;
+    void* retire_arg;
+    PyMetrics recorder;
+    pthread_t scaler;
+    pthread_mutex_t scaler_mutex;
+    pthread_mutex_t reload_mutex;
+    pthread_cond_t scaler_cond;
+    bool scaler_running;
+    bool scaler_stop;
+    pthread_t recycler;
+    pthread_mutex_t recycler_mutex;
+    pthread_cond_t recycler_cond;
+    std::vector<PyInterpreterLease> quarantined;
+    bool recycler_running;
+    bool recycler_stop;
+    pthread_t watchdog;
+    pthread_mutex_t watchdog_mutex;
+    pthread_cond_t watchdog_cond;
+    pthread_mutex_t expire_mutex;
+    unsigned long watchdog_wake_ns;
+    bool watchdog_running;
+    bool watchdog_stop;
     // functions
     PthreadMutexPtr make_mutex() const throw();
-    PthreadCondPtr make_cond() const throw();
+    unsigned int make_shards_no(unsigned int n) const throw();
+    unsigned int home_shard() const throw();
     void init_mt_layer();
     void init_python();
     void init_interpreters();
+    void init();
+    PyInterpreterThreadStatePtr new_interpreter();
+    void end_interpreter(PyInterpreterLease lease);
     void clean_interpreters();
+    void start_scaler();
+    void stop_scaler();
+    static void* scale(void* arg);
+    void grow(unsigned int n, bool scaled);
+    void ready();
+    void retire_idle();
+    void quarantine(PyInterpreterLease lease);
+    void stop_recycler();
+    static void* recycle_quarantined(void* arg);
+    void renew(PyInterpreterLease lease);
+    void check_heap(PyInterpreterLease lease);
+    void stop_watchdog();
+    static void* watch_calls(void* arg);
+    unsigned long find_expired(PyExpiredCalls& expired) const;
+    void expire_call(PyInterpreterLease lease, unsigned long deadline_ns);
+    void put_back(PyInterpreterLease lease);
     void clean_mt_layer();
     void clean_python();
     void invariant() const;
-    void build_handlers(const std::string& mn,
-                        const std::string& dhn);
-    void build_handler(PyInterpreterThreadStatePtr interpreter,
-                       const std::string& mn,
-                       const std::string& dhn);
-    PyInterpreterThreadStatePtr move(PyInterpreterThreadStatePtr interpreter,
-                                     PyInterpreterThreadStatePtrQueue& src,
-                                     PyInterpreterThreadStatePtrQueue& des);
+    void build_handlers();
+    void build_handler(PyInterpreterLease lease);
+    void release_handlers(PyInterpreterSlot& s);
+    void rebuild_handler(PyInterpreterLease lease, PyPreloadedModules& former);
+    void wait_busy(unsigned int busy, unsigned long deadline_ns);
+    void retire(PyInterpreterLease lease);
+    void push_free(PyInterpreterShard& s, PyInterpreterLease lease);
+    PyInterpreterLease pop_free(PyInterpreterShard& s);
+    void unlink_free(PyInterpreterShard& s, PyInterpreterLease lease);
+    PyInterpreterLease take_free(unsigned int from);
+    PyInterpreterLease take_last_used();
+    bool take(PyInterpreterLease lease);
+    PyInterpreterLease wait_free(unsigned int from, unsigned int max_timeout_ns);
+    void book(PyInterpreterLease lease);
+    void push_waiter(PyInterpreterWaiter& w);
+    void unlink_waiter(PyInterpreterWaiter& w);
+    PyInterpreterWaiter* hand_off(PyInterpreterLease lease);
+    static void resume(PyInterpreterWaiter* w);
 };
 
+/*
+  The slot of a lease does not change while the lease is held so it can
+  be read without the pool mutex.
+*/
+inline PyInterpreterThreadStatePtr
+PyInterpreterPool::get_interpreter(PyInterpreterLease lease) const
+{
+    return slots[lease].interpreter;
+}
+
+inline PyDataHandlerPtr
+PyInterpreterPool::get_handler(PyInterpreterLease lease) const
+{
+    return slots[lease].handler;
+}
+
+inline unsigned int
+PyInterpreterPool::get_version(PyInterpreterLease lease) const
+{
+    return slots[lease].version;
+}
+
+/*
+  Counts a call that went well, with the interpreter of the lease
+  current. Only the holder of the lease writes its slot.
+*/
+inline void PyInterpreterPool::called(PyInterpreterLease lease)
+{
+    const PyInterpreterRecycling& r = scaling.recycling;
+    PyInterpreterSlot& s = slots[lease];
+    s.calls++;
+    if (r.max_calls && s.calls >= r.max_calls) {
+        recycle(lease);
+    } else if (r.max_heap_growth && s.calls % r.heap_check_calls == 0) {
+        check_heap(lease);
+    }
+}
+
+inline void PyInterpreterPool::record(PyMetric m, unsigned long ns)
+{
+    recorder.record(m, ns);
+}
+
 #endif /* _PY_INTERPRETER_POOL_H_ */
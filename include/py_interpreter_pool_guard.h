@@ -3,7 +3,7 @@
 
 #include "config.h"
 
-#include <python2.7/Python.h>
+#include "py_python.h"
 #include <pthread.h>
 
 #include "lock_guard.h"
@@ -15,52 +15,144 @@
 // The type to be used like a context manager, RAII style. It allocates a new
 // interpreter and upon destruction (in a context) it is returned to
 // the pool. The data of the context may used freely in the current block.
+// With a GIL per interpreter it is the GIL of the allocated interpreter
+// which is held in the block, so the blocks run in parallel. A call
+// given a timeout is cancelled by the watchdog of the pool at its
+// deadline, a PyTimeoutError is then thrown.
 //
 struct PyInterpreterPoolGuard
 {
-    PyInterpreterPoolGuard(PyInterpreterPool& p): pool(p) {
+    PyInterpreterPoolGuard(PyInterpreterPool& p):
+        pool(p), owns_lease(true), timeout_ns(0), kept_state(NULL) {
         FRAME;
 
-        interpreter = pool.alloc(handler);
-        INFO("Allocated interpreter: " + lexical_cast<string>(interpreter));
+        lease = pool.alloc();
+        INFO("Allocated interpreter: %#lx", pool.get_interpreter(lease));
+        enter();
+    }
+
+    // Enters the interpreter of a lease held by the caller, which keeps it
+    PyInterpreterPoolGuard(PyInterpreterPool& p, PyInterpreterLease l):
+        pool(p), lease(l), owns_lease(false), timeout_ns(0), kept_state(NULL) {
+        FRAME;
+
+        enter();
+    }
+
+    // Same with a thread state of the caller in that interpreter, kept by
+    // it from one guard to the next. Only a GIL per interpreter needs it.
+    PyInterpreterPoolGuard(PyInterpreterPool& p, PyInterpreterLease l, PyThreadStatePtr ts):
+        pool(p), lease(l), owns_lease(false), timeout_ns(0), kept_state(ts) {
+        FRAME;
+
+        enter();
+    }
+
+    void enter() {
+        FRAME;
+
+        interpreter = pool.get_interpreter(lease);
+        handler = pool.get_handler(lease);
+        unsigned long started_ns = PyMetrics_Clock();
+#ifdef PY_OWN_GIL
+        // the GIL of the interpreter, with a thread state of this thread
+        root = kept_state ? kept_state
+                          : PyThreadState_New(PyThreadState_GetInterpreter(interpreter));
+        INFO("Interpreter GIL acquire");
+        PyEval_RestoreThread(root);
+        INFO("Interpreter GIL acquired");
+#else
         INFO("GIL acquire");
         gstate = PyGILState_Ensure();
         INFO("GIL acquired");
         root = PyThreadState_Get();
-        INFO("Saved main thread state: " + lexical_cast<string>(root));
+        INFO("Saved main thread state: %#lx", root);
         root = PyThreadState_Swap(interpreter);
-        INFO("Python thread swap done to: " + lexical_cast<string>(interpreter));
+        INFO("Python thread swap done to: %#lx", interpreter);
+#endif
+        pool.record(METRIC_GIL_ACQUIRE, PyMetrics_Clock() - started_ns);
     }
 
     ~PyInterpreterPoolGuard() {
         FRAME;
 
+#ifdef PY_OWN_GIL
+        if (kept_state) {
+            PyEval_SaveThread();
+        } else {
+            PyThreadState_Clear(root);
+            PyThreadState_DeleteCurrent();
+        }
+        INFO("Interpreter GIL released");
+        if (owns_lease) {
+            pool.dealloc(lease);
+            INFO("Deallocated interpreter done: %#lx", interpreter);
+        }
+#else
         PyThreadState_Swap(root);
-        INFO("Python thread swap done to main thread state: " + lexical_cast<string>(root));
-        pool.dealloc(interpreter);
-        INFO("Deallocated interpreter done: " + lexical_cast<string>(interpreter));
+        INFO("Python thread swap done to main thread state: %#lx", root);
         INFO("GIL release");
         PyGILState_Release(gstate);
         INFO("GIL released");
+        // the waiters resumed by the release must not run under the GIL
+        if (owns_lease) {
+            pool.dealloc(lease);
+            INFO("Deallocated interpreter done: %#lx", interpreter);
+        }
+#endif
     }
 
     PyObject* operator()(PyObject* args) {
+        return call(handler, args);
+    }
+
+    // Calls the handler of the pool registry with the given id
+    PyObject* operator()(PyHandlerId id, PyObject* args) {
+        return call(id == DEFAULT_HANDLER ? handler : pool.get_handler(lease, id), args);
+    }
+
+    // Timeout of the calls to come, none if zero
+    void set_timeout(unsigned long ns) {
+        timeout_ns = ns;
+    }
+
+    PyObject* call(PyDataHandlerPtr h, PyObject* args) {
         FRAME;
 
-        INFO("Calling handler: " + lexical_cast<string>(handler));
-        PyObject* result = PyObject_CallObject(handler, args);
+        INFO("Calling handler: %#lx", h);
+        unsigned long started_ns = PyMetrics_Clock();
+        if (timeout_ns) {
+            pool.watch(lease, started_ns + timeout_ns);
+        }
+        PyObject* result = PyObject_CallObject(h, args);
+        bool expired = timeout_ns && pool.unwatch(lease);
+        pool.record(METRIC_HANDLER, PyMetrics_Clock() - started_ns);
         if (!result || PyErr_Occurred()) {
+            // the interpreter may be recycled for that error
+            pool.failed(lease);
             std::string error_message("PyObject_CallObject");
             Py_Error(error_message);
+            if (expired) {
+                throw PyTimeoutError(error_info("Handler timed out after " +
+                                                lexical_cast<std::string>(timeout_ns) +
+                                                " ns: " + error_message));
+            }
+
             throw std::runtime_error(error_info(error_message));
         }
 
+        pool.called(lease);
+
         return result;
     }
 
     PyInterpreterPool& pool;
+    PyInterpreterLease lease;
+    bool owns_lease;
+    unsigned long timeout_ns;
     PyInterpreterThreadStatePtr interpreter;
     PyDataHandlerPtr handler;
+    PyThreadStatePtr kept_state;
     PyThreadStatePtr root;
     PyGILState_STATE gstate;
 };
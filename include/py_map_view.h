@@ -0,0 +1,35 @@
+#ifndef _PY_MAP_VIEW_H_
+#define _PY_MAP_VIEW_H_
+
+#include <map>
+#include <string>
+
+#include "config.h"
+
+#include "py_python.h"
+
+typedef std::map<std::string, std::string> MapString2String;
+typedef std::multimap<std::string, std::string> MultimapString2String;
+typedef MapString2String::const_iterator MapString2StringConstIterator;
+typedef MultimapString2String::const_iterator MultimapString2StringConstIterator;
+
+/*
+ * Read only python mapping over a map of the caller. Nothing is copied
+ * when it is made, a value becomes a python string only when the
+ * handler reads it. A multimap is seen as a dict holding the last
+ * value of each key, the method getall() returns all of them. The view
+ * must be detached before the map is gone, later use of it raises
+ * RuntimeError in python. A view no one else refers to may be attached
+ * again to another map.
+ *
+ * The type is created in the current interpreter, each interpreter
+ * needs its own one.
+ */
+PyObject* PyMapView_NewType();
+PyObject* PyMapView_FromMap(PyObject* type, const MapString2String* map);
+PyObject* PyMapView_FromMultimap(PyObject* type, const MultimapString2String* multimap);
+void PyMapView_AttachMap(PyObject* view, const MapString2String* map);
+void PyMapView_AttachMultimap(PyObject* view, const MultimapString2String* multimap);
+void PyMapView_Detach(PyObject* view);
+
+#endif /* _PY_MAP_VIEW_H_ */
@@ -0,0 +1,102 @@
+#ifndef _PY_METRICS_H_
+#define _PY_METRICS_H_
+
+#include <vector>
+
+#include "config.h"
+
+#include <pthread.h>
+#include <time.h>
+
+#define METRICS_SUB_BUCKET_BITS 4
+#define METRICS_SUB_BUCKETS (1u << METRICS_SUB_BUCKET_BITS)
+#define METRICS_MAX_EXPONENT 43
+#define METRICS_BUCKETS ((METRICS_MAX_EXPONENT - METRICS_SUB_BUCKET_BITS + 2) * METRICS_SUB_BUCKETS)
+#define METRICS_CACHE_SIZE 4
+
+/*
+  What is timed, in nanoseconds
+*/
+enum PyMetric
+{
+    METRIC_ALLOC_WAIT,
+    METRIC_GIL_ACQUIRE,
+    METRIC_MARSHAL,
+    METRIC_HANDLER,
+    METRICS_NO
+};
+
+/*
+  Time on the monotonic clock
+*/
+inline unsigned long PyMetrics_Clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long)ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+/*
+  Histogram in the HDR style: the values below 16 have a bucket each,
+  every power of two above is split in 16 linear buckets so that the
+  error is about 6% at any scale. Values beyond 2^44 ns are counted in
+  the last bucket.
+*/
+struct PyHistogram
+{
+    PyHistogram(): count(0), sum(0), max(0), buckets(METRICS_BUCKETS, 0) {}
+
+    static unsigned int bucket(unsigned long value);
+    static unsigned long bucket_value(unsigned int bucket);
+    void record(unsigned long value);
+    void add(const PyHistogram& other);
+    unsigned long percentile(double p) const;
+    double mean() const;
+
+    unsigned long count;
+    unsigned long sum;
+    unsigned long max;
+    std::vector<unsigned long> buckets;
+};
+
+/*
+  Histograms of one thread, written by it only
+*/
+struct PyMetricsBlock
+{
+    PyMetricsBlock(): next(NULL) {}
+
+    pthread_t thread;
+    PyMetricsBlock* next;
+    unsigned long count[METRICS_NO];
+    unsigned long sum[METRICS_NO];
+    unsigned long max[METRICS_NO];
+    unsigned long buckets[METRICS_NO][METRICS_BUCKETS];
+} __attribute__((aligned(64)));
+
+/*
+  Recorder of the timings. Each thread records to its own block with
+  plain relaxed stores, no lock and no shared cache line. The blocks
+  are linked in a lock free list, a snapshot adds them up. A block
+  outlives its thread, the counts are kept until the recorder is gone.
+*/
+class PyMetrics
+{
+public:
+    PyMetrics();
+    ~PyMetrics();
+    void record(PyMetric m, unsigned long ns);
+    void snapshot(PyHistogram* histograms) const;
+
+private:
+    // members
+    static unsigned long instances_no;
+    const unsigned long id;
+    PyMetricsBlock* blocks;
+    // functions
+    PyMetricsBlock* block();
+    PyMetricsBlock* find_block(pthread_t thread) const;
+};
+
+#endif /* _PY_METRICS_H_ */
@@ -0,0 +1,44 @@
+#ifndef _PY_PRELOAD_H_
+#define _PY_PRELOAD_H_
+
+#include <map>
+#include <string>
+
+#include "config.h"
+
+#include "py_python.h"
+
+/*
+ * A python module compiled once and kept marshalled, with the file it
+ * was compiled from
+ */
+struct PyPreloadedModule
+{
+    PyPreloadedModule(): package(false) {}
+
+    std::string code;
+    std::string file;
+    bool package;
+};
+
+typedef std::map<std::string, PyPreloadedModule> PyPreloadedModules;
+
+/*
+ * Modules imported by one interpreter, compiled once and served to the
+ * others from memory. The names of the modules loaded in the current
+ * interpreter are taken before the import of the handler, the modules
+ * of source files loaded by it are collected after. An importer put
+ * first on sys.meta_path of another interpreter runs them from their
+ * code, the filesystem is not looked at. All of them need the GIL of
+ * the current interpreter and return false with a python error set on
+ * failure. Unloading drops the modules from sys.modules and the
+ * importers from sys.meta_path so that the next import runs new code.
+ * The importer itself is compiled once as well and kept as a module of
+ * each interpreter.
+ */
+PyObject* PyPreload_Loaded();
+bool PyPreload_Collect(PyObject* loaded, PyPreloadedModules& modules);
+bool PyPreload_Install(const PyPreloadedModules& modules);
+bool PyPreload_Unload(const PyPreloadedModules& modules);
+
+#endif /* _PY_PRELOAD_H_ */
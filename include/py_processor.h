@@ -2,12 +2,14 @@
 #define __PY_PROCESSOR_H_
 
 #include <map>
+#include <memory>
 #include <pthread.h>
 #include <string>
+#include <vector>
 
 #include "config.h"
 
-#include <python2.7/Python.h>
+#include "py_python.h"
 
 #include "strutl.h"
 #include "lexical_cast.h"
@@ -15,14 +17,139 @@
 #include "py_tools.h"
 #include "py_interpreter_pool.h"
 #include "py_interpreter_pool_guard.h"
+#include "py_map_view.h"
 #include "trace.h"
 
 #define PYTHON_DATA_HANDLER "process_data_logic"
 
-typedef std::map<std::string, std::string> MapString2String;
-typedef std::multimap<std::string, std::string> MultimapString2String;
-typedef MapString2String::const_iterator MapString2StringConstIterator;
-typedef MultimapString2String::const_iterator MultimapString2StringConstIterator;
+/*
+ * Where the handlers run: in the interpreters of this process, sharing
+ * its GIL, or in worker processes, each one with its own python, made
+ * by itself or inherited from a zygote process
+ */
+enum PyProcessorBackend
+{
+    BACKEND_INTERPRETERS,
+    BACKEND_WORKERS,
+    BACKEND_ZYGOTE
+};
+
+/*
+ * How the maps are passed to the handler: copied to new dicts or
+ * wrapped in views reading them in place, for the call only
+ */
+enum PyProcessorMarshalling
+{
+    MARSHAL_DICT,
+    MARSHAL_VIEW
+};
+
+/*
+ * One call of the handler in a batch or submitted, cancelled past its
+ * timeout if it has one
+ */
+struct PyProcessorRequest
+{
+    PyProcessorRequest(): timeout_ns(0) {}
+    PyProcessorRequest(const std::string& i,
+                       const MapString2String& m,
+                       const MultimapString2String& p,
+                       unsigned long t = 0):
+        identifier(i), messages(m), parameters(p), timeout_ns(t) {}
+
+    std::string identifier;
+    MapString2String messages;
+    MultimapString2String parameters;
+    unsigned long timeout_ns;
+};
+
+enum PyProcessorStatus
+{
+    PROCESS_OK,
+    PROCESS_ERROR,
+    PROCESS_REJECTED
+};
+
+/*
+ * Outcome of one call in a batch: the content returned by the handler
+ * or the error message when it failed
+ */
+struct PyProcessorResult
+{
+    PyProcessorResult(): status(PROCESS_OK) {}
+
+    PyProcessorStatus status;
+    std::string content;
+};
+
+#define MAX_INTERNED_KEYS 4096
+
+typedef std::map<std::string, PyObject*> PyInternedKeys;
+
+/*
+ * Python objects the processor keeps in each interpreter of its pool,
+ * used only by the holder of its lease: the argument tuple and the
+ * containers of the maps refilled by every call, the keys of the maps
+ * seen so far, interned, and the type of the map views.
+ */
+struct PyProcessorSlot
+{
+    PyProcessorSlot():
+        argv(NULL),
+        messages(NULL),
+        parameters(NULL),
+        map_view_type(NULL) {}
+
+    PyObject* argv;
+    PyObject* messages;
+    PyObject* parameters;
+    PyObject* map_view_type;
+    PyInternedKeys message_keys;
+    PyInternedKeys parameter_keys;
+};
+
+typedef std::vector<PyProcessorSlot> PyProcessorSlots;
+typedef std::vector<PyProcessorRequest> PyProcessorRequests;
+typedef std::vector<PyProcessorResult> PyProcessorResults;
+
+#define DEFAULT_SUBMIT_QUEUE_SIZE 1024
+
+/*
+ * Reader of the result of a call, given the bytes of the python object
+ * while the interpreter is still held. They are not copied and not
+ * valid after it returns.
+ */
+typedef void (*PyProcessorReader)(const char* data, size_t size, void* arg);
+
+/*
+ * Completion of a submitted call, run by the executor thread
+ */
+typedef void (*PyProcessorCallback)(const PyProcessorResult& result, void* arg);
+
+struct PyProcessorTask;
+
+/*
+ * Handle of the result of a submitted call. Copies share the result
+ * which is kept until the last of them is gone.
+ */
+class PyProcessorFuture
+{
+  public:
+    explicit PyProcessorFuture(PyProcessorTask* t = NULL);
+    PyProcessorFuture(const PyProcessorFuture& other);
+    PyProcessorFuture& operator=(const PyProcessorFuture& other);
+    ~PyProcessorFuture();
+    bool valid() const;
+    bool ready() const;
+    const PyProcessorResult& get() const;
+
+  private:
+    PyProcessorTask* task;
+};
+
+class PyWorkerPool;
+class PySubmitQueue;
+struct PyProcessAwaitable;
 
 /* 
  * Python backend processor
@@ -30,17 +157,129 @@ typedef MultimapString2String::const_iterator MultimapString2StringConstIterator
 class PyProcessor
 {
   public:
-    PyProcessor(const std::string& processor_module_name);
+    PyProcessor(const std::string& processor_module_name,
+                int pool_size = DEFAULT_POOL_SIZE,
+                unsigned int shards_no = DEFAULT_POOL_SHARDS,
+                PyInterpreterReusePolicy policy = REUSE_FIFO,
+                PyProcessorMarshalling marshalling = MARSHAL_DICT);
+    PyProcessor(const std::string& processor_module_name,
+                const PyInterpreterScaling& scaling,
+                unsigned int shards_no = DEFAULT_POOL_SHARDS,
+                PyInterpreterReusePolicy policy = REUSE_FIFO,
+                PyProcessorMarshalling marshalling = MARSHAL_DICT);
+    PyProcessor(const PyHandlerNames& handlers,
+                const PyInterpreterScaling& scaling,
+                unsigned int shards_no = DEFAULT_POOL_SHARDS,
+                PyInterpreterReusePolicy policy = REUSE_FIFO,
+                PyProcessorMarshalling marshalling = MARSHAL_DICT);
+    PyProcessor(const std::string& processor_module_name,
+                PyProcessorBackend backend,
+                unsigned int workers_no,
+                unsigned int interpreters_no = 1,
+                const PyProcessorRequests& warmup = PyProcessorRequests());
     ~PyProcessor();
     std::string Process(const std::string& identifier,
                         MapString2String& messages,
-                        MultimapString2String& parameters);
+                        MultimapString2String& parameters,
+                        unsigned long timeout_ns = 0);
+    void Process(const std::string& identifier,
+                 const MapString2String& messages,
+                 const MultimapString2String& parameters,
+                 std::string& output,
+                 unsigned long timeout_ns = 0);
+    std::string Process(PyHandlerId handler,
+                        const std::string& identifier,
+                        const MapString2String& messages,
+                        const MultimapString2String& parameters,
+                        unsigned long timeout_ns = 0);
+    void Process(PyHandlerId handler,
+                 const std::string& identifier,
+                 const MapString2String& messages,
+                 const MultimapString2String& parameters,
+                 std::string& output,
+                 unsigned long timeout_ns = 0);
+    void Process(const std::string& identifier,
+                 const MapString2String& messages,
+                 const MultimapString2String& parameters,
+                 PyProcessorReader reader,
+                 void* arg,
+                 unsigned long timeout_ns = 0);
+    void Process(const std::string& identifier,
+                 const MapString2String& messages,
+                 const MultimapString2String& parameters,
+                 MapString2String& output,
+                 unsigned long timeout_ns = 0);
+    void Process(const std::string& identifier,
+                 const MapString2String& messages,
+                 const MultimapString2String& parameters,
+                 std::vector<std::string>& output,
+                 unsigned long timeout_ns = 0);
+    PyProcessorResults ProcessBatch(const PyProcessorRequests& requests);
+    void StartExecutors(unsigned int executors_no,
+                        unsigned int queue_size = DEFAULT_SUBMIT_QUEUE_SIZE);
+    PyProcessorFuture Submit(const std::string& identifier,
+                             const MapString2String& messages,
+                             const MultimapString2String& parameters,
+                             unsigned long timeout_ns = 0);
+    void Submit(const std::string& identifier,
+                const MapString2String& messages,
+                const MultimapString2String& parameters,
+                PyProcessorCallback callback,
+                void* arg,
+                unsigned long timeout_ns = 0);
+    PyProcessAwaitable ProcessAsync(const std::string& identifier,
+                                    const MapString2String& messages,
+                                    const MultimapString2String& parameters,
+                                    unsigned long timeout_ns = 0);
+    size_t size() const;
+    PyInterpreterPoolMetrics Metrics() const;
+    void Reload();
+    PyPoolFootprint Footprint();
 
   private:
+    friend struct PyProcessAwaitable;
+    struct PyExecutor
+    {
+        PyProcessor* processor;
+        PyInterpreterLease lease;
+        PyThreadStatePtr state;
+        pthread_t thread;
+    };
+    typedef std::vector<PyExecutor> PyExecutors;
     std::string module_name;
-    PyInterpreterPool ip;
-    PyObject* map2dict(const MapString2String& messages);
-    PyObject* multimap2dict(const MultimapString2String& messages);
+    PyHandlerNames handler_names;
+    PyProcessorMarshalling marshalling;
+    PyProcessorSlots slots;
+    std::UNIQUE_PTR<PyInterpreterPool> ip;
+    std::UNIQUE_PTR<PyWorkerPool> wp;
+    std::UNIQUE_PTR<PySubmitQueue> queue;
+    PyExecutors executors;
+    void start_pool();
+    static void retire_slot(void* arg, PyInterpreterLease lease);
+    void run(PyInterpreterPoolGuard* ipg,
+             const PyProcessorRequest& request,
+             PyProcessorResult& result);
+    void submit(PyProcessorTask* task);
+    void stop_executors();
+    static void* execute(void* arg);
+    void check_handler(PyHandlerId handler) const;
+    std::string call(PyInterpreterPoolGuard& ipg,
+                     const std::string& identifier,
+                     const MapString2String& messages,
+                     const MultimapString2String& parameters,
+                     PyHandlerId handler = DEFAULT_HANDLER);
+    PyObject* invoke(PyInterpreterPoolGuard& ipg,
+                     const std::string& identifier,
+                     const MapString2String& messages,
+                     const MultimapString2String& parameters,
+                     PyHandlerId handler = DEFAULT_HANDLER);
+    bool prepare_arguments(PyProcessorSlot& slot,
+                           const std::string& identifier,
+                           const MapString2String& messages,
+                           const MultimapString2String& parameters);
+    void release_arguments(PyProcessorSlot& slot);
+    void clean_slot(PyProcessorSlot& slot);
+    void clean_slots();
 };
 
 #endif /* __PY_PROCESSOR_H_ */
@@ -0,0 +1,32 @@
+#ifndef _PY_PYTHON_H_
+#define _PY_PYTHON_H_
+
+#include "config.h"
+
+//
+// The python the library is built on: 2.7 with one GIL shared by all
+// interpreters by default, CPython 3.12+ with a GIL per interpreter if
+// PY_OWN_GIL is defined.
+//
+#ifdef PY_OWN_GIL
+#include <Python.h>
+#else
+#include <python2.7/Python.h>
+#endif
+
+#if PY_MAJOR_VERSION >= 3
+
+#if defined(PY_OWN_GIL) && PY_VERSION_HEX < 0x030C0000
+#error "PY_OWN_GIL needs CPython 3.12 or newer"
+#endif
+
+#define PyString_Check PyUnicode_Check
+#define PyString_FromString PyUnicode_FromString
+#define PyString_FromStringAndSize PyUnicode_FromStringAndSize
+#define PyString_AsString PyUnicode_AsUTF8
+#define PyString_InternInPlace PyUnicode_InternInPlace
+#define PyOS_AfterFork PyOS_AfterFork_Child
+
+#endif
+
+#endif /* _PY_PYTHON_H_ */
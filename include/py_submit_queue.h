@@ -0,0 +1,71 @@
+#ifndef _PY_SUBMIT_QUEUE_H_
+#define _PY_SUBMIT_QUEUE_H_
+
+#include <vector>
+
+#include "config.h"
+
+#include <pthread.h>
+
+#include "py_processor.h"
+
+#define EXECUTOR_BATCH_SIZE 64
+
+/*
+ * A submitted call: the request, its result once done and how the
+ * submitter learns about it, by the callback or by waiting on the
+ * condition. The task is shared by the queue and the futures, the last
+ * one releasing it deletes it.
+ */
+struct PyProcessorTask
+{
+    PyProcessorTask(const std::string& identifier,
+                    const MapString2String& messages,
+                    const MultimapString2String& parameters,
+                    PyProcessorCallback cb,
+                    void* a,
+                    unsigned int r,
+                    unsigned long timeout_ns = 0);
+    ~PyProcessorTask();
+    void complete();
+    void wait();
+    void release();
+
+    PyProcessorRequest request;
+    PyProcessorResult result;
+    PyProcessorCallback callback;
+    void* arg;
+    pthread_mutex_t mutex;
+    pthread_cond_t done_cond;
+    bool done;
+    unsigned int refs;
+};
+
+typedef std::vector<PyProcessorTask*> PyProcessorTasks;
+
+/*
+ * Bounded queue of the submitted tasks, a ring shared by any number of
+ * submitters and executors. A submitter never waits: when the queue is
+ * full the task is refused. An executor waits for tasks and takes all
+ * there are, up to a limit, at once.
+ */
+class PySubmitQueue
+{
+  public:
+    PySubmitQueue(unsigned int n);
+    ~PySubmitQueue();
+    bool push(PyProcessorTask* task);
+    bool pop(PyProcessorTasks& tasks, size_t max_tasks);
+    void stop();
+
+  private:
+    const size_t capacity;
+    std::vector<PyProcessorTask*> ring;
+    size_t head;
+    size_t tail;
+    bool stopped;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty_cond;
+};
+
+#endif /* _PY_SUBMIT_QUEUE_H_ */
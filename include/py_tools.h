@@ -3,9 +3,10 @@
 
 #include "config.h"
 
-#include <python2.7/Python.h>
+#include "py_python.h"
 #include <stdarg.h>
 
 void Py_DecrefAll(int count, ...);
+long Py_HeapSize();
 
 #endif
@@ -0,0 +1,157 @@
+#ifndef _PY_WORKER_POOL_H_
+#define _PY_WORKER_POOL_H_
+
+#include <string>
+#include <vector>
+
+#include "config.h"
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "py_processor.h"
+
+#define DEFAULT_WORKERS_NO 4
+#define WORKER_RING_SIZE 65536
+#define WORKER_POLL_NS 100000000
+#define WORKER_RESPONSE_TIMEOUT_NS 60000000000ul
+
+/*
+  Byte ring in shared memory carrying the messages one way. Head and
+  tail count all the bytes ever written and read so the used space is
+  their difference.
+*/
+struct PyWorkerRing
+{
+    size_t head;
+    size_t tail;
+    pthread_cond_t cond;
+    char data[WORKER_RING_SIZE];
+};
+
+/*
+  A channel connects one client at a time with one serving thread of a
+  worker process: requests go down one ring, responses up the other.
+  Its mutex is robust, a peer dying with it held does not lock out the
+  other side.
+*/
+struct PyWorkerChannel
+{
+    pthread_mutex_t mutex;
+    int stop;
+    PyWorkerRing request;
+    PyWorkerRing response;
+};
+
+/*
+  How the workers are made: each one forked by the client and starting
+  its own processor, or forked by a zygote process holding a processor
+  warmed once and shared copy on write
+*/
+enum PyWorkerSpawn
+{
+    SPAWN_FORK,
+    SPAWN_ZYGOTE
+};
+
+/*
+  A worker requested from the zygote and its pid once forked, -1 if
+  the fork failed
+*/
+struct PyWorkerSpawnSlot
+{
+    pid_t pid;
+    int requested;
+};
+
+/*
+  Control block of the zygote in shared memory, followed by one spawn
+  slot per worker
+*/
+struct PyWorkerZygote
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int stop;
+};
+
+/*
+  The class manages a pool of worker processes, each one running its
+  own python with a processor of the module. As the processes do not
+  share the GIL the handlers run on all the cores. A client leases a
+  channel, writes the request to its ring in shared memory and waits
+  for the response written by the worker to the other ring.
+
+  With a zygote the module is imported and the warm up calls are made
+  once, in the zygote, before it forks the workers.
+
+  A call waits for its response until its timeout, or a default one,
+  then the worker is killed as it may be stuck in the handler. A worker
+  found dead is replaced by a new one, forked again or from the zygote,
+  once all its channels are back from their clients.
+*/
+class PyWorkerPool
+{
+public:
+    // functions
+    PyWorkerPool(const std::string& mn,
+                 unsigned int workers_no = DEFAULT_WORKERS_NO,
+                 unsigned int interpreters_no = 1,
+                 PyWorkerSpawn spawn = SPAWN_FORK,
+                 const PyProcessorRequests& warmup = PyProcessorRequests());
+    ~PyWorkerPool();
+    size_t size() const;
+    std::string process(const std::string& identifier,
+                        const MapString2String& messages,
+                        const MultimapString2String& parameters,
+                        unsigned long timeout_ns = 0);
+
+private:
+    // types
+    typedef std::vector<pid_t> Pids;
+    typedef std::vector<unsigned int> ChannelIndexes;
+    // members
+    const std::string module_name;
+    const unsigned int workers_no;
+    const unsigned int interpreters_no;
+    const size_t channels_no;
+    const PyWorkerSpawn spawn_mode;
+    const PyProcessorRequests warmup;
+    PyWorkerChannel* channels;
+    PyWorkerZygote* zygote;
+    PyWorkerSpawnSlot* spawns;
+    pid_t zygote_pid;
+    Pids workers;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty_free_cond;
+    ChannelIndexes free;
+    ChannelIndexes broken;
+    // functions
+    void init_channels();
+    void init_channel(PyWorkerChannel& ch);
+    void init_workers();
+    void init_zygote();
+    void clean_workers();
+    void clean_zygote();
+    void clean_channels();
+    unsigned int alloc();
+    void dealloc(unsigned int channel);
+    void replace_worker(unsigned int channel);
+    void reap_worker(pid_t pid);
+    pid_t spawn(unsigned int worker);
+    pid_t fork_worker(unsigned int worker);
+    static pid_t fork_python();
+    void serve(unsigned int worker);
+    void serve_zygote();
+    void run_servers(PyProcessor& processor, unsigned int worker);
+    static void* serve_channel(void* arg);
+    static bool peer_alive(pid_t peer, bool is_worker);
+    static void send(PyWorkerChannel& ch, PyWorkerRing& r,
+                     const std::string& data, pid_t peer, bool is_worker,
+                     unsigned long deadline_ns = NO_DEADLINE);
+    static bool receive(PyWorkerChannel& ch, PyWorkerRing& r,
+                        char* data, size_t n, pid_t peer, bool is_worker,
+                        unsigned long deadline_ns = NO_DEADLINE);
+};
+
+#endif /* _PY_WORKER_POOL_H_ */
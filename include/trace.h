@@ -1,7 +1,7 @@
 #ifndef __TRACE__
 #define __TRACE__
 
-#include <iostream>
+#include <cstring>
 #include <string>
 
 #include <pthread.h>
@@ -10,67 +10,105 @@
 
 #include "lexical_cast.h"
 
-#ifdef __USE_TRACE__
+//
+// The frames are traced in all builds, at the cost of a flag test when
+// the tracing is off. The message of INFO is not even made then. Debug
+// builds start with the tracing on, the others when PYINTERP_TRACE is
+// set in the environment or __Frame__::on() is called. INFO takes a
+// message, or a printf format literal with up to three integer or
+// pointer arguments formatted by the drain thread only, as %lu, %ld or
+// %lx: INFO("Booked interpreter: %lu", lease).
+//
 #define FRAME __Frame__ __t__(__FUNCTION__)
-#define INFO(__MESSAGE__) __t__.info(__MESSAGE__)
+#define INFO(...) do { if (__t__.active) __t__.info(__VA_ARGS__); } while (0)
+
+#ifdef __USE_TRACE__
 #define __IS_TRACE__ true
 #else
-#define FRAME
-#define INFO(__MESSAGE__) {}
 #define __IS_TRACE__ false
 #endif
 
+#define TRACE_RING_SIZE 1024
+#define TRACE_MESSAGE_SIZE 96
+#define TRACE_ARGS 3
+
+enum __TraceKind__
+{
+    TRACE_ENTER,
+    TRACE_LEAVE,
+    TRACE_INFO
+};
+
+//
+// Argument of a formatted INFO, kept as is in the record
+//
+struct __TraceArg__
+{
+    __TraceArg__(): value(0) {}
+    __TraceArg__(int v): value(v) {}
+    __TraceArg__(unsigned int v): value(v) {}
+    __TraceArg__(long v): value(v) {}
+    __TraceArg__(unsigned long v): value(v) {}
+    __TraceArg__(const void* v): value((unsigned long)v) {}
+
+    unsigned long value;
+};
 
+//
+// The calling thread writes a fixed size record to its own ring, with
+// the time and the depth of the frame, and goes on. A background thread
+// drains the rings and formats the records to the trace output, stderr
+// by default. Records are dropped, and counted, when a ring is full.
+// Messages longer than a record are cut and marked so.
+//
 class __Frame__
 {
 public:
-    __Frame__(const char* fn, const std::string& msg = "") : frame(fn) {
-        pid = getpid();
-        ++call_level;
-        if (is_trace) {
-            try {
-                std::cerr << note("TRACE", "Enter " + msg) << std::endl;
-            } catch(...) {}
+    __Frame__(const char* fn, const char* msg = "") :
+        frame(fn), active(__atomic_load_n(&is_trace, __ATOMIC_RELAXED)) {
+        if (__builtin_expect(active, 0)) {
+            ++call_level;
+            record(TRACE_ENTER, frame, call_level, msg, strlen(msg));
         }
     }
 
     ~__Frame__() {
-        if (is_trace) {
-            try {
-                std::cerr << note("TRACE", "Leave") << std::endl;
-            } catch(...) {}
+        if (__builtin_expect(active, 0)) {
+            record(TRACE_LEAVE, frame, call_level, "", 0);
+            --call_level;
         }
-        --call_level;
     }
 
     void info(const std::string& msg) const {
-        if (is_trace) {
-            try {
-                std::cerr << note("TRACE", msg) << std::endl;
-            } catch(...) {}
-        }
+        record(TRACE_INFO, frame, call_level, msg.data(), msg.size());
     }
 
-    std::string note(const std::string& level, const std::string& msg) const {
-        std::string sep(msg.length() != 0, ' ');
-        pthread_t tid = pthread_self();
-        std::string rv = "[" + lexical_cast<std::string>(pid) +
-            "][" + lexical_cast<std::string>(tid) + "] " +
-            level + " " + prefix() + frame + sep + msg;
+    void info(const char* msg) const {
+        record(TRACE_INFO, frame, call_level, msg, strlen(msg));
+    }
 
-        return rv;
+    void info(const char* format, __TraceArg__ a,
+              __TraceArg__ b = __TraceArg__(), __TraceArg__ c = __TraceArg__()) const {
+        unsigned long args[TRACE_ARGS] = {a.value, b.value, c.value};
+        record(frame, call_level, format, args);
     }
 
-    static void on() { is_trace = true; }
+    static void on(int fd = STDERR_FILENO);
+    static void off() { __atomic_store_n(&is_trace, false, __ATOMIC_RELAXED); }
+    static bool enabled() { return __atomic_load_n(&is_trace, __ATOMIC_RELAXED); }
+    static void flush();
+    static unsigned long dropped();
 
-    static void off() { is_trace = true; }
+    const char* frame;
+    const bool active;
 
 private:
     static bool is_trace;
-    static unsigned int call_level;
-    std::string frame;
-    pid_t pid;
-    static std::string prefix() {std::string s(call_level, ' '); return s;}
+    static __thread unsigned int call_level;
+    static void record(__TraceKind__ kind, const char* frame, unsigned int level,
+                       const char* msg, size_t size);
+    static void record(const char* frame, unsigned int level,
+                       const char* format, const unsigned long* args);
 };
 
 #endif /* __TRACE__ */
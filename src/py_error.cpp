@@ -4,7 +4,7 @@
 
 #include "config.h"
 
-#include <python2.7/Python.h>
+#include "py_python.h"
 
 #include "lexical_cast.h"
 #include "py_error.h"
@@ -45,7 +45,11 @@ void Py_Error(string& error_message)
     }
 
     if (pExcValue != NULL) {
+#if PY_MAJOR_VERSION >= 3
+        PyObject* otext = PyObject_Str(pExcValue);
+#else
         PyObject* otext = PyObject_GetAttrString(pExcValue, "message");
+#endif
         if (otext) {
             error_message += PyString_AsString(otext);
             Py_DecRef(otext);
@@ -0,0 +1,193 @@
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "config.h"
+
+#include "py_python.h"
+
+#include "py_footprint.h"
+
+using namespace std;
+
+/*
+ * The walk is done in python, the same source for python 2 and 3. The
+ * modules are walked in the order of their names, one does not enter
+ * another, so that the attribution does not depend on the import
+ * order. The modules and their dicts are fenced off before the walk:
+ * a function reaches the globals of the module defining it wherever
+ * it was imported to, which would be charged to the importer.
+ */
+static const char* footprint_source =
+    "import gc, sys\n"
+    "\n"
+    "def footprint():\n"
+    "    seen = set()\n"
+    "    by_type = {}\n"
+    "    modules = []\n"
+    "    fences = set()\n"
+    "    for module in list(sys.modules.values()):\n"
+    "        d = getattr(module, '__dict__', None)\n"
+    "        if d is not None:\n"
+    "            fences.add(id(module))\n"
+    "            fences.add(id(d))\n"
+    "    for name, module in sorted(sys.modules.items(), key=lambda item: item[0]):\n"
+    "        d = getattr(module, '__dict__', None)\n"
+    "        if d is None or id(module) in seen:\n"
+    "            continue\n"
+    "        objects = 0\n"
+    "        size = 0\n"
+    "        stack = [module]\n"
+    "        while stack:\n"
+    "            o = stack.pop()\n"
+    "            if id(o) in seen or (id(o) in fences and o is not module and o is not d):\n"
+    "                continue\n"
+    "            seen.add(id(o))\n"
+    "            n = sys.getsizeof(o, 0)\n"
+    "            objects += 1\n"
+    "            size += n\n"
+    "            t = by_type.setdefault(type(o).__name__, [0, 0])\n"
+    "            t[0] += 1\n"
+    "            t[1] += n\n"
+    "            stack.extend(gc.get_referents(o))\n"
+    "        modules.append((name, len(d), sys.getsizeof(d, 0), objects, size))\n"
+    "    return [(k, tuple(v)) for k, v in by_type.items()], modules\n";
+
+static PyObject* footprint_walk()
+{
+    PyObject* globals = PyDict_New();
+    if (!globals) {
+        return NULL;
+    }
+
+    if (PyDict_SetItemString(globals, "__builtins__", PyEval_GetBuiltins()) != 0) {
+        Py_DECREF(globals);
+        return NULL;
+    }
+
+    PyObject* rv = PyRun_String(footprint_source, Py_file_input, globals, globals);
+    if (!rv) {
+        Py_DECREF(globals);
+        return NULL;
+    }
+
+    Py_DECREF(rv);
+    PyObject* fn = PyDict_GetItemString(globals, "footprint");
+    rv = fn ? PyObject_CallFunctionObjArgs(fn, NULL) : NULL;
+    Py_DECREF(globals);
+
+    return rv;
+}
+
+static bool more_type_bytes(const PyTypeFootprint& a, const PyTypeFootprint& b)
+{
+    return a.bytes > b.bytes;
+}
+
+static bool more_module_bytes(const PyModuleFootprint& a, const PyModuleFootprint& b)
+{
+    return a.bytes > b.bytes;
+}
+
+static bool more_duplicated_bytes(const PyModuleDuplication& a, const PyModuleDuplication& b)
+{
+    return a.duplicated_bytes > b.duplicated_bytes;
+}
+
+bool PyFootprint_Take(PyInterpreterFootprint& footprint)
+{
+    PyObject* rv = footprint_walk();
+    if (!rv) {
+        return false;
+    }
+
+    PyObject* types = NULL;
+    PyObject* modules = NULL;
+    if (!PyArg_ParseTuple(rv, "OO", &types, &modules)) {
+        Py_DECREF(rv);
+        return false;
+    }
+
+    footprint.objects = 0;
+    footprint.bytes = 0;
+    footprint.types.clear();
+    footprint.modules.clear();
+    for (Py_ssize_t i = 0; i < PyList_Size(types); i++) {
+        const char* name = NULL;
+        PyTypeFootprint t;
+        if (!PyArg_ParseTuple(PyList_GetItem(types, i), "s(kk)", &name, &t.objects, &t.bytes)) {
+            Py_DECREF(rv);
+            return false;
+        }
+
+        t.name = name;
+        footprint.objects += t.objects;
+        footprint.bytes += t.bytes;
+        footprint.types.push_back(t);
+    }
+
+    for (Py_ssize_t i = 0; i < PyList_Size(modules); i++) {
+        const char* name = NULL;
+        PyModuleFootprint m;
+        if (!PyArg_ParseTuple(PyList_GetItem(modules, i), "skkkk", &name, &m.entries,
+                              &m.dict_bytes, &m.objects, &m.bytes)) {
+            Py_DECREF(rv);
+            return false;
+        }
+
+        m.name = name;
+        footprint.modules.push_back(m);
+    }
+
+    Py_DECREF(rv);
+    sort(footprint.types.begin(), footprint.types.end(), more_type_bytes);
+    sort(footprint.modules.begin(), footprint.modules.end(), more_module_bytes);
+
+    return true;
+}
+
+void PyFootprint_Sum(PyPoolFootprint& footprint, const vector<string>& handler_modules)
+{
+    map<string, PyModuleDuplication> copies;
+    map<string, unsigned long> smallest;
+    footprint.objects = 0;
+    footprint.bytes = 0;
+    footprint.handler_bytes = 0;
+    for (size_t i = 0; i < footprint.interpreters.size(); i++) {
+        const PyInterpreterFootprint& f = footprint.interpreters[i];
+        footprint.objects += f.objects;
+        footprint.bytes += f.bytes;
+        for (size_t j = 0; j < f.modules.size(); j++) {
+            const PyModuleFootprint& m = f.modules[j];
+            PyModuleDuplication& d = copies[m.name];
+            d.name = m.name;
+            d.copies++;
+            d.bytes += m.bytes;
+            if (d.copies == 1 || m.bytes < smallest[m.name]) {
+                smallest[m.name] = m.bytes;
+            }
+
+            if (find(handler_modules.begin(), handler_modules.end(), m.name) != handler_modules.end()) {
+                footprint.handler_bytes += m.bytes;
+            }
+        }
+    }
+
+    footprint.duplicated.clear();
+    footprint.duplicated_bytes = 0;
+    for (map<string, PyModuleDuplication>::iterator it = copies.begin(); it != copies.end(); ++it) {
+        PyModuleDuplication& d = it->second;
+        if (d.copies < 2) {
+            continue;
+        }
+
+        d.duplicated_bytes = d.bytes - smallest[d.name];
+        footprint.duplicated.push_back(d);
+        if (find(handler_modules.begin(), handler_modules.end(), d.name) == handler_modules.end()) {
+            footprint.duplicated_bytes += d.duplicated_bytes;
+        }
+    }
+
+    sort(footprint.duplicated.begin(), footprint.duplicated.end(), more_duplicated_bytes);
+}
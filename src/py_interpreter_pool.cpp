@@ -1,14 +1,16 @@
-#include <algorithm>
-#include <deque>
+#include <cerrno>
+#include <climits>
 #include <memory>
 #include <new>
 #include <string>
 
 #include "config.h"
 
-#include <python2.7/Python.h>
+#include "py_python.h"
 #include <pthread.h>
+#include <sched.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "cxx_compatibility.h"
 #include "trace.h"
@@ -34,24 +36,177 @@ PyInterpreterPool::make_mutex() const throw()
 }
 
 /*
- * Heap allocation of a new condtional variable
+ * Absolute deadline on the monotonic clock, nanoseconds normalized
  */
-PthreadCondPtr
-PyInterpreterPool::make_cond() const throw()
+static void make_deadline(struct timespec& ts, unsigned long timeout_ns)
 {
-    return new (std::nothrow) pthread_cond_t;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += timeout_ns / 1000000000u;
+    ts.tv_nsec += timeout_ns % 1000000000u;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+}
+
+/*
+ * Time on the monotonic clock
+ */
+static unsigned long monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long)ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+static unsigned long monotonic_ms()
+{
+    return monotonic_ns() / 1000000ul;
+}
+
+/*
+ * Number of shards: one per online cpu if requested so, never more
+ * than the interpreters to be shared.
+ */
+unsigned int
+PyInterpreterPool::make_shards_no(unsigned int n) const throw()
+{
+    if (n == SHARD_PER_CPU) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n = cpus > 0 ? (unsigned int)cpus : 1;
+    }
+
+    if (n > pool_size) {
+        n = pool_size;
+    }
+
+    return n > 0 ? n : 1;
+}
+
+/*
+ * Shard of the core the caller is running on
+ */
+unsigned int
+PyInterpreterPool::home_shard() const throw()
+{
+    if (shard.size() == 1) {
+        return 0;
+    }
+
+    int cpu = sched_getcpu();
+
+    return cpu >= 0 ? (unsigned int)cpu % shard.size() : 0;
 }
 
 /*
  * Make pool and allocate thread control structures
  */
-PyInterpreterPool::PyInterpreterPool(int n):
+PyInterpreterPool::PyInterpreterPool(int n,
+                                     unsigned int shards_no,
+                                     PyInterpreterReusePolicy p):
     pool_size(n),
+    scaling(n, n),
+    policy(p),
+    mutex(make_mutex()),
+    preload(true),
+    slots(n),
+    shard(make_shards_no(shards_no)),
+    busy_count(0),
+    waiting_count(0),
+    waiter_head(NULL),
+    waiter_tail(NULL),
+    handlers_count(0),
+    live_count(0),
+    waits_count(0),
+    wait_ns(0),
+    timeouts_count(0),
+    grown_count(0),
+    retired_count(0),
+    recycled_count(0),
+    expired_count(0),
+    code_version(0),
+    retire_fn(NULL),
+    retire_arg(NULL),
+    scaler_running(false),
+    scaler_stop(false),
+    recycler_running(false),
+    recycler_stop(false),
+    watchdog_wake_ns(ULONG_MAX),
+    watchdog_running(false),
+    watchdog_stop(false)
+{
+    FRAME;
+
+    init();
+}
+
+/*
+ * Make elastic pool, with the table of the maximal size
+ */
+PyInterpreterPool::PyInterpreterPool(const PyInterpreterScaling& s,
+                                     unsigned int shards_no,
+                                     PyInterpreterReusePolicy p):
+    pool_size(s.max_size),
+    scaling(s),
+    policy(p),
     mutex(make_mutex()),
-    not_empty_free_cond(make_cond())
+    preload(true),
+    slots(s.max_size),
+    shard(make_shards_no(shards_no)),
+    busy_count(0),
+    waiting_count(0),
+    waiter_head(NULL),
+    waiter_tail(NULL),
+    handlers_count(0),
+    live_count(0),
+    waits_count(0),
+    wait_ns(0),
+    timeouts_count(0),
+    grown_count(0),
+    retired_count(0),
+    recycled_count(0),
+    expired_count(0),
+    code_version(0),
+    retire_fn(NULL),
+    retire_arg(NULL),
+    scaler_running(false),
+    scaler_stop(false),
+    recycler_running(false),
+    recycler_stop(false),
+    watchdog_wake_ns(ULONG_MAX),
+    watchdog_running(false),
+    watchdog_stop(false)
+{
+    FRAME;
+
+    init();
+}
+
+/*
+ * Common part of the constructors
+ */
+void PyInterpreterPool::init()
 {
     FRAME;
 
+    if (scaling.max_size == 0 || scaling.min_size > scaling.max_size) {
+        throw logic_error(error_info("Invalid pool bounds: " +
+                                     lexical_cast<string>(scaling.min_size) + " - " +
+                                     lexical_cast<string>(scaling.max_size)));
+    }
+
+    if (scaling.recycling.max_heap_growth && scaling.recycling.heap_check_calls == 0) {
+        throw logic_error(error_info("Invalid heap check period: 0"));
+    }
+
+#ifndef PY_OWN_GIL
+    // sharing the allocator the heap of an interpreter is not known
+    if (scaling.recycling.max_heap_growth) {
+        throw logic_error(error_info("Heap growth not measured per interpreter"));
+    }
+#endif
+
     LockGuard<pthread_mutex_t> gpm(&global_pool_mutex);
 
     init_mt_layer();
@@ -63,7 +218,7 @@ PyInterpreterPool::PyInterpreterPool(int n):
         init_interpreters();
     } catch(exception& e) {
         global_pools_no--;
-		INFO("Got exception: " + e.what());
+		INFO(string("Got exception: ") + e.what());
         throw;
     }
 }
@@ -75,6 +230,11 @@ PyInterpreterPool::~PyInterpreterPool()
 {
     FRAME;
 
+    // they take the global mutex themselves
+    stop_watchdog();
+    stop_recycler();
+    stop_scaler();
+
     LockGuard<pthread_mutex_t> gpm(&global_pool_mutex);
 
     try {
@@ -85,363 +245,1893 @@ PyInterpreterPool::~PyInterpreterPool()
         }
 
     } catch(exception& e) {
-		INFO("Got exception: " + e.what());
+		INFO(string("Got exception: ") + e.what());
 	}
 
     clean_mt_layer();
 }
 
 /*
- * Create data handler
+ * The callable of a module in the current interpreter, a new reference
+ * or NULL with the error message set
+ */
+static PyObject* resolve_handler(const PyHandlerName& name, string& error_message)
+{
+    PyObject* py_module_name = PyString_FromString(name.first.c_str());
+    if (!py_module_name) {
+        error_message = "creating module name: " + name.first;
+        return NULL;
+    }
+
+    PyObject* py_module = PyImport_Import(py_module_name);
+    Py_DECREF(py_module_name);
+    if (!py_module) {
+        error_message = "importing module: " + name.first;
+        return NULL;
+    }
+
+    PyObject* py_data_handler = PyObject_GetAttrString(py_module, name.second.c_str());
+    Py_DECREF(py_module);
+    if (!(py_data_handler && PyCallable_Check(py_data_handler))) {
+        Py_XDECREF(py_data_handler);
+        error_message = "building data handler: " + name.first + "." + name.second;
+        return NULL;
+    }
+
+    return py_data_handler;
+}
+
+/*
+ * Create the data handlers of the registry in the interpreter of the
+ * lease, the first one is the default. The modules the first one
+ * loads are collected compiled, to be known at reload and to be
+ * installed in the others when preloading.
  */
-void PyInterpreterPool::build_handler(PyInterpreterThreadStatePtr interpreter,
-                                      const string& mn,
-                                      const string& dhn)
+void PyInterpreterPool::build_handler(PyInterpreterLease lease)
 {
     FRAME;
 
+    // the first one collects the modules, the others get them
+    PyObject* loaded = NULL;
+    if (preloaded.empty()) {
+        loaded = PyPreload_Loaded();
+    } else if (preload && !PyPreload_Install(preloaded)) {
+        string error_message("installing preloaded modules");
+        Py_Error(error_message);
+        INFO(error_message);
+    }
+
+    if (PyErr_Occurred() != NULL) {
+        PyErr_Clear();
+    }
+
     string error_message;
-    PyObject* py_module_name = PyString_FromString(mn.c_str());
-    if (!py_module_name) {
-        error_message = "creating module name: " + mn;
-    } else {
-        PyObject* py_module = PyImport_Import(py_module_name);
-        if (!py_module) {
-            error_message = "importing module: " + mn;
+    PyInterpreterSlot& s = slots[lease];
+    s.version = __atomic_load_n(&code_version, __ATOMIC_RELAXED);
+    s.recycle = false;
+    s.calls = 0;
+
+    for (unsigned int i = 0; i < handler_names.size() && error_message.empty(); i++) {
+        PyObject* py_data_handler = resolve_handler(handler_names[i], error_message);
+        if (!py_data_handler) {
+            break;
+        }
+
+        INFO("Created data handler: %#lx", py_data_handler);
+        if (i == DEFAULT_HANDLER) {
+            s.handler = py_data_handler;
+            handlers_count++;
         } else {
-            PyObject* py_data_handler = PyObject_GetAttrString(py_module, dhn.c_str());
-            if (!(py_data_handler && PyCallable_Check(py_data_handler))) {
-                error_message = "building data handler";
-            } else {
-                Py_DecrefAll(2, py_module_name, py_module);
-                INFO("Created data handler: " + lexical_cast<string>(py_data_handler));
-                handler.insert(pair<PyInterpreterThreadStatePtr, PyDataHandlerPtr>(interpreter, py_data_handler));
-                INFO("Loaded data handler map: " +
-                     lexical_cast<string>(interpreter) + " -> " +
-                     lexical_cast<string>(py_data_handler));
-            }
+            s.handlers.push_back(py_data_handler);
+        }
+
+        INFO("Loaded data handler slot: %lu -> %#lx", lease, py_data_handler);
+    }
+
+    if (loaded) {
+        if (error_message.empty() && !PyPreload_Collect(loaded, preloaded)) {
+            preloaded.clear();
+            PyErr_Clear();
         }
+
+        Py_DECREF(loaded);
+        INFO("Preloaded modules: %lu", preloaded.size());
     }
 
     if (!error_message.empty()) {
         if (PyErr_Occurred() != NULL) {
             Py_Error(error_message);
-            throw runtime_error(error_info(error_message));
         }
+
+        release_handlers(s);
+        throw runtime_error(error_info(error_message));
+    }
+
+    // the modules imported are not growth
+    if (scaling.recycling.max_heap_growth) {
+        s.heap_base = Py_HeapSize();
+    }
+}
+
+/*
+ * Drop the data handlers of the slot, with its interpreter current
+ */
+void PyInterpreterPool::release_handlers(PyInterpreterSlot& s)
+{
+    if (s.handler) {
+        Py_DECREF(s.handler);
+        s.handler = NULL;
+        handlers_count--;
+    }
+
+    for (unsigned int i = 0; i < s.handlers.size(); i++) {
+        Py_DECREF(s.handlers[i]);
     }
+
+    s.handlers.clear();
 }
 
 /*
  * Make all handles and link them with interpreter
  */
-void PyInterpreterPool::build_handlers(const string& mn,
-                                       const string& dhn)
+void PyInterpreterPool::build_handlers()
 {
     FRAME;
 
-    INFO("Creating handlers for: " + mn + "." + dhn);
+    INFO("Creating handlers no: %lu", handler_names.size());
 
-    for (unsigned int i = 0; i < pool_size; i++) {
-        PyInterpreterThreadStatePtr interpreter = alloc();
-        INFO("Got next interpreter: " + lexical_cast<string>(interpreter));
-        PyThreadState_Swap(interpreter);
-        build_handler(interpreter, mn, dhn);
-        PyThreadState_Swap(NULL);
-        dealloc(interpreter);
+    // not started yet so nobody books them, whatever the reuse policy
+    for (PyInterpreterLease lease = 0; lease < pool_size; lease++) {
+        if (!slots[lease].interpreter) {
+            continue;
+        }
+
+        INFO("Got next interpreter: %lu", lease);
+        PyGILGuard g(get_interpreter(lease));
+        build_handler(lease);
     }
 
-    INFO("Created handlers no: " + lexical_cast<string>(handler.size()));
+    INFO("Created handlers no: %lu", handlers_count);
 }
 
 /*
  * Build N interpreters with their contexts: python thread states and
  * data handlers for each of them. Store states and handlers in map.
- * The interpreter may then execut in its own context.
+ * The interpreter may then execut in its own context. A progressive
+ * pool returns with the first one, the others follow in background.
  */
 void PyInterpreterPool::start(const string& mn, const string& dhn)
 {
-    FRAME;
-
-    LockGuard<pthread_mutex_t> gpm(&global_pool_mutex);
-
-    build_handlers(mn, dhn);
-
-    // finally, the object is created
-    module_name = mn;
-    data_handler_name = dhn;
-
-    invariant(); // must hold since now on
+    start(PyHandlerNames(1, PyHandlerName(mn, dhn)));
 }
 
 /*
- * Get next free interpreter from the queue waiting for the condition:
- * queue not empty. No global mutex used here as this is a condition
- * we wait for: not empty queue of interpreters. The allocated
- * interpreter is returned but it alst is stored on the busy queue
- * so that the do not loose it.
+ * Start with a registry of handlers, each interpreter has all of them
+ * resolved. The id of a handler is its index in the registry.
  */
-PyInterpreterThreadStatePtr
-PyInterpreterPool::alloc(unsigned int max_timeout_ns)
+void PyInterpreterPool::start(const PyHandlerNames& names)
 {
     FRAME;
 
-    LockGuard<pthread_mutex_t> m(mutex);
+    if (names.empty()) {
+        throw logic_error(error_info("No data handler to start the pool with"));
+    }
 
-    struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
-    ts.tv_nsec += max_timeout_ns;
+    bool complete = false;
+    {
+        LockGuard<pthread_mutex_t> gpm(&global_pool_mutex);
 
-    int rc = 0;
-    while (free.empty() && rc == 0) {
-        rc = pthread_cond_timedwait(not_empty_free_cond, mutex, &ts);
-    }
+        handler_names = names;
+        build_handlers();
 
-    if (rc != 0) {
-        throw runtime_error(sys_error_info(rc, "pthread_cond_wait"));
-    }
+        invariant(); // must hold since now on
 
-    PyInterpreterThreadStatePtr interpreter = move(free.front(), free, busy);
+        complete = live_count == scaling.min_size;
+        if (!complete || scaling.min_size < scaling.max_size) {
+            start_scaler();
+        }
+    }
 
-    return interpreter;
+    // without the lock, the client may start another pool
+    if (complete) {
+        ready();
+    }
 }
 
-PyInterpreterThreadStatePtr
-PyInterpreterPool::alloc(PyDataHandlerPtr& handler_rv,
-                         unsigned int max_timeout_ns)
+/*
+ * Rebuild the handlers of all the interpreters on the current code of
+ * their modules, one free interpreter at a time, the others serving
+ * meanwhile. The busy ones are done once released, their calls end on
+ * the code they started with. The first interpreter rebuilt compiles
+ * the modules for the others. If it fails the pool keeps the former
+ * code, rebuilt in that interpreter, and the error is thrown.
+ */
+void PyInterpreterPool::reload(unsigned long timeout_ns)
 {
     FRAME;
 
-    LockGuard<pthread_mutex_t> m(mutex);
+    LockGuard<pthread_mutex_t> rm(&reload_mutex);
 
-    struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
-    ts.tv_nsec += max_timeout_ns;
+    PyPreloadedModules former;
+    unsigned int version = 0;
+    {
+        LockGuard<pthread_mutex_t> gpm(&global_pool_mutex);
 
-    int rc = 0;
-    while (free.empty() && rc == 0) {
-        rc = pthread_cond_timedwait(not_empty_free_cond, mutex, &ts);
+        former.swap(preloaded);
+        version = __atomic_add_fetch(&code_version, 1, __ATOMIC_RELAXED);
     }
 
-    if (rc != 0) {
-        throw runtime_error(sys_error_info(rc, "pthread_cond_wait"));
-    }
+    INFO("Reloading to version: %lu", version);
+
+    unsigned long deadline_ns = PyMetrics_Clock() + timeout_ns;
+    unsigned int stale = 1;
+    while (stale > 0) {
+        stale = 0;
+        for (PyInterpreterLease lease = 0; lease < pool_size; lease++) {
+            PyInterpreterSlot& s = slots[lease];
+            if (__atomic_load_n(&s.state, __ATOMIC_ACQUIRE) == SLOT_EMPTY ||
+                __atomic_load_n(&s.version, __ATOMIC_RELAXED) == version) {
+                continue;
+            }
 
-    PyInterpreterThreadStatePtr interpreter = move(free.front(), free, busy);
-    PyInterpreterThreadStatePtrToDataHandlerPtrMapConstIterator it = handler.find(interpreter);
-    if (it != handler.end()) {
-        handler_rv = handler.find(interpreter)->second;
-    } else {
-        throw runtime_error(error_info("handler of interpreter missing"));
+            if (!take(lease)) {
+                stale++;
+                continue;
+            }
+
+            try {
+                rebuild_handler(lease, former);
+            } catch (...) {
+                if (slots[lease].handler) {
+                    dealloc(lease);
+                } else {
+                    retire(lease);
+                }
+
+                throw;
+            }
+
+            dealloc(lease);
+        }
+
+        if (stale > 0) {
+            wait_busy(stale, deadline_ns);
+        }
     }
 
-    return interpreter;
+    INFO("Reloaded to version: %lu", version);
 }
 
 /*
- * Put back the interpreter on the queue raising the condition: queue
- * not empty. No global mutex used here as we signal the condition
- * to potentiol waiters: the queue is not empty.
+ * Walk the objects of all the interpreters, one booked at a time, and
+ * sum up what they hold. The GIL of each one is held for its walk.
  */
-void PyInterpreterPool::dealloc(PyInterpreterThreadStatePtr interpreter)
+PyPoolFootprint PyInterpreterPool::footprint(unsigned long timeout_ns)
 {
     FRAME;
 
-    LockGuard<pthread_mutex_t> m(mutex);
+    unsigned long deadline_ns = PyMetrics_Clock() + timeout_ns;
+    PyPoolFootprint f;
+    vector<bool> done(pool_size, false);
+    unsigned int busy = 1;
+    while (busy > 0) {
+        busy = 0;
+        for (PyInterpreterLease lease = 0; lease < pool_size; lease++) {
+            if (done[lease]) {
+                continue;
+            }
 
-    (void)move(interpreter, busy, free);
-    int rc = pthread_cond_broadcast(not_empty_free_cond);
-    if (rc != 0) {
-        throw runtime_error(sys_error_info(rc, "pthread_cond_broadcast"));
+            if (__atomic_load_n(&slots[lease].state, __ATOMIC_ACQUIRE) == SLOT_EMPTY) {
+                done[lease] = true;
+                continue;
+            }
+
+            if (!take(lease)) {
+                busy++;
+                continue;
+            }
+
+            PyInterpreterFootprint fi;
+            fi.lease = lease;
+            string error_message;
+            {
+                PyGILGuard g(slots[lease].interpreter);
+                if (!PyFootprint_Take(fi)) {
+                    error_message = "PyFootprint_Take";
+                    Py_Error(error_message);
+                }
+            }
+
+            dealloc(lease);
+            if (!error_message.empty()) {
+                throw runtime_error(error_info(error_message));
+            }
+
+            f.interpreters.push_back(fi);
+            done[lease] = true;
+        }
+
+        if (busy > 0) {
+            wait_busy(busy, deadline_ns);
+        }
+    }
+
+    vector<string> handler_modules;
+    for (unsigned int i = 0; i < handler_names.size(); i++) {
+        handler_modules.push_back(handler_names[i].first);
     }
+
+    PyFootprint_Sum(f, handler_modules);
+
+    return f;
 }
 
 /*
-  Get the size of the pool of interpreters. No global mutex used here
-  but just the local one: we can't just return the state of the
-  queues, free and busy as there can be some pending operation on them.
-*/
-size_t PyInterpreterPool::size() const
+ * Pause of a walk of the interpreters for the busy ones, an interpreter
+ * kept for good by its client must not hold the walk forever
+ */
+void PyInterpreterPool::wait_busy(unsigned int busy, unsigned long deadline_ns)
 {
-    FRAME;
-
-    LockGuard<pthread_mutex_t> m(mutex);
-
-    invariant();
+    if (PyMetrics_Clock() >= deadline_ns) {
+        throw PyTimeoutError(error_info("Interpreters still busy: " +
+                                        lexical_cast<string>(busy)));
+    }
 
-    return free.size() + busy.size();
+    usleep(RELOAD_PERIOD_US);
 }
 
 /*
- * Initialize mutex, cond variable checking if they memoery is Ok
+ * Rebuild the handlers of a booked interpreter, in global critical
+ * section as the interpreters are made. The modules of the former
+ * code are dropped first. When the first one fails it is rebuilt on
+ * the former code, compiled, as the files are already changed.
  */
-void PyInterpreterPool::init_mt_layer()
+void PyInterpreterPool::rebuild_handler(PyInterpreterLease lease,
+                                        PyPreloadedModules& former)
 {
     FRAME;
 
-    if (!mutex) {
-        throw runtime_error(error_info("pthread_mutex not allocated"));
-    }
-
-    if (!not_empty_free_cond) {
-        if (mutex) {
-            delete mutex;
-        }
+    LockGuard<pthread_mutex_t> gpm(&global_pool_mutex);
 
-        throw runtime_error(error_info("pthread_cond not allocated"));
+    PyInterpreterSlot& s = slots[lease];
+    if (s.version == code_version) {
+        return;
     }
 
-    int rc = pthread_mutex_init(mutex, NULL);
-    if (rc != 0) {
-        throw runtime_error(sys_error_info(rc, "pthread_mutex_init"));
+    PyGILGuard g(s.interpreter);
+    if (!PyPreload_Unload(former)) {
+        PyErr_Clear();
     }
 
-    rc = pthread_cond_init(not_empty_free_cond, NULL);
-    if (rc != 0) {
-        throw runtime_error(sys_error_info(rc, "pthread_cond_init"));
+    release_handlers(s);
+    try {
+        build_handler(lease);
+    } catch (...) {
+        if (!preloaded.empty() || former.empty()) {
+            throw;
+        }
+
+        preloaded.swap(former);
+        __atomic_sub_fetch(&code_version, 1, __ATOMIC_RELAXED);
+        if (!PyPreload_Unload(preloaded) || !PyPreload_Install(preloaded)) {
+            PyErr_Clear();
+        }
+
+        build_handler(lease);
+        throw;
     }
 }
 
 /*
- * Only once, init python environment
+ * End a booked interpreter the handlers of which could not be made
  */
-void PyInterpreterPool::init_python()
+void PyInterpreterPool::retire(PyInterpreterLease lease)
 {
     FRAME;
 
-    Py_Initialize();
-    PyEval_InitThreads();
-    PyEval_ReleaseLock();
+    LockGuard<pthread_mutex_t> gpm(&global_pool_mutex);
 
-    INFO("Initialized python with threads");
+    end_interpreter(lease);
+    __atomic_sub_fetch(&busy_count, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&live_count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&retired_count, 1, __ATOMIC_RELAXED);
 }
 
 /*
- * Create interpreters in global critical section
+ * Tell the client the pool has reached its lower bound
  */
-void PyInterpreterPool::init_interpreters()
+void PyInterpreterPool::ready()
 {
     FRAME;
 
-    INFO("Creating interpreters: " + lexical_cast<string>(pool_size));
+    INFO("Pool ready: %lu", size());
 
-    for (unsigned int i = 0; i < pool_size; i++) {
-        PyInterpreterThreadStatePtr interpreter = Py_NewInterpreter();
-        if (!interpreter) {
-            if (PyErr_Occurred() != NULL) {
-                string error_message("Py_NewInterpreter");
-                Py_Error(error_message);
-                throw runtime_error(error_info(error_message));
-            }
-        } else {
-            free.push_front(interpreter);
-            INFO("Created interpreter Py_NewInterpreter [" +
-                 lexical_cast<string>(i) + "] " +
-                 lexical_cast<string>(interpreter));
-        }
+    if (scaling.on_ready) {
+        scaling.on_ready(scaling.ready_arg, size());
     }
+}
 
-    INFO("Created interpreters: " + lexical_cast<string>(free.size()));
+/*
+ * Switch the preloading of the handler modules, before the start
+ */
+void PyInterpreterPool::preload_modules(bool on)
+{
+    preload = on;
 }
 
 /*
-  Release all interpreters and destroy synch layer in global citical
-  section, The mutex, cond variables being smart pointers will be
-  released automaticly so not need to do manually.
-*/
-void PyInterpreterPool::clean_interpreters()
+ * Set the function called before an interpreter is retired
+ */
+void PyInterpreterPool::on_retire(PyInterpreterRetireFn fn, void* arg)
 {
     FRAME;
 
-    PyGILGuard g;
+    LockGuard<pthread_mutex_t> gpm(&global_pool_mutex);
 
-    // first handlers, so that the pointers are not invalidated
-    for (PyInterpreterThreadStatePtrToDataHandlerPtrMapIterator it = handler.begin();
-         it != handler.end();
-         ++it) {
-        PyThreadState_Swap(it->first);
-        Py_XDECREF(it->second);
-        PyThreadState_Swap(NULL);
+    retire_fn = fn;
+    retire_arg = arg;
+}
+
+/*
+ * Get next free interpreter, first from the shard of the caller core
+ * then stealing from the other shards. If all of them are empty or
+ * other clients already wait the caller is queued after them. No
+ * global mutex used here as this is a condition we wait for. The
+ * lease of the allocated interpreter is returned, its slot is marked
+ * busy so that we do not loose it.
+ */
+PyInterpreterLease
+PyInterpreterPool::alloc(unsigned int max_timeout_ns)
+{
+    FRAME;
+
+    unsigned long started_ns = PyMetrics_Clock();
+    unsigned int home = home_shard();
+    PyInterpreterLease lease = NO_LEASE;
+    if (__atomic_load_n(&waiting_count, __ATOMIC_RELAXED) == 0) {
+        if (policy == REUSE_AFFINITY) {
+            lease = take_last_used();
+        }
+
+        if (lease == NO_LEASE) {
+            lease = take_free(home);
+        }
     }
 
-    // no problem, they are not busy
-    for (PyInterpreterThreadStatePtrQueueIterator it = free.begin();
-         it != free.end();
-         ++it) {
-        PyThreadState_Swap(*it);
-        Py_EndInterpreter(*it);
-        PyThreadState_Swap(NULL);
+    if (lease == NO_LEASE) {
+        lease = wait_free(home, max_timeout_ns);
     }
 
-    // brutal, gracefull ending missing
-    for (PyInterpreterThreadStatePtrQueueIterator it = busy.begin();
-         it != busy.end();
-         ++it) {
-        PyThreadState_Swap(*it);
-        Py_EndInterpreter(*it);
-        PyThreadState_Swap(NULL);
+    if (policy == REUSE_AFFINITY) {
+        pthread_setspecific(last_lease_key, (void*)((size_t)lease + 1));
     }
+
+    recorder.record(METRIC_ALLOC_WAIT, PyMetrics_Clock() - started_ns);
+
+    return lease;
 }
 
-void PyInterpreterPool::clean_mt_layer()
+/*
+ * Put back the interpreter. The oldest waiting client gets it directly,
+ * otherwise it goes on the list of the caller core shard. No global
+ * mutex used here as we only hand off to potentiol waiters.
+ */
+void PyInterpreterPool::dealloc(PyInterpreterLease lease)
 {
     FRAME;
 
-    int rc = pthread_mutex_destroy(mutex);
-    if (rc != 0) {
-        cerr << sys_error_info(rc, "pthread_mutex_destroy") << endl;
-    } else {
-        delete mutex;
+    if (lease >= pool_size) {
+        throw logic_error(error_info("Cant release interpreter not booked: " +
+                                     lexical_cast<string>(lease)));
     }
 
-    rc = pthread_cond_destroy(not_empty_free_cond);
-    if (rc != 0) {
-        cerr << sys_error_info(rc, "pthread_cond_destroy") << endl;
-    } else {
-        delete not_empty_free_cond;
+    // the booking state is changed by other shards too
+    PyInterpreterSlotState busy = SLOT_BUSY;
+    PyInterpreterSlotState released =
+        __atomic_load_n(&slots[lease].recycle, __ATOMIC_RELAXED) ? SLOT_QUARANTINED : SLOT_FREE;
+    if (!__atomic_compare_exchange_n(&slots[lease].state, &busy, released,
+                                     false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        throw logic_error(error_info("Cant release interpreter not booked: " +
+                                     lexical_cast<string>(lease)));
     }
-}
 
-void PyInterpreterPool::clean_python()
-{
-    FRAME;
+    // still counted busy until it is renewed
+    if (released == SLOT_QUARANTINED) {
+        quarantine(lease);
+        return;
+    }
 
-    PyGILGuard g(false);
+    __atomic_sub_fetch(&busy_count, 1, __ATOMIC_RELAXED);
 
-    Py_Finalize();
-    // No GIL anuymore, so no matching release, the guard is fake
+    put_back(lease);
 }
 
 /*
- * Class invariant may not be violated:
- * - number of data handlers is the same as pool size
- * - numer of free and busy inerpreters is same as pool size
+ * Make the free interpreter available, released or just created. The
+ * release time is kept for the retiring of the idle ones.
  */
-void PyInterpreterPool::invariant() const
+void PyInterpreterPool::put_back(PyInterpreterLease lease)
 {
-    assert(free.size() + busy.size() == pool_size);
-    assert(handler.size() == pool_size);
+    if (scaling.min_size < scaling.max_size) {
+        slots[lease].released_ms = monotonic_ms();
+    }
+
+    if (__atomic_load_n(&waiting_count, __ATOMIC_SEQ_CST) != 0) {
+        PyInterpreterWaiter* w = NULL;
+        bool handed = false;
+        {
+            LockGuard<pthread_mutex_t> m(mutex);
+            if (waiter_head) {
+                book(lease);
+                w = hand_off(lease);
+                handed = true;
+            }
+        }
+
+        if (handed) {
+            resume(w);
+            return;
+        }
+    }
+
+    unsigned int home = home_shard();
+    {
+        LockGuard<pthread_mutex_t> sm(&shard[home].mutex);
+        push_free(shard[home], lease);
+    }
+
+    // a client may have started to wait while it was being linked
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&waiting_count, __ATOMIC_SEQ_CST) == 0) {
+        return;
+    }
+
+    PyInterpreterWaiter* w = NULL;
+    {
+        LockGuard<pthread_mutex_t> m(mutex);
+        if (waiter_head) {
+            PyInterpreterLease free_lease = take_free(home);
+            if (free_lease != NO_LEASE) {
+                w = hand_off(free_lease);
+            }
+        }
+    }
+
+    resume(w);
 }
 
 /*
- * Move the interpreter from one queue to another. It has do be done
- * in a scope of a guard, a critical section, while managing free interpreter pool.
+ * Book a free interpreter for an asynchronous client. It returns false
+ * with the lease in the waiter if one could be booked at once. Else
+ * the waiter is queued and true returned: the client is resumed with
+ * the lease later, by the call of dealloc handing it off.
  */
-PyInterpreterThreadStatePtr
-PyInterpreterPool::move(PyInterpreterThreadStatePtr interpreter,
-                        PyInterpreterThreadStatePtrQueue& src,
-                        PyInterpreterThreadStatePtrQueue& des)
+bool PyInterpreterPool::alloc_async(PyInterpreterWaiter& w)
 {
     FRAME;
 
-    INFO("Moving interpreter: " + lexical_cast<string>(interpreter));
+    if (!w.resume) {
+        throw logic_error(error_info("No resume function of the waiter"));
+    }
 
-    PyInterpreterThreadStatePtrQueueIterator it = find(src.begin(), src.end(), interpreter);
-    if (it == src.end()) {
-        throw logic_error(error_info("Cant find interpreter in queue"));
-    } else {
-        src.erase(it);
-        des.push_back(interpreter);
+    unsigned int home = home_shard();
+    w.lease = NO_LEASE;
+    if (__atomic_load_n(&waiting_count, __ATOMIC_RELAXED) == 0) {
+        w.lease = take_free(home);
+        if (w.lease != NO_LEASE) {
+            return false;
+        }
     }
 
-    return interpreter;
+    LockGuard<pthread_mutex_t> m(mutex);
+
+    __atomic_add_fetch(&waiting_count, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (!waiter_head) {
+        w.lease = take_free(home);
+        if (w.lease != NO_LEASE) {
+            __atomic_sub_fetch(&waiting_count, 1, __ATOMIC_SEQ_CST);
+            return false;
+        }
+    }
+
+    // counted as waiting until handed off
+    push_waiter(w);
+
+    return true;
+}
+
+/*
+  Get the size of the pool of interpreters, the ones living now. It
+  changes in time if the pool is elastic.
+*/
+size_t PyInterpreterPool::size() const
+{
+    return __atomic_load_n(&live_count, __ATOMIC_RELAXED);
+}
+
+/*
+ * The most interpreters the pool may have, the size of the table
+ */
+size_t PyInterpreterPool::capacity() const
+{
+    return pool_size;
+}
+
+/*
+ * Counters read one by one, each one is exact but they may be not
+ * consistent with each other
+ */
+PyInterpreterPoolStats PyInterpreterPool::stats() const
+{
+    PyInterpreterPoolStats st;
+    st.size = __atomic_load_n(&live_count, __ATOMIC_RELAXED);
+    st.min_size = scaling.min_size;
+    st.max_size = scaling.max_size;
+    st.busy = __atomic_load_n(&busy_count, __ATOMIC_RELAXED);
+    st.waiting = __atomic_load_n(&waiting_count, __ATOMIC_RELAXED);
+    st.waits = __atomic_load_n(&waits_count, __ATOMIC_RELAXED);
+    st.wait_ns = __atomic_load_n(&wait_ns, __ATOMIC_RELAXED);
+    st.timeouts = __atomic_load_n(&timeouts_count, __ATOMIC_RELAXED);
+    st.grown = __atomic_load_n(&grown_count, __ATOMIC_RELAXED);
+    st.retired = __atomic_load_n(&retired_count, __ATOMIC_RELAXED);
+    st.recycled = __atomic_load_n(&recycled_count, __ATOMIC_RELAXED);
+    st.expired = __atomic_load_n(&expired_count, __ATOMIC_RELAXED);
+
+    return st;
+}
+
+/*
+ * The counters with the histograms summed over the recording threads
+ */
+PyInterpreterPoolMetrics PyInterpreterPool::metrics() const
+{
+    PyInterpreterPoolMetrics m;
+    m.pool = stats();
+    m.free = m.pool.size > m.pool.busy ? m.pool.size - m.pool.busy : 0;
+    recorder.snapshot(m.histograms);
+
+    return m;
+}
+
+/*
+ * Version of the code of the handlers, one more at each reload
+ */
+unsigned int PyInterpreterPool::version() const
+{
+    return __atomic_load_n(&code_version, __ATOMIC_RELAXED);
+}
+
+/*
+ * Number of data handlers of the registry
+ */
+size_t PyInterpreterPool::handlers() const
+{
+    return handler_names.size();
+}
+
+/*
+ * Handler of the registry with the given id in the interpreter of a
+ * lease held
+ */
+PyDataHandlerPtr
+PyInterpreterPool::get_handler(PyInterpreterLease lease, PyHandlerId id) const
+{
+    if (id == DEFAULT_HANDLER) {
+        return slots[lease].handler;
+    }
+
+    if (id >= handler_names.size()) {
+        throw logic_error(error_info("No data handler with id: " +
+                                     lexical_cast<string>(id)));
+    }
+
+    return slots[lease].handlers[id - 1];
+}
+
+/*
+ * Number of free list shards
+ */
+unsigned int PyInterpreterPool::shards() const
+{
+    return shard.size();
+}
+
+/*
+ * Which free interpreter is booked first
+ */
+PyInterpreterReusePolicy PyInterpreterPool::reuse_policy() const
+{
+    return policy;
+}
+
+/*
+ * Initialize mutex, cond variable attributes checking if they memoery
+ * is Ok. Waiters use the monotonic clock for their deadlines.
+ */
+void PyInterpreterPool::init_mt_layer()
+{
+    FRAME;
+
+    if (!mutex) {
+        throw runtime_error(error_info("pthread_mutex not allocated"));
+    }
+
+    int rc = pthread_mutex_init(mutex, NULL);
+    if (rc != 0) {
+        throw runtime_error(sys_error_info(rc, "pthread_mutex_init"));
+    }
+
+    rc = pthread_condattr_init(&waiter_cond_attr);
+    if (rc != 0) {
+        throw runtime_error(sys_error_info(rc, "pthread_condattr_init"));
+    }
+
+    rc = pthread_condattr_setclock(&waiter_cond_attr, CLOCK_MONOTONIC);
+    if (rc != 0) {
+        throw runtime_error(sys_error_info(rc, "pthread_condattr_setclock"));
+    }
+
+    rc = pthread_key_create(&last_lease_key, NULL);
+    if (rc != 0) {
+        throw runtime_error(sys_error_info(rc, "pthread_key_create"));
+    }
+
+    for (unsigned int i = 0; i < shard.size(); i++) {
+        rc = pthread_mutex_init(&shard[i].mutex, NULL);
+        if (rc != 0) {
+            throw runtime_error(sys_error_info(rc, "pthread_mutex_init"));
+        }
+    }
+
+    rc = pthread_mutex_init(&scaler_mutex, NULL);
+    if (rc != 0) {
+        throw runtime_error(sys_error_info(rc, "pthread_mutex_init"));
+    }
+
+    rc = pthread_mutex_init(&reload_mutex, NULL);
+    if (rc != 0) {
+        throw runtime_error(sys_error_info(rc, "pthread_mutex_init"));
+    }
+
+    rc = pthread_mutex_init(&recycler_mutex, NULL);
+    if (rc != 0) {
+        throw runtime_error(sys_error_info(rc, "pthread_mutex_init"));
+    }
+
+    rc = pthread_cond_init(&recycler_cond, NULL);
+    if (rc != 0) {
+        throw runtime_error(sys_error_info(rc, "pthread_cond_init"));
+    }
+
+    rc = pthread_mutex_init(&watchdog_mutex, NULL);
+    if (rc != 0) {
+        throw runtime_error(sys_error_info(rc, "pthread_mutex_init"));
+    }
+
+    rc = pthread_cond_init(&watchdog_cond, &waiter_cond_attr);
+    if (rc != 0) {
+        throw runtime_error(sys_error_info(rc, "pthread_cond_init"));
+    }
+
+    rc = pthread_mutex_init(&expire_mutex, NULL);
+    if (rc != 0) {
+        throw runtime_error(sys_error_info(rc, "pthread_mutex_init"));
+    }
+
+    rc = pthread_cond_init(&scaler_cond, &waiter_cond_attr);
+    if (rc != 0) {
+        throw runtime_error(sys_error_info(rc, "pthread_cond_init"));
+    }
+}
+
+/*
+ * Only once, init python environment
+ */
+void PyInterpreterPool::init_python()
+{
+    FRAME;
+
+    Py_Initialize();
+#ifdef PY_OWN_GIL
+    PyEval_SaveThread();
+#else
+    // released with no thread state current, else the main thread
+    // would go on without taking it again
+    PyEval_InitThreads();
+    PyEval_SaveThread();
+#endif
+
+    INFO("Initialized python with threads");
+}
+
+/*
+ * Create interpreters in global critical section, the lower bound of
+ * an elastic pool
+ */
+void PyInterpreterPool::init_interpreters()
+{
+    FRAME;
+
+    unsigned int n = scaling.min_size;
+    if (scaling.progressive && n > 1) {
+        n = 1;
+    }
+
+    INFO("Creating interpreters: %lu", n);
+
+    for (unsigned int i = 0; i < n; i++) {
+        PyInterpreterThreadStatePtr interpreter = new_interpreter();
+        if (interpreter) {
+            slots[i].interpreter = interpreter;
+            slots[i].released_ms = monotonic_ms();
+            push_free(shard[i % shard.size()], i);
+            live_count++;
+            INFO("Created interpreter Py_NewInterpreter [%lu] %#lx", i, interpreter);
+        }
+    }
+
+    INFO("Created interpreters: %lu in shards: %lu", live_count, shard.size());
+}
+
+/*
+ * Create one interpreter in global critical section, from the main
+ * one. The caller thread state is not changed.
+ */
+PyInterpreterThreadStatePtr PyInterpreterPool::new_interpreter()
+{
+    FRAME;
+
+    PyGILGuard g;
+#ifdef PY_OWN_GIL
+    // each one with its own GIL
+    PyInterpreterConfig config;
+    config.use_main_obmalloc = 0;
+    config.allow_fork = 0;
+    config.allow_exec = 0;
+    config.allow_threads = 1;
+    config.allow_daemon_threads = 0;
+    config.check_multi_interp_extensions = 1;
+    config.gil = PyInterpreterConfig_OWN_GIL;
+
+    PyInterpreterThreadStatePtr interpreter = NULL;
+    PyStatus status = Py_NewInterpreterFromConfig(&interpreter, &config);
+    if (PyStatus_Exception(status)) {
+        throw runtime_error(error_info(string("Py_NewInterpreterFromConfig: ") +
+                                       (status.err_msg ? status.err_msg : "")));
+    }
+
+    // leave the GIL of the new interpreter, back to the main one
+    PyEval_SaveThread();
+    PyEval_RestoreThread(g.main_ts);
+#else
+    // the guard swaps the main thread state back
+    PyInterpreterThreadStatePtr interpreter = Py_NewInterpreter();
+#endif
+    if (!interpreter && PyErr_Occurred() != NULL) {
+        string error_message("Py_NewInterpreter");
+        Py_Error(error_message);
+        throw runtime_error(error_info(error_message));
+    }
+
+    return interpreter;
+}
+
+/*
+ * End the interpreter of the slot, not on any free list, in global
+ * critical section. The client is called first to release its objects.
+ * The watchdog may still be raising in it for the call which ended.
+ */
+void PyInterpreterPool::end_interpreter(PyInterpreterLease lease)
+{
+    FRAME;
+
+    {
+        LockGuard<pthread_mutex_t> em(&expire_mutex);
+    }
+
+    PyInterpreterSlot& s = slots[lease];
+    {
+        PyGILGuard g(s.interpreter);
+        if (retire_fn) {
+            retire_fn(retire_arg, lease);
+        }
+
+        release_handlers(s);
+    }
+
+#ifdef PY_OWN_GIL
+    PyEval_RestoreThread(s.interpreter);
+    Py_EndInterpreter(s.interpreter);
+#else
+    PyGILGuard g;
+    PyThreadState_Swap(s.interpreter);
+    Py_EndInterpreter(s.interpreter);
+    PyThreadState_Swap(NULL);
+#endif
+
+    INFO("Ended interpreter: %lu", lease);
+
+    s.interpreter = NULL;
+    s.state = SLOT_EMPTY;
+}
+
+/*
+ * Run the thread resizing an elastic pool
+ */
+void PyInterpreterPool::start_scaler()
+{
+    FRAME;
+
+    int rc = pthread_create(&scaler, NULL, scale, this);
+    if (rc != 0) {
+        throw runtime_error(sys_error_info(rc, "pthread_create"));
+    }
+
+    scaler_running = true;
+}
+
+void PyInterpreterPool::stop_scaler()
+{
+    FRAME;
+
+    if (!scaler_running) {
+        return;
+    }
+
+    {
+        LockGuard<pthread_mutex_t> sm(&scaler_mutex);
+        __atomic_store_n(&scaler_stop, true, __ATOMIC_RELAXED);
+        pthread_cond_signal(&scaler_cond);
+    }
+
+    pthread_join(scaler, NULL);
+    scaler_running = false;
+}
+
+/*
+ * Make the missing interpreters of the lower bound first. Then every
+ * period look at the waits since the last one. Under pressure add
+ * interpreters, one per waiting client at least, up to the upper
+ * bound. Otherwise end the ones idle for too long.
+ */
+void* PyInterpreterPool::scale(void* arg)
+{
+    FRAME;
+
+    PyInterpreterPool* p = (PyInterpreterPool*)arg;
+    const PyInterpreterScaling& sc = p->scaling;
+
+    if (p->size() < sc.min_size) {
+        try {
+            p->grow(sc.min_size - p->size(), false);
+            if (p->size() == sc.min_size) {
+                p->ready();
+            }
+        } catch(exception& e) {
+            INFO(string("Got exception: ") + e.what());
+        }
+    }
+
+    if (sc.min_size == sc.max_size) {
+        return NULL;
+    }
+
+    PyInterpreterPoolStats last = p->stats();
+    unsigned long last_waits = last.waits;
+    unsigned long last_wait_ns = last.wait_ns;
+    unsigned long last_timeouts = last.timeouts;
+
+    LockGuard<pthread_mutex_t> sm(&p->scaler_mutex);
+    while (!p->scaler_stop) {
+        struct timespec ts;
+        make_deadline(ts, sc.period_ms * 1000000ul);
+        pthread_cond_timedwait(&p->scaler_cond, &p->scaler_mutex, &ts);
+        if (p->scaler_stop) {
+            break;
+        }
+
+        PyInterpreterPoolStats st = p->stats();
+        unsigned long waits = st.waits - last_waits;
+        unsigned long wait_ns = st.wait_ns - last_wait_ns;
+        bool pressure = st.waiting >= sc.grow_waiters ||
+            st.timeouts != last_timeouts ||
+            (waits > 0 && wait_ns / waits >= sc.grow_wait_ns);
+        last_waits = st.waits;
+        last_wait_ns = st.wait_ns;
+        last_timeouts = st.timeouts;
+
+        pthread_mutex_unlock(&p->scaler_mutex);
+        try {
+            if (pressure && st.size < sc.max_size) {
+                unsigned int n = st.waiting > 1 ? st.waiting : 1;
+                p->grow(n < sc.max_size - st.size ? n : sc.max_size - st.size, true);
+            } else if (!pressure && st.size > sc.min_size) {
+                p->retire_idle();
+            }
+        } catch(exception& e) {
+            INFO(string("Got exception: ") + e.what());
+        }
+        pthread_mutex_lock(&p->scaler_mutex);
+    }
+
+    return NULL;
+}
+
+/*
+ * Add interpreters in the empty slots, each one made available as
+ * soon as its handler is built. The global mutex is taken for one
+ * interpreter at a time so that other pools can start meanwhile.
+ */
+void PyInterpreterPool::grow(unsigned int n, bool scaled)
+{
+    FRAME;
+
+    for (; n > 0 && !__atomic_load_n(&scaler_stop, __ATOMIC_RELAXED); n--) {
+        PyInterpreterLease lease = NO_LEASE;
+        {
+            LockGuard<pthread_mutex_t> gpm(&global_pool_mutex);
+
+            for (lease = 0; lease < pool_size && slots[lease].interpreter; lease++);
+            if (lease == pool_size) {
+                return;
+            }
+
+            PyInterpreterSlot& s = slots[lease];
+            s.interpreter = new_interpreter();
+            if (!s.interpreter) {
+                return;
+            }
+
+            try {
+                PyGILGuard g(s.interpreter);
+                build_handler(lease);
+            } catch (...) {
+                end_interpreter(lease);
+                throw;
+            }
+        }
+
+        __atomic_add_fetch(&live_count, 1, __ATOMIC_RELAXED);
+        if (scaled) {
+            __atomic_add_fetch(&grown_count, 1, __ATOMIC_RELAXED);
+        }
+
+        INFO("Added interpreter: %lu", lease);
+
+        put_back(lease);
+    }
+}
+
+/*
+ * End the interpreters free for too long, down to the lower bound. The
+ * free lists are ordered by release time so only their heads are
+ * looked at.
+ */
+void PyInterpreterPool::retire_idle()
+{
+    FRAME;
+
+    LockGuard<pthread_mutex_t> gpm(&global_pool_mutex);
+
+    unsigned long now = monotonic_ms();
+    vector<PyInterpreterLease> idle;
+    for (unsigned int i = 0; i < shard.size(); i++) {
+        LockGuard<pthread_mutex_t> sm(&shard[i].mutex);
+        while (shard[i].free_head != NO_LEASE &&
+               __atomic_load_n(&live_count, __ATOMIC_RELAXED) > scaling.min_size) {
+            PyInterpreterLease lease = shard[i].free_head;
+            if (now - slots[lease].released_ms < scaling.idle_ms) {
+                break;
+            }
+
+            unlink_free(shard[i], lease);
+            slots[lease].state = SLOT_EMPTY;
+            __atomic_sub_fetch(&live_count, 1, __ATOMIC_RELAXED);
+            idle.push_back(lease);
+        }
+    }
+
+    for (size_t i = 0; i < idle.size(); i++) {
+        end_interpreter(idle[i]);
+        __atomic_add_fetch(&retired_count, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Have the interpreter of the lease replaced once released
+ */
+void PyInterpreterPool::recycle(PyInterpreterLease lease)
+{
+    __atomic_store_n(&slots[lease].recycle, true, __ATOMIC_RELAXED);
+}
+
+/*
+ * Counts a call that failed, with its error still set. The interpreter
+ * is recycled, if told so, when it is not a plain exception of the
+ * handler: out of memory, an internal error or one not derived from
+ * Exception, like SystemExit, after which its state is not known.
+ */
+void PyInterpreterPool::failed(PyInterpreterLease lease)
+{
+    slots[lease].calls++;
+    if (!scaling.recycling.on_error) {
+        return;
+    }
+
+    if (!PyErr_Occurred() ||
+        !PyErr_ExceptionMatches(PyExc_Exception) ||
+        PyErr_ExceptionMatches(PyExc_MemoryError) ||
+        PyErr_ExceptionMatches(PyExc_SystemError)) {
+        recycle(lease);
+    }
+}
+
+/*
+ * Recycle the interpreter of the lease if its heap has grown too much,
+ * with the interpreter current
+ */
+void PyInterpreterPool::check_heap(PyInterpreterLease lease)
+{
+    PyInterpreterSlot& s = slots[lease];
+    long size = Py_HeapSize();
+    if (size >= 0 && s.heap_base >= 0 &&
+        size - s.heap_base > (long)scaling.recycling.max_heap_growth) {
+        recycle(lease);
+    }
+}
+
+/*
+ * Queue a released interpreter for the recycler, started by the
+ * first one
+ */
+void PyInterpreterPool::quarantine(PyInterpreterLease lease)
+{
+    FRAME;
+
+    INFO("Quarantined interpreter: %lu", lease);
+
+    LockGuard<pthread_mutex_t> rm(&recycler_mutex);
+
+    quarantined.push_back(lease);
+    if (!recycler_running) {
+        int rc = pthread_create(&recycler, NULL, recycle_quarantined, this);
+        if (rc != 0) {
+            throw runtime_error(sys_error_info(rc, "pthread_create"));
+        }
+
+        recycler_running = true;
+    }
+
+    pthread_cond_signal(&recycler_cond);
+}
+
+void PyInterpreterPool::stop_recycler()
+{
+    FRAME;
+
+    {
+        LockGuard<pthread_mutex_t> rm(&recycler_mutex);
+        if (!recycler_running) {
+            return;
+        }
+
+        recycler_stop = true;
+        pthread_cond_signal(&recycler_cond);
+    }
+
+    pthread_join(recycler, NULL);
+    recycler_running = false;
+}
+
+/*
+ * Thread renewing the quarantined interpreters one by one, in the
+ * order they were released. The ones left at stop are ended with the
+ * others.
+ */
+void* PyInterpreterPool::recycle_quarantined(void* arg)
+{
+    FRAME;
+
+    PyInterpreterPool* p = (PyInterpreterPool*)arg;
+
+    LockGuard<pthread_mutex_t> rm(&p->recycler_mutex);
+    while (true) {
+        while (p->quarantined.empty() && !p->recycler_stop) {
+            pthread_cond_wait(&p->recycler_cond, &p->recycler_mutex);
+        }
+
+        if (p->recycler_stop) {
+            break;
+        }
+
+        PyInterpreterLease lease = p->quarantined.front();
+        p->quarantined.erase(p->quarantined.begin());
+
+        pthread_mutex_unlock(&p->recycler_mutex);
+        try {
+            p->renew(lease);
+        } catch(exception& e) {
+            INFO(string("Got exception: ") + e.what());
+        }
+        pthread_mutex_lock(&p->recycler_mutex);
+    }
+
+    return NULL;
+}
+
+/*
+ * End the quarantined interpreter and make a new one in its slot, in
+ * global critical section as for the others, then put it back. The
+ * old one is ended first so that the two heaps are never there at
+ * once. If the new one cannot be made the slot is left empty.
+ */
+void PyInterpreterPool::renew(PyInterpreterLease lease)
+{
+    FRAME;
+
+    {
+        LockGuard<pthread_mutex_t> gpm(&global_pool_mutex);
+
+        PyInterpreterSlot& s = slots[lease];
+        end_interpreter(lease);
+        try {
+            s.interpreter = new_interpreter();
+            PyGILGuard g(s.interpreter);
+            build_handler(lease);
+        } catch (...) {
+            if (s.interpreter) {
+                end_interpreter(lease);
+            }
+
+            __atomic_sub_fetch(&busy_count, 1, __ATOMIC_RELAXED);
+            __atomic_sub_fetch(&live_count, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&retired_count, 1, __ATOMIC_RELAXED);
+            throw;
+        }
+    }
+
+    INFO("Recycled interpreter: %lu", lease);
+
+    __atomic_add_fetch(&recycled_count, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&busy_count, 1, __ATOMIC_RELAXED);
+    put_back(lease);
+}
+
+/*
+ * Set the deadline of the call about to be made by the holder of the
+ * lease, with the GIL of its interpreter held. The watchdog is started
+ * by the first one and woken up when it sleeps past the deadline.
+ */
+void PyInterpreterPool::watch(PyInterpreterLease lease, unsigned long deadline_ns)
+{
+    PyInterpreterSlot& s = slots[lease];
+    s.call_thread = (unsigned long)PyThreadState_Get()->thread_id;
+    s.expired = false;
+    __atomic_store_n(&s.deadline_ns, deadline_ns, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&watchdog_running, __ATOMIC_ACQUIRE) &&
+        deadline_ns >= __atomic_load_n(&watchdog_wake_ns, __ATOMIC_SEQ_CST)) {
+        return;
+    }
+
+    LockGuard<pthread_mutex_t> wm(&watchdog_mutex);
+    if (!watchdog_running) {
+        int rc = pthread_create(&watchdog, NULL, watch_calls, this);
+        if (rc != 0) {
+            // no call to unwatch, nor a deadline left for the next one
+            __atomic_store_n(&s.deadline_ns, NO_DEADLINE, __ATOMIC_SEQ_CST);
+            throw runtime_error(sys_error_info(rc, "pthread_create"));
+        }
+
+        __atomic_store_n(&watchdog_running, true, __ATOMIC_RELEASE);
+    }
+
+    pthread_cond_signal(&watchdog_cond);
+}
+
+/*
+ * Clear the deadline once the call is over, still with the GIL, and
+ * tell whether it expired. An exception raised after the call ended
+ * is dropped so that it does not hit the next one.
+ */
+bool PyInterpreterPool::unwatch(PyInterpreterLease lease)
+{
+    PyInterpreterSlot& s = slots[lease];
+    __atomic_store_n(&s.deadline_ns, NO_DEADLINE, __ATOMIC_SEQ_CST);
+    if (!s.expired) {
+        return false;
+    }
+
+    PyThreadState_SetAsyncExc(s.call_thread, NULL);
+    __atomic_add_fetch(&expired_count, 1, __ATOMIC_RELAXED);
+
+    return true;
+}
+
+void PyInterpreterPool::stop_watchdog()
+{
+    FRAME;
+
+    {
+        LockGuard<pthread_mutex_t> wm(&watchdog_mutex);
+        if (!watchdog_running) {
+            return;
+        }
+
+        watchdog_stop = true;
+        pthread_cond_signal(&watchdog_cond);
+    }
+
+    pthread_join(watchdog, NULL);
+    watchdog_running = false;
+}
+
+/*
+ * Watchdog thread sleeping until the earliest deadline, for good when
+ * no call has one. The time it sleeps until is published so that a
+ * call with an earlier deadline wakes it up. While it looks at the
+ * deadlines it is the most there is, the calls then take the mutex
+ * which they get once it sleeps again, having seen them or not.
+ */
+void* PyInterpreterPool::watch_calls(void* arg)
+{
+    FRAME;
+
+    PyInterpreterPool* p = (PyInterpreterPool*)arg;
+    PyExpiredCalls expired;
+
+    LockGuard<pthread_mutex_t> wm(&p->watchdog_mutex);
+    while (!p->watchdog_stop) {
+        __atomic_store_n(&p->watchdog_wake_ns, ULONG_MAX, __ATOMIC_SEQ_CST);
+        unsigned long next_ns = p->find_expired(expired);
+        if (!expired.empty()) {
+            pthread_mutex_unlock(&p->watchdog_mutex);
+            for (size_t i = 0; i < expired.size(); i++) {
+                try {
+                    p->expire_call(expired[i].first, expired[i].second);
+                } catch(exception& e) {
+                    INFO(string("Got exception: ") + e.what());
+                }
+            }
+            pthread_mutex_lock(&p->watchdog_mutex);
+            continue;
+        }
+
+        if (next_ns == NO_DEADLINE) {
+            pthread_cond_wait(&p->watchdog_cond, &p->watchdog_mutex);
+        } else {
+            __atomic_store_n(&p->watchdog_wake_ns, next_ns, __ATOMIC_SEQ_CST);
+            struct timespec ts;
+            ts.tv_sec = next_ns / 1000000000ul;
+            ts.tv_nsec = next_ns % 1000000000ul;
+            pthread_cond_timedwait(&p->watchdog_cond, &p->watchdog_mutex, &ts);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * The calls past their deadline, with it, and the earliest deadline of
+ * the others, none if there is no other one
+ */
+unsigned long PyInterpreterPool::find_expired(PyExpiredCalls& expired) const
+{
+    expired.clear();
+    unsigned long now = PyMetrics_Clock();
+    unsigned long next_ns = NO_DEADLINE;
+    for (PyInterpreterLease lease = 0; lease < pool_size; lease++) {
+        unsigned long deadline = __atomic_load_n(&slots[lease].deadline_ns, __ATOMIC_SEQ_CST);
+        if (deadline == NO_DEADLINE) {
+            continue;
+        }
+
+        if (deadline <= now) {
+            expired.push_back(make_pair(lease, deadline));
+        } else if (next_ns == NO_DEADLINE || deadline < next_ns) {
+            next_ns = deadline;
+        }
+    }
+
+    return next_ns;
+}
+
+/*
+ * Raise SystemExit in the thread of the call, it is not caught by the
+ * handlers catching Exception, and set the deadline to raise it again
+ * if the call goes on. The expire mutex keeps the interpreter from
+ * being ended meanwhile: a slot still having the deadline is still in
+ * the call, which is looked at again with its GIL taken as the call
+ * may have ended.
+ */
+void PyInterpreterPool::expire_call(PyInterpreterLease lease, unsigned long deadline_ns)
+{
+    FRAME;
+
+    LockGuard<pthread_mutex_t> em(&expire_mutex);
+
+    PyInterpreterSlot& s = slots[lease];
+    if (__atomic_load_n(&s.deadline_ns, __ATOMIC_SEQ_CST) != deadline_ns) {
+        return;
+    }
+
+#ifdef PY_OWN_GIL
+    PyGILGuard g(s.interpreter);
+#else
+    // a thread state of its own, the one of the slot is running the call
+    PyGILGuard g;
+#if PY_VERSION_HEX >= 0x03090000
+    PyThreadState* ts = PyThreadState_New(PyThreadState_GetInterpreter(s.interpreter));
+#else
+    PyThreadState* ts = PyThreadState_New(s.interpreter->interp);
+#endif
+    PyThreadState_Swap(ts);
+#endif
+    if (__atomic_load_n(&s.deadline_ns, __ATOMIC_SEQ_CST) == deadline_ns) {
+        INFO("Expired call of interpreter: %lu", lease);
+        s.expired = true;
+        PyThreadState_SetAsyncExc(s.call_thread, PyExc_SystemExit);
+        __atomic_store_n(&s.deadline_ns, PyMetrics_Clock() + WATCHDOG_PERIOD_US * 1000ul,
+                         __ATOMIC_SEQ_CST);
+    }
+#ifndef PY_OWN_GIL
+    PyThreadState_Swap(g.main_ts);
+    PyThreadState_Clear(ts);
+    PyThreadState_Delete(ts);
+#endif
+}
+
+/*
+  Release all interpreters and destroy synch layer in global citical
+  section, The mutex, cond variables being smart pointers will be
+  released automaticly so not need to do manually.
+*/
+void PyInterpreterPool::clean_interpreters()
+{
+    FRAME;
+
+    // first handlers, so that the pointers are not invalidated
+    for (PyInterpreterSlots::iterator it = slots.begin();
+         it != slots.end();
+         ++it) {
+        if (it->interpreter && it->handler) {
+            PyGILGuard g(it->interpreter);
+            release_handlers(*it);
+        }
+    }
+
+#ifdef PY_OWN_GIL
+    // its own GIL is taken with its last thread state and released
+    // as it ends
+    for (PyInterpreterSlots::iterator it = slots.begin();
+         it != slots.end();
+         ++it) {
+        if (it->interpreter) {
+            PyEval_RestoreThread(it->interpreter);
+            Py_EndInterpreter(it->interpreter);
+            it->interpreter = NULL;
+        }
+    }
+#else
+    PyGILGuard g;
+
+    // brutal for the busy ones, gracefull ending missing
+    for (PyInterpreterSlots::iterator it = slots.begin();
+         it != slots.end();
+         ++it) {
+        if (it->interpreter) {
+            PyThreadState_Swap(it->interpreter);
+            Py_EndInterpreter(it->interpreter);
+            PyThreadState_Swap(NULL);
+            it->interpreter = NULL;
+        }
+    }
+#endif
+}
+
+void PyInterpreterPool::clean_mt_layer()
+{
+    FRAME;
+
+    for (unsigned int i = 0; i < shard.size(); i++) {
+        int rc = pthread_mutex_destroy(&shard[i].mutex);
+        if (rc != 0) {
+            cerr << sys_error_info(rc, "pthread_mutex_destroy") << endl;
+        }
+    }
+
+    int rc = pthread_mutex_destroy(mutex);
+    if (rc != 0) {
+        cerr << sys_error_info(rc, "pthread_mutex_destroy") << endl;
+    } else {
+        delete mutex;
+    }
+
+    rc = pthread_condattr_destroy(&waiter_cond_attr);
+    if (rc != 0) {
+        cerr << sys_error_info(rc, "pthread_condattr_destroy") << endl;
+    }
+
+    rc = pthread_key_delete(last_lease_key);
+    if (rc != 0) {
+        cerr << sys_error_info(rc, "pthread_key_delete") << endl;
+    }
+
+    rc = pthread_cond_destroy(&scaler_cond);
+    if (rc != 0) {
+        cerr << sys_error_info(rc, "pthread_cond_destroy") << endl;
+    }
+
+    rc = pthread_cond_destroy(&watchdog_cond);
+    if (rc != 0) {
+        cerr << sys_error_info(rc, "pthread_cond_destroy") << endl;
+    }
+
+    rc = pthread_mutex_destroy(&watchdog_mutex);
+    if (rc != 0) {
+        cerr << sys_error_info(rc, "pthread_mutex_destroy") << endl;
+    }
+
+    rc = pthread_mutex_destroy(&expire_mutex);
+    if (rc != 0) {
+        cerr << sys_error_info(rc, "pthread_mutex_destroy") << endl;
+    }
+
+    rc = pthread_cond_destroy(&recycler_cond);
+    if (rc != 0) {
+        cerr << sys_error_info(rc, "pthread_cond_destroy") << endl;
+    }
+
+    rc = pthread_mutex_destroy(&recycler_mutex);
+    if (rc != 0) {
+        cerr << sys_error_info(rc, "pthread_mutex_destroy") << endl;
+    }
+
+    rc = pthread_mutex_destroy(&reload_mutex);
+    if (rc != 0) {
+        cerr << sys_error_info(rc, "pthread_mutex_destroy") << endl;
+    }
+
+    rc = pthread_mutex_destroy(&scaler_mutex);
+    if (rc != 0) {
+        cerr << sys_error_info(rc, "pthread_mutex_destroy") << endl;
+    }
+}
+
+void PyInterpreterPool::clean_python()
+{
+    FRAME;
+
+    PyGILGuard g(false);
+
+    Py_Finalize();
+    // No GIL anuymore, so no matching release, the guard is fake
+}
+
+/*
+ * Class invariant may not be violated:
+ * - number of data handlers is the same as live interpreters
+ * - numer of free and busy inerpreters is same as live interpreters
+ * It is checked with no concurrent clients.
+ */
+void PyInterpreterPool::invariant() const
+{
+    unsigned int free_count = 0;
+    for (unsigned int i = 0; i < shard.size(); i++) {
+        free_count += shard[i].free_count;
+    }
+
+    assert(free_count + busy_count == live_count);
+    assert(handlers_count == live_count);
+}
+
+/*
+ * Link the slot at the tail of the free list of the shard. It has do
+ * be done in a scope of the shard guard, a critical section, while
+ * managing free interpreter pool.
+ */
+void PyInterpreterPool::push_free(PyInterpreterShard& sh, PyInterpreterLease lease)
+{
+    PyInterpreterSlot& s = slots[lease];
+    s.state = SLOT_FREE;
+    __atomic_store_n(&s.shard, (unsigned int)(&sh - &shard[0]), __ATOMIC_RELAXED);
+    s.next = NO_LEASE;
+    s.prev = sh.free_tail;
+    if (sh.free_tail == NO_LEASE) {
+        sh.free_head = lease;
+    } else {
+        slots[sh.free_tail].next = lease;
+    }
+
+    sh.free_tail = lease;
+    __atomic_store_n(&sh.free_count, sh.free_count + 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Unlink the slot the reuse policy picks from the free list of the
+ * shard marking it busy: the head is the coldest one, the tail the one
+ * released last. Same critical section as above is needed.
+ */
+PyInterpreterLease PyInterpreterPool::pop_free(PyInterpreterShard& sh)
+{
+    PyInterpreterLease lease = policy == REUSE_FIFO ? sh.free_head : sh.free_tail;
+    if (lease == NO_LEASE) {
+        throw logic_error(error_info("Cant find interpreter in free list"));
+    }
+
+    unlink_free(sh, lease);
+    book(lease);
+
+    return lease;
+}
+
+/*
+ * Unlink the slot from any place of the free list of the shard. Same
+ * critical section as above is needed.
+ */
+void PyInterpreterPool::unlink_free(PyInterpreterShard& sh, PyInterpreterLease lease)
+{
+    PyInterpreterSlot& s = slots[lease];
+    if (s.prev == NO_LEASE) {
+        sh.free_head = s.next;
+    } else {
+        slots[s.prev].next = s.next;
+    }
+
+    if (s.next == NO_LEASE) {
+        sh.free_tail = s.prev;
+    } else {
+        slots[s.next].prev = s.prev;
+    }
+
+    s.prev = s.next = NO_LEASE;
+    __atomic_store_n(&s.shard, NO_SHARD, __ATOMIC_RELAXED);
+    __atomic_store_n(&sh.free_count, sh.free_count - 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Mark the slot busy, it is not on any free list
+ */
+void PyInterpreterPool::book(PyInterpreterLease lease)
+{
+    FRAME;
+
+    __atomic_store_n(&slots[lease].state, SLOT_BUSY, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&busy_count, 1, __ATOMIC_RELAXED);
+
+    INFO("Booked interpreter: %lu", lease);
+}
+
+/*
+ * Book a free interpreter from the given shard or, if it is empty,
+ * steal one from the next non empty shard. Empty shards are skipped
+ * without taking their lock.
+ */
+PyInterpreterLease PyInterpreterPool::take_free(unsigned int from)
+{
+    for (unsigned int i = 0; i < shard.size(); i++) {
+        PyInterpreterShard& sh = shard[(from + i) % shard.size()];
+        if (__atomic_load_n(&sh.free_count, __ATOMIC_RELAXED) == 0) {
+            continue;
+        }
+
+        LockGuard<pthread_mutex_t> sm(&sh.mutex);
+        if (sh.free_head != NO_LEASE) {
+            return pop_free(sh);
+        }
+    }
+
+    return NO_LEASE;
+}
+
+/*
+ * Book the interpreter the calling thread used last if it is still on
+ * some free list. The shard it is linked in is read without its lock
+ * so it is checked again once locked.
+ */
+PyInterpreterLease PyInterpreterPool::take_last_used()
+{
+    size_t last = (size_t)pthread_getspecific(last_lease_key);
+    if (last == 0) {
+        return NO_LEASE;
+    }
+
+    PyInterpreterLease lease = last - 1;
+
+    return take(lease) ? lease : NO_LEASE;
+}
+
+/*
+ * Book the given interpreter if it is on a free list
+ */
+bool PyInterpreterPool::take(PyInterpreterLease lease)
+{
+    unsigned int sh = __atomic_load_n(&slots[lease].shard, __ATOMIC_RELAXED);
+    if (sh == NO_SHARD) {
+        return false;
+    }
+
+    LockGuard<pthread_mutex_t> sm(&shard[sh].mutex);
+    if (slots[lease].shard != sh) {
+        return false;
+    }
+
+    unlink_free(shard[sh], lease);
+    book(lease);
+
+    return true;
+}
+
+/*
+ * Queue the caller and park it on its own condition until a lease is
+ * handed to it or the deadline passes. The pool mutex serializes the
+ * queue, the waiter is announced before the last look at the shards
+ * so that a concurrent dealloc either is seen or sees the waiter.
+ */
+PyInterpreterLease
+PyInterpreterPool::wait_free(unsigned int from, unsigned int max_timeout_ns)
+{
+    FRAME;
+
+    LockGuard<pthread_mutex_t> m(mutex);
+
+    __atomic_add_fetch(&waiting_count, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    PyInterpreterLease lease = NO_LEASE;
+    if (!waiter_head) {
+        lease = take_free(from);
+    }
+
+    int rc = 0;
+    if (lease == NO_LEASE) {
+        PyInterpreterWaiter w;
+        rc = pthread_cond_init(&w.cond, &waiter_cond_attr);
+        if (rc != 0) {
+            __atomic_sub_fetch(&waiting_count, 1, __ATOMIC_SEQ_CST);
+            throw runtime_error(sys_error_info(rc, "pthread_cond_init"));
+        }
+
+        struct timespec ts;
+        make_deadline(ts, max_timeout_ns);
+        unsigned long started_ns = monotonic_ns();
+
+        push_waiter(w);
+        while (w.lease == NO_LEASE && rc == 0) {
+            rc = pthread_cond_timedwait(&w.cond, mutex, &ts);
+        }
+
+        __atomic_add_fetch(&waits_count, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&wait_ns, monotonic_ns() - started_ns, __ATOMIC_RELAXED);
+
+        // a lease handed off at the deadline is still taken
+        lease = w.lease;
+        if (lease == NO_LEASE) {
+            unlink_waiter(w);
+        }
+
+        pthread_cond_destroy(&w.cond);
+    }
+
+    __atomic_sub_fetch(&waiting_count, 1, __ATOMIC_SEQ_CST);
+
+    if (lease == NO_LEASE) {
+        __atomic_add_fetch(&timeouts_count, 1, __ATOMIC_RELAXED);
+        throw runtime_error(sys_error_info(rc, "pthread_cond_timedwait"));
+    }
+
+    return lease;
+}
+
+/*
+ * Append the waiter at the tail of the queue, under the pool mutex
+ */
+void PyInterpreterPool::push_waiter(PyInterpreterWaiter& w)
+{
+    w.next = NULL;
+    w.prev = waiter_tail;
+    if (waiter_tail) {
+        waiter_tail->next = &w;
+    } else {
+        waiter_head = &w;
+    }
+
+    waiter_tail = &w;
+}
+
+/*
+ * Remove the waiter from any place of the queue, under the pool mutex
+ */
+void PyInterpreterPool::unlink_waiter(PyInterpreterWaiter& w)
+{
+    if (w.prev) {
+        w.prev->next = w.next;
+    } else {
+        waiter_head = w.next;
+    }
+
+    if (w.next) {
+        w.next->prev = w.prev;
+    } else {
+        waiter_tail = w.prev;
+    }
+
+    w.prev = w.next = NULL;
+}
+
+/*
+ * Give the booked lease to the oldest waiter and wake only it up. It
+ * is done under the pool mutex so the waiter can not leave before the
+ * signal. An asynchronous waiter is returned to be resumed once the
+ * mutex is released.
+ */
+PyInterpreterWaiter* PyInterpreterPool::hand_off(PyInterpreterLease lease)
+{
+    FRAME;
+
+    PyInterpreterWaiter* w = waiter_head;
+    unlink_waiter(*w);
+    w->lease = lease;
+
+    INFO("Handed off interpreter: %lu", lease);
+
+    if (w->resume) {
+        __atomic_sub_fetch(&waiting_count, 1, __ATOMIC_SEQ_CST);
+        return w;
+    }
+
+    int rc = pthread_cond_signal(&w->cond);
+    if (rc != 0) {
+        throw runtime_error(sys_error_info(rc, "pthread_cond_signal"));
+    }
+
+    return NULL;
+}
+
+/*
+ * Resume an asynchronous waiter. A resumed client releasing its lease
+ * resumes the next one, so the waiters resumed meanwhile in this thread
+ * are queued and resumed in turn by the outermost call, not nested.
+ */
+static __thread PyInterpreterWaiter* resume_head = NULL;
+static __thread PyInterpreterWaiter* resume_tail = NULL;
+static __thread bool resuming = false;
+
+void PyInterpreterPool::resume(PyInterpreterWaiter* w)
+{
+    if (!w) {
+        return;
+    }
+
+    w->next = NULL;
+    if (resume_tail) {
+        resume_tail->next = w;
+    } else {
+        resume_head = w;
+    }
+
+    resume_tail = w;
+    if (resuming) {
+        return;
+    }
+
+    resuming = true;
+    try {
+        while (resume_head) {
+            // the waiter may be gone once resumed
+            PyInterpreterWaiter* next = resume_head;
+            resume_head = next->next;
+            if (!resume_head) {
+                resume_tail = NULL;
+            }
+
+            next->resume(next->arg, next->lease);
+        }
+    } catch (...) {
+        resuming = false;
+        throw;
+    }
+
+    resuming = false;
 }
@@ -0,0 +1,435 @@
+#include <string>
+
+#include "config.h"
+
+#include "py_python.h"
+
+#include "py_map_view.h"
+
+using namespace std;
+
+/*
+ * The view refers to one of the maps, none once detached
+ */
+struct PyMapView
+{
+    PyObject_HEAD
+    const MapString2String* map;
+    const MultimapString2String* multimap;
+};
+
+enum PyMapViewPart
+{
+    VIEW_KEYS,
+    VIEW_VALUES,
+    VIEW_ITEMS
+};
+
+static bool map_view_attached(PyMapView* v)
+{
+    if (!v->map && !v->multimap) {
+        PyErr_SetString(PyExc_RuntimeError, "map view used after the call");
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Key of the map from a python string, false if it is not a string
+ */
+static bool map_view_key(PyObject* key, string& k)
+{
+#if PY_MAJOR_VERSION >= 3
+    if (!PyUnicode_Check(key)) {
+        return false;
+    }
+
+    Py_ssize_t n = 0;
+    const char* s = PyUnicode_AsUTF8AndSize(key, &n);
+    if (!s) {
+        PyErr_Clear();
+        return false;
+    }
+
+    k.assign(s, n);
+#else
+    if (PyString_Check(key)) {
+        k.assign(PyString_AS_STRING(key), PyString_GET_SIZE(key));
+    } else if (PyUnicode_Check(key)) {
+        PyObject* s = PyUnicode_AsUTF8String(key);
+        if (!s) {
+            PyErr_Clear();
+            return false;
+        }
+
+        k.assign(PyString_AS_STRING(s), PyString_GET_SIZE(s));
+        Py_DECREF(s);
+    } else {
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+/*
+ * Value of the key, the last one of a multimap as a dict made of it
+ * would keep
+ */
+static const string* map_view_find(PyMapView* v, const string& k)
+{
+    if (v->map) {
+        MapString2String::const_iterator it = v->map->find(k);
+        return it == v->map->end() ? NULL : &it->second;
+    }
+
+    MultimapString2String::const_iterator it = v->multimap->upper_bound(k);
+    if (it == v->multimap->begin()) {
+        return NULL;
+    }
+
+    --it;
+    return it->first == k ? &it->second : NULL;
+}
+
+static PyObject* map_view_string(const string& s)
+{
+    return PyString_FromStringAndSize(s.data(), s.size());
+}
+
+/*
+ * List of the keys, the values or the items, one per distinct key
+ */
+template <typename M>
+static PyObject* map_view_list(const M& m, PyMapViewPart part)
+{
+    PyObject* list = PyList_New(0);
+    if (!list) {
+        return NULL;
+    }
+
+    for (typename M::const_iterator it = m.begin(); it != m.end();) {
+        typename M::const_iterator next = m.upper_bound(it->first);
+        typename M::const_iterator last = next;
+        --last;
+
+        PyObject* item = NULL;
+        if (part == VIEW_KEYS) {
+            item = map_view_string(it->first);
+        } else if (part == VIEW_VALUES) {
+            item = map_view_string(last->second);
+        } else {
+            PyObject* key = map_view_string(it->first);
+            PyObject* value = key ? map_view_string(last->second) : NULL;
+            item = value ? PyTuple_Pack(2, key, value) : NULL;
+            Py_XDECREF(key);
+            Py_XDECREF(value);
+        }
+
+        if (!item || PyList_Append(list, item) != 0) {
+            Py_XDECREF(item);
+            Py_DECREF(list);
+            return NULL;
+        }
+
+        Py_DECREF(item);
+        it = next;
+    }
+
+    return list;
+}
+
+static PyObject* map_view_part(PyMapView* v, PyMapViewPart part)
+{
+    if (!map_view_attached(v)) {
+        return NULL;
+    }
+
+    return v->map ? map_view_list(*v->map, part) : map_view_list(*v->multimap, part);
+}
+
+static Py_ssize_t map_view_length(PyObject* self)
+{
+    PyMapView* v = (PyMapView*)self;
+    if (!map_view_attached(v)) {
+        return -1;
+    }
+
+    if (v->map) {
+        return v->map->size();
+    }
+
+    Py_ssize_t n = 0;
+    for (MultimapString2String::const_iterator it = v->multimap->begin();
+         it != v->multimap->end();
+         it = v->multimap->upper_bound(it->first)) {
+        n++;
+    }
+
+    return n;
+}
+
+static PyObject* map_view_subscript(PyObject* self, PyObject* key)
+{
+    PyMapView* v = (PyMapView*)self;
+    if (!map_view_attached(v)) {
+        return NULL;
+    }
+
+    string k;
+    const string* value = map_view_key(key, k) ? map_view_find(v, k) : NULL;
+    if (!value) {
+        PyErr_SetObject(PyExc_KeyError, key);
+        return NULL;
+    }
+
+    return map_view_string(*value);
+}
+
+static int map_view_contains(PyObject* self, PyObject* key)
+{
+    PyMapView* v = (PyMapView*)self;
+    if (!map_view_attached(v)) {
+        return -1;
+    }
+
+    string k;
+    return map_view_key(key, k) && map_view_find(v, k) ? 1 : 0;
+}
+
+static PyObject* map_view_iter(PyObject* self)
+{
+    PyObject* keys = map_view_part((PyMapView*)self, VIEW_KEYS);
+    if (!keys) {
+        return NULL;
+    }
+
+    PyObject* it = PyObject_GetIter(keys);
+    Py_DECREF(keys);
+
+    return it;
+}
+
+static PyObject* map_view_keys(PyObject* self, PyObject* unused)
+{
+    return map_view_part((PyMapView*)self, VIEW_KEYS);
+}
+
+static PyObject* map_view_values(PyObject* self, PyObject* unused)
+{
+    return map_view_part((PyMapView*)self, VIEW_VALUES);
+}
+
+static PyObject* map_view_items(PyObject* self, PyObject* unused)
+{
+    return map_view_part((PyMapView*)self, VIEW_ITEMS);
+}
+
+static PyObject* map_view_get(PyObject* self, PyObject* args)
+{
+    PyObject* key = NULL;
+    PyObject* def = Py_None;
+    if (!PyArg_ParseTuple(args, "O|O:get", &key, &def)) {
+        return NULL;
+    }
+
+    PyMapView* v = (PyMapView*)self;
+    if (!map_view_attached(v)) {
+        return NULL;
+    }
+
+    string k;
+    const string* value = map_view_key(key, k) ? map_view_find(v, k) : NULL;
+    if (!value) {
+        Py_INCREF(def);
+        return def;
+    }
+
+    return map_view_string(*value);
+}
+
+/*
+ * All the values of the key in the order of the multimap
+ */
+static PyObject* map_view_getall(PyObject* self, PyObject* key)
+{
+    PyMapView* v = (PyMapView*)self;
+    if (!map_view_attached(v)) {
+        return NULL;
+    }
+
+    PyObject* list = PyList_New(0);
+    string k;
+    if (!list || !map_view_key(key, k)) {
+        return list;
+    }
+
+    if (v->map) {
+        const string* value = map_view_find(v, k);
+        PyObject* item = value ? map_view_string(*value) : NULL;
+        if (value && (!item || PyList_Append(list, item) != 0)) {
+            Py_XDECREF(item);
+            Py_DECREF(list);
+            return NULL;
+        }
+
+        Py_XDECREF(item);
+        return list;
+    }
+
+    typedef pair<MultimapString2StringConstIterator, MultimapString2StringConstIterator> Range;
+    Range r = v->multimap->equal_range(k);
+    for (MultimapString2StringConstIterator it = r.first; it != r.second; ++it) {
+        PyObject* item = map_view_string(it->second);
+        if (!item || PyList_Append(list, item) != 0) {
+            Py_XDECREF(item);
+            Py_DECREF(list);
+            return NULL;
+        }
+
+        Py_DECREF(item);
+    }
+
+    return list;
+}
+
+#if PY_MAJOR_VERSION < 3
+static PyObject* map_view_has_key(PyObject* self, PyObject* key)
+{
+    int rc = map_view_contains(self, key);
+    if (rc < 0) {
+        return NULL;
+    }
+
+    return PyBool_FromLong(rc);
+}
+#endif
+
+static void map_view_dealloc(PyObject* self)
+{
+#if PY_MAJOR_VERSION >= 3
+    PyTypeObject* type = Py_TYPE(self);
+    PyObject_Free(self);
+    Py_DECREF(type);
+#else
+    PyObject_Del(self);
+#endif
+}
+
+static PyMethodDef map_view_methods[] = {
+    {"keys", map_view_keys, METH_NOARGS, "List of the keys"},
+    {"values", map_view_values, METH_NOARGS, "List of the values"},
+    {"items", map_view_items, METH_NOARGS, "List of the (key, value) pairs"},
+    {"get", map_view_get, METH_VARARGS, "Value of the key or the default"},
+    {"getall", map_view_getall, METH_O, "List of all the values of the key"},
+#if PY_MAJOR_VERSION < 3
+    {"has_key", map_view_has_key, METH_O, "True if the key is there"},
+#endif
+    {NULL, NULL, 0, NULL}
+};
+
+#define MAP_VIEW_TYPE_NAME "pyinterp.MapView"
+#define MAP_VIEW_TYPE_DOC "Read only view of a map of the caller"
+
+#if PY_MAJOR_VERSION >= 3
+static PyType_Slot map_view_slots[] = {
+    {Py_tp_dealloc, (void*)map_view_dealloc},
+    {Py_tp_iter, (void*)map_view_iter},
+    {Py_tp_methods, (void*)map_view_methods},
+    {Py_tp_doc, (void*)MAP_VIEW_TYPE_DOC},
+    {Py_mp_length, (void*)map_view_length},
+    {Py_mp_subscript, (void*)map_view_subscript},
+    {Py_sq_contains, (void*)map_view_contains},
+    {0, NULL}
+};
+
+static PyType_Spec map_view_spec = {
+    MAP_VIEW_TYPE_NAME,
+    sizeof(PyMapView),
+    0,
+    Py_TPFLAGS_DEFAULT,
+    map_view_slots
+};
+#else
+static PyMappingMethods map_view_mapping;
+static PySequenceMethods map_view_sequence;
+static PyTypeObject map_view_type;
+static bool map_view_type_ready = false;
+#endif
+
+/*
+ * A heap type of this interpreter in python 3, with the interpreters
+ * sharing the GIL of python 2 the one static type for all of them
+ */
+PyObject* PyMapView_NewType()
+{
+#if PY_MAJOR_VERSION >= 3
+    return PyType_FromSpec(&map_view_spec);
+#else
+    if (!map_view_type_ready) {
+        map_view_mapping.mp_length = map_view_length;
+        map_view_mapping.mp_subscript = map_view_subscript;
+        map_view_sequence.sq_contains = map_view_contains;
+        Py_REFCNT(&map_view_type) = 1;
+        map_view_type.tp_name = MAP_VIEW_TYPE_NAME;
+        map_view_type.tp_doc = MAP_VIEW_TYPE_DOC;
+        map_view_type.tp_basicsize = sizeof(PyMapView);
+        map_view_type.tp_flags = Py_TPFLAGS_DEFAULT;
+        map_view_type.tp_dealloc = map_view_dealloc;
+        map_view_type.tp_iter = map_view_iter;
+        map_view_type.tp_methods = map_view_methods;
+        map_view_type.tp_as_mapping = &map_view_mapping;
+        map_view_type.tp_as_sequence = &map_view_sequence;
+        if (PyType_Ready(&map_view_type) != 0) {
+            return NULL;
+        }
+
+        map_view_type_ready = true;
+    }
+
+    Py_INCREF(&map_view_type);
+    return (PyObject*)&map_view_type;
+#endif
+}
+
+PyObject* PyMapView_FromMap(PyObject* type, const MapString2String* map)
+{
+    PyObject* v = (PyObject*)PyObject_New(PyMapView, (PyTypeObject*)type);
+    if (v) {
+        PyMapView_AttachMap(v, map);
+    }
+
+    return v;
+}
+
+PyObject* PyMapView_FromMultimap(PyObject* type, const MultimapString2String* multimap)
+{
+    PyObject* v = (PyObject*)PyObject_New(PyMapView, (PyTypeObject*)type);
+    if (v) {
+        PyMapView_AttachMultimap(v, multimap);
+    }
+
+    return v;
+}
+
+void PyMapView_AttachMap(PyObject* view, const MapString2String* map)
+{
+    PyMapView* v = (PyMapView*)view;
+    v->map = map;
+    v->multimap = NULL;
+}
+
+void PyMapView_AttachMultimap(PyObject* view, const MultimapString2String* multimap)
+{
+    PyMapView* v = (PyMapView*)view;
+    v->map = NULL;
+    v->multimap = multimap;
+}
+
+void PyMapView_Detach(PyObject* view)
+{
+    PyMapView* v = (PyMapView*)view;
+    v->map = NULL;
+    v->multimap = NULL;
+}
@@ -0,0 +1,214 @@
+#include <cstring>
+
+#include "config.h"
+
+#include <pthread.h>
+
+#include "aligned_allocator.h"
+#include "py_metrics.h"
+
+using namespace std;
+
+unsigned long PyMetrics::instances_no = 0;
+
+/*
+ * The block of the thread for the last recorders it used, by their
+ * unique id so that a recorder gone is never matched again
+ */
+struct PyMetricsCacheEntry
+{
+    unsigned long id;
+    PyMetricsBlock* block;
+};
+
+static __thread PyMetricsCacheEntry metrics_cache[METRICS_CACHE_SIZE];
+
+unsigned int PyHistogram::bucket(unsigned long value)
+{
+    if (value < METRICS_SUB_BUCKETS) {
+        return value;
+    }
+
+    unsigned int e = 63 - __builtin_clzl(value);
+    if (e > METRICS_MAX_EXPONENT) {
+        return METRICS_BUCKETS - 1;
+    }
+
+    unsigned int sub = (value >> (e - METRICS_SUB_BUCKET_BITS)) & (METRICS_SUB_BUCKETS - 1);
+
+    return (e - METRICS_SUB_BUCKET_BITS + 1) * METRICS_SUB_BUCKETS + sub;
+}
+
+/*
+ * The highest value counted in the bucket
+ */
+unsigned long PyHistogram::bucket_value(unsigned int bucket)
+{
+    if (bucket < METRICS_SUB_BUCKETS) {
+        return bucket;
+    }
+
+    unsigned int e = bucket / METRICS_SUB_BUCKETS + METRICS_SUB_BUCKET_BITS - 1;
+    unsigned long sub = bucket % METRICS_SUB_BUCKETS;
+
+    return ((METRICS_SUB_BUCKETS + sub + 1) << (e - METRICS_SUB_BUCKET_BITS)) - 1;
+}
+
+/*
+ * A value taken by the owner of the histogram, not shared
+ */
+void PyHistogram::record(unsigned long value)
+{
+    buckets[bucket(value)]++;
+    count++;
+    sum += value;
+    if (value > max) {
+        max = value;
+    }
+}
+
+void PyHistogram::add(const PyHistogram& other)
+{
+    for (unsigned int i = 0; i < buckets.size(); i++) {
+        buckets[i] += other.buckets[i];
+    }
+
+    count += other.count;
+    sum += other.sum;
+    if (other.max > max) {
+        max = other.max;
+    }
+}
+
+/*
+ * Value below which p percent of the recorded ones are, never more
+ * than the maximum recorded
+ */
+unsigned long PyHistogram::percentile(double p) const
+{
+    if (count == 0) {
+        return 0;
+    }
+
+    unsigned long rank = (unsigned long)(p / 100.0 * count + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    unsigned long seen = 0;
+    for (unsigned int i = 0; i < buckets.size(); i++) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            unsigned long v = bucket_value(i);
+            return v < max ? v : max;
+        }
+    }
+
+    return max;
+}
+
+double PyHistogram::mean() const
+{
+    return count ? (double)sum / count : 0.0;
+}
+
+PyMetrics::PyMetrics():
+    id(__atomic_add_fetch(&instances_no, 1, __ATOMIC_RELAXED)),
+    blocks(NULL)
+{
+}
+
+PyMetrics::~PyMetrics()
+{
+    while (blocks) {
+        PyMetricsBlock* b = blocks;
+        blocks = b->next;
+        aligned_delete(b);
+    }
+}
+
+/*
+ * Only the thread owning the block writes it, the relaxed stores keep
+ * the snapshots free of torn values
+ */
+void PyMetrics::record(PyMetric m, unsigned long ns)
+{
+    PyMetricsBlock* b = block();
+    unsigned int i = PyHistogram::bucket(ns);
+    __atomic_store_n(&b->buckets[m][i], b->buckets[m][i] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&b->sum[m], b->sum[m] + ns, __ATOMIC_RELAXED);
+    if (ns > b->max[m]) {
+        __atomic_store_n(&b->max[m], ns, __ATOMIC_RELAXED);
+    }
+
+    __atomic_store_n(&b->count[m], b->count[m] + 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Sum of the histograms of all the threads, one per metric. The counts
+ * are read while being written so they may differ a bit from each
+ * other.
+ */
+void PyMetrics::snapshot(PyHistogram* histograms) const
+{
+    for (unsigned int m = 0; m < METRICS_NO; m++) {
+        histograms[m] = PyHistogram();
+    }
+
+    for (PyMetricsBlock* b = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); b; b = b->next) {
+        for (unsigned int m = 0; m < METRICS_NO; m++) {
+            PyHistogram& h = histograms[m];
+            h.count += __atomic_load_n(&b->count[m], __ATOMIC_RELAXED);
+            h.sum += __atomic_load_n(&b->sum[m], __ATOMIC_RELAXED);
+            unsigned long max = __atomic_load_n(&b->max[m], __ATOMIC_RELAXED);
+            if (max > h.max) {
+                h.max = max;
+            }
+
+            for (unsigned int i = 0; i < METRICS_BUCKETS; i++) {
+                h.buckets[i] += __atomic_load_n(&b->buckets[m][i], __ATOMIC_RELAXED);
+            }
+        }
+    }
+}
+
+/*
+ * Block of the calling thread, made and linked at its first record
+ */
+PyMetricsBlock* PyMetrics::block()
+{
+    PyMetricsCacheEntry& e = metrics_cache[id % METRICS_CACHE_SIZE];
+    if (e.id == id) {
+        return e.block;
+    }
+
+    pthread_t self = pthread_self();
+    PyMetricsBlock* b = find_block(self);
+    if (!b) {
+        b = aligned_new<PyMetricsBlock>();
+        memset(b->count, 0, sizeof(b->count));
+        memset(b->sum, 0, sizeof(b->sum));
+        memset(b->max, 0, sizeof(b->max));
+        memset(b->buckets, 0, sizeof(b->buckets));
+        b->thread = self;
+        b->next = __atomic_load_n(&blocks, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&blocks, &b->next, b, true,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+    }
+
+    e.id = id;
+    e.block = b;
+
+    return b;
+}
+
+PyMetricsBlock* PyMetrics::find_block(pthread_t thread) const
+{
+    for (PyMetricsBlock* b = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); b; b = b->next) {
+        if (pthread_equal(b->thread, thread)) {
+            return b;
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,314 @@
+#include <string>
+
+#include "config.h"
+
+#include "py_python.h"
+#include <pthread.h>
+#ifdef PY_OWN_GIL
+#include <marshal.h>
+#else
+#include <python2.7/marshal.h>
+#endif
+
+#include "lock_guard.h"
+#include "py_preload.h"
+
+#define PRELOAD_MODULE "_py_preload"
+
+using namespace std;
+
+/*
+ * Collecting and importing is done in python, the same source for
+ * python 2 and 3: the importer has both the old find_module protocol
+ * and the find_spec one.
+ */
+static const char* preload_source =
+    "import marshal, os, sys, types\n"
+    "\n"
+    "def loaded():\n"
+    "    return list(sys.modules.keys())\n"
+    "\n"
+    "def collect(before):\n"
+    "    before = set(before)\n"
+    "    found = []\n"
+    "    for name, module in list(sys.modules.items()):\n"
+    "        if name in before or module is None:\n"
+    "            continue\n"
+    "        path = getattr(module, '__file__', None) or ''\n"
+    "        if path.endswith('.pyc') or path.endswith('.pyo'):\n"
+    "            path = path[:-1]\n"
+    "        if not path.endswith('.py') or not os.path.isfile(path):\n"
+    "            continue\n"
+    "        with open(path, 'rb') as f:\n"
+    "            source = f.read()\n"
+    "        code = compile(source, path, 'exec', 0, True)\n"
+    "        found.append((name, marshal.dumps(code), path, hasattr(module, '__path__')))\n"
+    "    return found\n"
+    "\n"
+    "class PyPreloadImporter(object):\n"
+    "    def __init__(self, modules):\n"
+    "        self.modules = modules\n"
+    "\n"
+    "    def find_module(self, fullname, path=None):\n"
+    "        return self if fullname in self.modules else None\n"
+    "\n"
+    "    def load_module(self, fullname):\n"
+    "        if fullname in sys.modules:\n"
+    "            return sys.modules[fullname]\n"
+    "        code, path, package = self.modules[fullname]\n"
+    "        module = types.ModuleType(fullname)\n"
+    "        module.__file__ = path\n"
+    "        module.__loader__ = self\n"
+    "        if package:\n"
+    "            module.__path__ = [os.path.dirname(path)]\n"
+    "            module.__package__ = fullname\n"
+    "        else:\n"
+    "            module.__package__ = fullname.rpartition('.')[0]\n"
+    "        sys.modules[fullname] = module\n"
+    "        try:\n"
+    "            exec(marshal.loads(code), module.__dict__)\n"
+    "        except:\n"
+    "            del sys.modules[fullname]\n"
+    "            raise\n"
+    "        return sys.modules[fullname]\n"
+    "\n"
+    "    def find_spec(self, fullname, path=None, target=None):\n"
+    "        if fullname not in self.modules:\n"
+    "            return None\n"
+    "        import importlib.util\n"
+    "        code, path, package = self.modules[fullname]\n"
+    "        spec = importlib.util.spec_from_loader(fullname, self, origin=path,\n"
+    "                                               is_package=package)\n"
+    "        spec.has_location = True\n"
+    "        if package:\n"
+    "            spec.submodule_search_locations = [os.path.dirname(path)]\n"
+    "        return spec\n"
+    "\n"
+    "    def create_module(self, spec):\n"
+    "        return None\n"
+    "\n"
+    "    def exec_module(self, module):\n"
+    "        exec(marshal.loads(self.modules[module.__name__][0]), module.__dict__)\n"
+    "\n"
+    "def install(modules):\n"
+    "    sys.meta_path.insert(0, PyPreloadImporter(modules))\n"
+    "\n"
+    "def unload(names):\n"
+    "    for name in names:\n"
+    "        sys.modules.pop(name, None)\n"
+    "    sys.meta_path[:] = [i for i in sys.meta_path\n"
+    "                        if type(i).__name__ != 'PyPreloadImporter']\n"
+    "    try:\n"
+    "        import importlib\n"
+    "        importlib.invalidate_caches()\n"
+    "    except (ImportError, AttributeError):\n"
+    "        pass\n";
+
+static PyObject* preload_bytes(const string& s)
+{
+#if PY_MAJOR_VERSION >= 3
+    return PyBytes_FromStringAndSize(s.data(), s.size());
+#else
+    return PyString_FromStringAndSize(s.data(), s.size());
+#endif
+}
+
+static bool preload_string(PyObject* o, string& s, bool bytes)
+{
+    char* data = NULL;
+    Py_ssize_t size = 0;
+#if PY_MAJOR_VERSION >= 3
+    if (!bytes) {
+        const char* text = PyUnicode_AsUTF8AndSize(o, &size);
+        if (!text) {
+            return false;
+        }
+
+        s.assign(text, size);
+        return true;
+    }
+
+    if (PyBytes_AsStringAndSize(o, &data, &size) != 0) {
+        return false;
+    }
+#else
+    if (PyString_AsStringAndSize(o, &data, &size) != 0) {
+        return false;
+    }
+#endif
+
+    s.assign(data, size);
+    return true;
+}
+
+// the preload source, marshalled once compiled
+static pthread_mutex_t preload_mutex = PTHREAD_MUTEX_INITIALIZER;
+static string preload_code;
+
+/*
+ * Code of the preload source, compiled by the first interpreter asking
+ * for it, the others read it from its marshalled form. The lock is
+ * not held while compiling, the GIL may be given up meanwhile.
+ */
+static PyObject* preload_compiled()
+{
+    string code;
+    {
+        LockGuard<pthread_mutex_t> pm(&preload_mutex);
+        code = preload_code;
+    }
+
+    if (code.empty()) {
+        PyObject* compiled = Py_CompileString(preload_source, "<preload>", Py_file_input);
+        if (!compiled) {
+            return NULL;
+        }
+
+        PyObject* data = PyMarshal_WriteObjectToString(compiled, Py_MARSHAL_VERSION);
+        Py_DECREF(compiled);
+        if (!data) {
+            return NULL;
+        }
+
+        bool done = preload_string(data, code, true);
+        Py_DECREF(data);
+        if (!done) {
+            return NULL;
+        }
+
+        LockGuard<pthread_mutex_t> pm(&preload_mutex);
+        preload_code = code;
+    }
+
+    return PyMarshal_ReadObjectFromString((char*)code.data(), code.size());
+}
+
+/*
+ * Function of the preload module of the current interpreter, run from
+ * the compiled source on first use and kept in sys.modules
+ */
+static PyObject* preload_function(const char* name)
+{
+    PyObject* module = PyDict_GetItemString(PyImport_GetModuleDict(), PRELOAD_MODULE);
+    if (module) {
+        Py_INCREF(module);
+    } else {
+        PyObject* code = preload_compiled();
+        if (!code) {
+            return NULL;
+        }
+
+        module = PyImport_ExecCodeModule((char*)PRELOAD_MODULE, code);
+        Py_DECREF(code);
+        if (!module) {
+            return NULL;
+        }
+    }
+
+    PyObject* fn = PyObject_GetAttrString(module, name);
+    Py_DECREF(module);
+
+    return fn;
+}
+
+static PyObject* preload_call(const char* name, PyObject* arg)
+{
+    PyObject* fn = preload_function(name);
+    if (!fn) {
+        return NULL;
+    }
+
+    PyObject* rv = arg ? PyObject_CallFunctionObjArgs(fn, arg, NULL)
+                       : PyObject_CallFunctionObjArgs(fn, NULL);
+    Py_DECREF(fn);
+
+    return rv;
+}
+
+PyObject* PyPreload_Loaded()
+{
+    return preload_call("loaded", NULL);
+}
+
+bool PyPreload_Collect(PyObject* loaded, PyPreloadedModules& modules)
+{
+    PyObject* found = preload_call("collect", loaded);
+    if (!found) {
+        return false;
+    }
+
+    for (Py_ssize_t i = 0; i < PyList_Size(found); i++) {
+        PyObject* item = PyList_GetItem(found, i);
+        string name;
+        PyPreloadedModule m;
+        if (!preload_string(PyTuple_GetItem(item, 0), name, false) ||
+            !preload_string(PyTuple_GetItem(item, 1), m.code, true) ||
+            !preload_string(PyTuple_GetItem(item, 2), m.file, false)) {
+            Py_DECREF(found);
+            return false;
+        }
+
+        m.package = PyObject_IsTrue(PyTuple_GetItem(item, 3)) == 1;
+        modules[name] = m;
+    }
+
+    Py_DECREF(found);
+
+    return true;
+}
+
+bool PyPreload_Install(const PyPreloadedModules& modules)
+{
+    PyObject* dict = PyDict_New();
+    if (!dict) {
+        return false;
+    }
+
+    for (PyPreloadedModules::const_iterator it = modules.begin(); it != modules.end(); ++it) {
+        PyObject* code = preload_bytes(it->second.code);
+        PyObject* file = code ? PyString_FromStringAndSize(it->second.file.data(),
+                                                           it->second.file.size()) : NULL;
+        PyObject* entry = file ? PyTuple_Pack(3, code, file,
+                                              it->second.package ? Py_True : Py_False) : NULL;
+        Py_XDECREF(code);
+        Py_XDECREF(file);
+        if (!entry || PyDict_SetItemString(dict, it->first.c_str(), entry) != 0) {
+            Py_XDECREF(entry);
+            Py_DECREF(dict);
+            return false;
+        }
+
+        Py_DECREF(entry);
+    }
+
+    PyObject* rv = preload_call("install", dict);
+    Py_DECREF(dict);
+    Py_XDECREF(rv);
+
+    return rv != NULL;
+}
+
+bool PyPreload_Unload(const PyPreloadedModules& modules)
+{
+    PyObject* names = PyList_New(0);
+    if (!names) {
+        return false;
+    }
+
+    for (PyPreloadedModules::const_iterator it = modules.begin(); it != modules.end(); ++it) {
+        PyObject* name = PyString_FromStringAndSize(it->first.data(), it->first.size());
+        if (!name || PyList_Append(names, name) != 0) {
+            Py_XDECREF(name);
+            Py_DECREF(names);
+            return false;
+        }
+
+        Py_DECREF(name);
+    }
+
+    PyObject* rv = preload_call("unload", names);
+    Py_DECREF(names);
+    Py_XDECREF(rv);
+
+    return rv != NULL;
+}
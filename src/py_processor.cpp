@@ -3,31 +3,216 @@
 
 #include "config.h"
 
-#include <python2.7/Python.h>
+#include "py_python.h"
 
 #include "config.h"
 #include "cxx_compatibility.h"
 #include "trace.h"
 #include "strutl.h"
 #include "lexical_cast.h"
+#include "lock_guard.h"
 #include "py_error.h"
 #include "py_tools.h"
 #include "py_interpreter_pool.h"
 #include "py_interpreter_pool_guard.h"
+#include "py_gil_guard.h"
+#include "py_map_view.h"
 #include "py_processor.h"
+#include "py_submit_queue.h"
+#include "py_worker_pool.h"
 
 using namespace std;
 
+/*
+ * The bytes of a result object, not copied: of a string, as utf-8 if
+ * it is unicode, of bytes or of any object with the buffer interface
+ */
+struct PyResultData
+{
+    PyResultData(PyObject* o): data(NULL), size(0), has_view(false), tmp(NULL) {
+#if PY_MAJOR_VERSION >= 3
+        if (PyUnicode_Check(o)) {
+            data = PyUnicode_AsUTF8AndSize(o, &size);
+        } else if (PyBytes_Check(o)) {
+            data = PyBytes_AS_STRING(o);
+            size = PyBytes_GET_SIZE(o);
+        }
+#else
+        if (PyString_Check(o)) {
+            data = PyString_AS_STRING(o);
+            size = PyString_GET_SIZE(o);
+        } else if (PyUnicode_Check(o)) {
+            tmp = PyUnicode_AsUTF8String(o);
+            if (tmp) {
+                data = PyString_AS_STRING(tmp);
+                size = PyString_GET_SIZE(tmp);
+            }
+        }
+#endif
+        else if (PyObject_CheckBuffer(o)) {
+            if (PyObject_GetBuffer(o, &view, PyBUF_SIMPLE) == 0) {
+                has_view = true;
+                data = (const char*)view.buf;
+                size = view.len;
+            }
+        } else {
+            throw runtime_error(error_info(string("Not a string result: ") +
+                                           Py_TYPE(o)->tp_name));
+        }
+
+        if (!data) {
+            string error_message("Result of the handler");
+            Py_Error(error_message);
+            throw runtime_error(error_info(error_message));
+        }
+    }
+
+    ~PyResultData() {
+        if (has_view) {
+            PyBuffer_Release(&view);
+        }
+
+        Py_XDECREF(tmp);
+    }
+
+    const char* data;
+    Py_ssize_t size;
+    Py_buffer view;
+    bool has_view;
+    PyObject* tmp;
+};
+
+/*
+ * Any item of a structured result as a string, converted by str() if
+ * it is not one
+ */
+static void result_item(PyObject* o, string& s)
+{
+    if (PyUnicode_Check(o) || PyString_Check(o) || PyObject_CheckBuffer(o)) {
+        PyResultData d(o);
+        s.assign(d.data, d.size);
+        return;
+    }
+
+    PyObject* str = PyObject_Str(o);
+    if (!str) {
+        string error_message("str() of result item");
+        Py_Error(error_message);
+        throw runtime_error(error_info(error_message));
+    }
+
+    try {
+        PyResultData d(str);
+        s.assign(d.data, d.size);
+    } catch (...) {
+        Py_DECREF(str);
+        throw;
+    }
+
+    Py_DECREF(str);
+}
+
 /*
  * Constructor of python processor starting it on a specific handler
  */
-PyProcessor::PyProcessor(const string& processor_module_name): module_name(processor_module_name)
+PyProcessor::PyProcessor(const string& processor_module_name,
+                         int pool_size,
+                         unsigned int shards_no,
+                         PyInterpreterReusePolicy policy,
+                         PyProcessorMarshalling m):
+    module_name(processor_module_name),
+    marshalling(m),
+    ip(new PyInterpreterPool(pool_size, shards_no, policy))
 {
     FRAME;
 	
-    ip.start(module_name, PYTHON_DATA_HANDLER);
+    start_pool();
+
+    INFO("Started python interpreter(s) "
+		 + lexical_cast<string>(ip->size())
+		 + " for: "
+		 + module_name
+		 + "."
+		 + PYTHON_DATA_HANDLER);
+}
+
+/*
+ * Constructor of python processor on an elastic pool of interpreters
+ */
+PyProcessor::PyProcessor(const string& processor_module_name,
+                         const PyInterpreterScaling& scaling,
+                         unsigned int shards_no,
+                         PyInterpreterReusePolicy policy,
+                         PyProcessorMarshalling m):
+    module_name(processor_module_name),
+    marshalling(m),
+    ip(new PyInterpreterPool(scaling, shards_no, policy))
+{
+    FRAME;
+
+    start_pool();
+
     INFO("Started python interpreter(s) "
-		 + lexical_cast<string>(ip.size())
+		 + lexical_cast<string>(ip->size())
+		 + " up to "
+		 + lexical_cast<string>(ip->capacity())
+		 + " for: "
+		 + module_name
+		 + "."
+		 + PYTHON_DATA_HANDLER);
+}
+
+/*
+ * Constructor of python processor serving the handlers of a registry
+ * from one pool, the first one being the default
+ */
+PyProcessor::PyProcessor(const PyHandlerNames& handlers,
+                         const PyInterpreterScaling& scaling,
+                         unsigned int shards_no,
+                         PyInterpreterReusePolicy policy,
+                         PyProcessorMarshalling m):
+    module_name(handlers.empty() ? string() : handlers[0].first),
+    handler_names(handlers),
+    marshalling(m),
+    ip(new PyInterpreterPool(scaling, shards_no, policy))
+{
+    FRAME;
+
+    start_pool();
+
+    INFO("Started python interpreter(s) "
+		 + lexical_cast<string>(ip->size())
+		 + " for handlers: "
+		 + lexical_cast<string>(ip->handlers()));
+}
+
+/*
+ * Constructor of python processor on a selected backend. The worker
+ * processes run each their own processor on the interpreters backend.
+ * The warm up calls are made by the zygote before forking the workers.
+ */
+PyProcessor::PyProcessor(const string& processor_module_name,
+                         PyProcessorBackend backend,
+                         unsigned int workers_no,
+                         unsigned int interpreters_no,
+                         const PyProcessorRequests& warmup):
+    module_name(processor_module_name),
+    marshalling(MARSHAL_DICT)
+{
+    FRAME;
+
+    if (backend == BACKEND_WORKERS) {
+        wp.reset(new PyWorkerPool(module_name, workers_no, interpreters_no));
+    } else if (backend == BACKEND_ZYGOTE) {
+        wp.reset(new PyWorkerPool(module_name, workers_no, interpreters_no,
+                                  SPAWN_ZYGOTE, warmup));
+    } else {
+        ip.reset(new PyInterpreterPool(interpreters_no));
+        start_pool();
+    }
+
+    INFO("Started python backend of size "
+		 + lexical_cast<string>(size())
 		 + " for: "
 		 + module_name
 		 + "."
@@ -41,8 +226,14 @@ PyProcessor::~PyProcessor()
 {
     FRAME;
 
-    INFO("Finishing python interpreter(s) "
-		 + lexical_cast<string>(ip.size())
+    if (queue.get()) {
+        stop_executors();
+    }
+
+    clean_slots();
+
+    INFO("Finishing python backend of size "
+		 + lexical_cast<string>(size())
 		 + " for: "
 		 + module_name
 		 + "."
@@ -50,85 +241,854 @@ PyProcessor::~PyProcessor()
 }
 
 /*
- * Processor allocating next available interpreter and releasin it
+ * Processor allocating next available interpreter and releasin it.
+ * With a timeout the call is cancelled at its deadline by a
+ * PyTimeoutError, in an interpreter or in a worker alike.
  */
 string
 PyProcessor::Process(const string& identifier,
                          MapString2String& messages,
-                         MultimapString2String& parameters)
+                         MultimapString2String& parameters,
+                         unsigned long timeout_ns)
+{
+    FRAME;
+
+    if (wp.get()) {
+        return wp->process(identifier, messages, parameters, timeout_ns);
+    }
+
+    PyInterpreterPoolGuard ipg(*ip);
+    ipg.set_timeout(timeout_ns);
+
+    // get result releasing the guard
+    return call(ipg, identifier, messages, parameters);
+}
+
+/*
+ * Processor putting the result in the string of the caller, its buffer
+ * is reused if large enough
+ */
+void PyProcessor::Process(const string& identifier,
+                          const MapString2String& messages,
+                          const MultimapString2String& parameters,
+                          string& output,
+                          unsigned long timeout_ns)
+{
+    FRAME;
+
+    if (wp.get()) {
+        output = wp->process(identifier, messages, parameters, timeout_ns);
+        return;
+    }
+
+    PyInterpreterPoolGuard ipg(*ip);
+    ipg.set_timeout(timeout_ns);
+    PyObject* py_result = invoke(ipg, identifier, messages, parameters);
+    try {
+        PyResultData d(py_result);
+        output.assign(d.data, d.size);
+    } catch (...) {
+        Py_DECREF(py_result);
+        throw;
+    }
+
+    Py_DECREF(py_result);
+}
+
+/*
+ * Processor calling a handler of the registry by its id
+ */
+string PyProcessor::Process(PyHandlerId handler,
+                            const string& identifier,
+                            const MapString2String& messages,
+                            const MultimapString2String& parameters,
+                            unsigned long timeout_ns)
+{
+    FRAME;
+
+    check_handler(handler);
+    if (wp.get()) {
+        return wp->process(identifier, messages, parameters, timeout_ns);
+    }
+
+    PyInterpreterPoolGuard ipg(*ip);
+    ipg.set_timeout(timeout_ns);
+
+    return call(ipg, identifier, messages, parameters, handler);
+}
+
+void PyProcessor::Process(PyHandlerId handler,
+                          const string& identifier,
+                          const MapString2String& messages,
+                          const MultimapString2String& parameters,
+                          string& output,
+                          unsigned long timeout_ns)
 {
     FRAME;
 
-    PyInterpreterPoolGuard ipg(ip);
+    check_handler(handler);
+    if (wp.get()) {
+        output = wp->process(identifier, messages, parameters, timeout_ns);
+        return;
+    }
+
+    PyInterpreterPoolGuard ipg(*ip);
+    ipg.set_timeout(timeout_ns);
+    PyObject* py_result = invoke(ipg, identifier, messages, parameters, handler);
+    try {
+        PyResultData d(py_result);
+        output.assign(d.data, d.size);
+    } catch (...) {
+        Py_DECREF(py_result);
+        throw;
+    }
+
+    Py_DECREF(py_result);
+}
+
+/*
+ * The worker processes serve the default handler only
+ */
+void PyProcessor::check_handler(PyHandlerId handler) const
+{
+    size_t handlers_no = wp.get() ? 1 : ip->handlers();
+    if (handler >= handlers_no) {
+        throw logic_error(error_info("No data handler with id: " +
+                                     lexical_cast<string>(handler)));
+    }
+}
+
+/*
+ * Processor giving the reader the bytes of the result in place, while
+ * the interpreter is held. The reader must not call the processor.
+ */
+void PyProcessor::Process(const string& identifier,
+                          const MapString2String& messages,
+                          const MultimapString2String& parameters,
+                          PyProcessorReader reader,
+                          void* arg,
+                          unsigned long timeout_ns)
+{
+    FRAME;
+
+    if (wp.get()) {
+        string content = wp->process(identifier, messages, parameters, timeout_ns);
+        reader(content.data(), content.size(), arg);
+        return;
+    }
+
+    PyInterpreterPoolGuard ipg(*ip);
+    ipg.set_timeout(timeout_ns);
+    PyObject* py_result = invoke(ipg, identifier, messages, parameters);
+    try {
+        PyResultData d(py_result);
+        reader(d.data, d.size, arg);
+    } catch (...) {
+        Py_DECREF(py_result);
+        throw;
+    }
+
+    Py_DECREF(py_result);
+}
+
+/*
+ * Processor of a handler returning a dict, converted item by item to
+ * the map of the caller. The workers return strings only.
+ */
+void PyProcessor::Process(const string& identifier,
+                          const MapString2String& messages,
+                          const MultimapString2String& parameters,
+                          MapString2String& output,
+                          unsigned long timeout_ns)
+{
+    FRAME;
+
+    if (wp.get()) {
+        throw logic_error(error_info("No structured results from workers"));
+    }
+
+    output.clear();
+
+    PyInterpreterPoolGuard ipg(*ip);
+    ipg.set_timeout(timeout_ns);
+    PyObject* py_result = invoke(ipg, identifier, messages, parameters);
+    try {
+        if (!PyDict_Check(py_result)) {
+            throw runtime_error(error_info(string("Not a dict result: ") +
+                                           Py_TYPE(py_result)->tp_name));
+        }
+
+        Py_ssize_t pos = 0;
+        PyObject* key = NULL;
+        PyObject* value = NULL;
+        string k;
+        while (PyDict_Next(py_result, &pos, &key, &value)) {
+            result_item(key, k);
+            result_item(value, output[k]);
+        }
+    } catch (...) {
+        Py_DECREF(py_result);
+        throw;
+    }
+
+    Py_DECREF(py_result);
+}
+
+/*
+ * Processor of a handler returning a list or a tuple, converted item by
+ * item to the vector of the caller. The workers return strings only.
+ */
+void PyProcessor::Process(const string& identifier,
+                          const MapString2String& messages,
+                          const MultimapString2String& parameters,
+                          vector<string>& output,
+                          unsigned long timeout_ns)
+{
+    FRAME;
+
+    if (wp.get()) {
+        throw logic_error(error_info("No structured results from workers"));
+    }
+
+    output.clear();
+
+    PyInterpreterPoolGuard ipg(*ip);
+    ipg.set_timeout(timeout_ns);
+    PyObject* py_result = invoke(ipg, identifier, messages, parameters);
+    try {
+        if (!PyList_Check(py_result) && !PyTuple_Check(py_result)) {
+            throw runtime_error(error_info(string("Not a list result: ") +
+                                           Py_TYPE(py_result)->tp_name));
+        }
+
+        Py_ssize_t n = PySequence_Fast_GET_SIZE(py_result);
+        output.resize(n);
+        for (Py_ssize_t i = 0; i < n; i++) {
+            result_item(PySequence_Fast_GET_ITEM(py_result, i), output[i]);
+        }
+    } catch (...) {
+        Py_DECREF(py_result);
+        throw;
+    }
+
+    Py_DECREF(py_result);
+}
+
+/*
+ * Processor running a batch of calls on one interpreter. The lease and
+ * the GIL are taken once for the whole batch. A failed call does not
+ * stop the batch, its error is returned in its result.
+ */
+PyProcessorResults
+PyProcessor::ProcessBatch(const PyProcessorRequests& requests)
+{
+    FRAME;
+
+    PyProcessorResults results(requests.size());
+    if (requests.empty()) {
+        return results;
+    }
+
+    if (wp.get()) {
+        for (size_t i = 0; i < requests.size(); i++) {
+            run(NULL, requests[i], results[i]);
+        }
+
+        return results;
+    }
+
+    PyInterpreterPoolGuard ipg(*ip);
+    for (size_t i = 0; i < requests.size(); i++) {
+        run(&ipg, requests[i], results[i]);
+    }
+
+    return results;
+}
+
+/*
+ * Starts the executor threads serving the submitted calls. Each one
+ * keeps its interpreter for good so the pool must have enough of them.
+ * The worker backend has no interpreters here, the executors just
+ * pass the calls on to the workers.
+ */
+void PyProcessor::StartExecutors(unsigned int executors_no,
+                                 unsigned int queue_size)
+{
+    FRAME;
+
+    if (queue.get()) {
+        throw logic_error(error_info("Executors already started"));
+    }
+
+    if (executors_no == 0 || (ip.get() && executors_no > ip->size())) {
+        throw logic_error(error_info("Invalid number of executors: " +
+                                     lexical_cast<string>(executors_no)));
+    }
+
+    queue.reset(new PySubmitQueue(queue_size));
+    executors.reserve(executors_no);
+    try {
+        for (unsigned int i = 0; i < executors_no; i++) {
+            PyExecutor e;
+            e.processor = this;
+            e.lease = ip.get() ? ip->alloc() : NO_LEASE;
+            e.state = NULL;
+            executors.push_back(e);
+            int rc = pthread_create(&executors.back().thread, NULL,
+                                    execute, &executors.back());
+            if (rc != 0) {
+                if (ip.get()) {
+                    ip->dealloc(e.lease);
+                }
+                executors.pop_back();
+                throw runtime_error(sys_error_info(rc, "pthread_create"));
+            }
+        }
+    } catch (...) {
+        stop_executors();
+        throw;
+    }
+
+    INFO("Started executors: %lu", executors_no);
+}
+
+/*
+ * Queues a call returning at once with the future of its result. A
+ * call refused because the queue is full is done at once with the
+ * status PROCESS_REJECTED.
+ */
+PyProcessorFuture
+PyProcessor::Submit(const string& identifier,
+                    const MapString2String& messages,
+                    const MultimapString2String& parameters,
+                    unsigned long timeout_ns)
+{
+    FRAME;
+
+    PyProcessorTask* task = new PyProcessorTask(identifier, messages, parameters,
+                                                NULL, NULL, 2, timeout_ns);
+    PyProcessorFuture future(task);
+    submit(task);
+
+    return future;
+}
+
+/*
+ * Queues a call, the callback gets its result in the executor thread.
+ * A refused call is completed in the calling thread.
+ */
+void PyProcessor::Submit(const string& identifier,
+                         const MapString2String& messages,
+                         const MultimapString2String& parameters,
+                         PyProcessorCallback callback,
+                         void* arg,
+                         unsigned long timeout_ns)
+{
+    FRAME;
+
+    submit(new PyProcessorTask(identifier, messages, parameters,
+                               callback, arg, 1, timeout_ns));
+}
+
+void PyProcessor::submit(PyProcessorTask* task)
+{
+    if (!queue.get()) {
+        task->release();
+        throw logic_error(error_info("Executors not started"));
+    }
+
+    if (!queue->push(task)) {
+        task->result.status = PROCESS_REJECTED;
+        task->result.content = error_info("Submit queue full or stopped");
+        task->complete();
+        task->release();
+    }
+}
+
+/*
+ * The executors finish the calls queued so far and return their
+ * interpreters
+ */
+void PyProcessor::stop_executors()
+{
+    FRAME;
+
+    queue->stop();
+    for (PyExecutors::iterator it = executors.begin(); it != executors.end(); ++it) {
+        pthread_join(it->thread, NULL);
+        if (ip.get()) {
+            ip->dealloc(it->lease);
+        }
+    }
+
+    executors.clear();
+}
+
+/*
+ * Body of an executor thread. It takes the queued calls in bunches and
+ * runs each bunch under one hold of its interpreter. The submitters
+ * are told about the results after the GIL is released. With a GIL
+ * per interpreter the thread state of the executor is made once, only
+ * made current for each bunch.
+ */
+void* PyProcessor::execute(void* arg)
+{
+    PyExecutor& e = *(PyExecutor*)arg;
+    PyProcessor& p = *e.processor;
+    PyProcessorTasks tasks;
+    tasks.reserve(EXECUTOR_BATCH_SIZE);
+
+#ifdef PY_OWN_GIL
+    if (p.ip.get()) {
+        e.state = PyThreadState_New(PyThreadState_GetInterpreter(p.ip->get_interpreter(e.lease)));
+    }
+#endif
+
+    while (p.queue->pop(tasks, EXECUTOR_BATCH_SIZE)) {
+        if (p.ip.get()) {
+            PyInterpreterPoolGuard ipg(*p.ip, e.lease, e.state);
+            for (size_t i = 0; i < tasks.size(); i++) {
+                p.run(&ipg, tasks[i]->request, tasks[i]->result);
+            }
+        } else {
+            for (size_t i = 0; i < tasks.size(); i++) {
+                p.run(NULL, tasks[i]->request, tasks[i]->result);
+            }
+        }
+
+        for (size_t i = 0; i < tasks.size(); i++) {
+            tasks[i]->complete();
+            tasks[i]->release();
+        }
+
+        tasks.clear();
+    }
+
+#ifdef PY_OWN_GIL
+    if (e.state) {
+        PyEval_RestoreThread(e.state);
+        PyThreadState_Clear(e.state);
+        PyThreadState_DeleteCurrent();
+    }
+#endif
+
+    return NULL;
+}
+
+/*
+ * One call of a batch, in the interpreter held by the guard or, with
+ * no guard, in a worker. The error of the call is put in its result,
+ * a timed out call does not stop the batch either.
+ */
+void PyProcessor::run(PyInterpreterPoolGuard* ipg,
+                      const PyProcessorRequest& request,
+                      PyProcessorResult& result)
+{
+    try {
+        if (ipg) {
+            ipg->set_timeout(request.timeout_ns);
+            result.content = call(*ipg,
+                                  request.identifier,
+                                  request.messages,
+                                  request.parameters);
+        } else {
+            result.content = wp->process(request.identifier,
+                                         request.messages,
+                                         request.parameters,
+                                         request.timeout_ns);
+        }
+        result.status = PROCESS_OK;
+    } catch (runtime_error& e) {
+        result.status = PROCESS_ERROR;
+        result.content = e.what();
+    }
+}
+
+/*
+ * Call of the data handler of the interpreter held by the guard
+ */
+string
+PyProcessor::call(PyInterpreterPoolGuard& ipg,
+                  const string& identifier,
+                  const MapString2String& messages,
+                  const MultimapString2String& parameters,
+                  PyHandlerId handler)
+{
+    FRAME;
+
+    string content;
+    PyObject* py_result = invoke(ipg, identifier, messages, parameters, handler);
+    try {
+        PyResultData d(py_result);
+        content.assign(d.data, d.size);
+    } catch (...) {
+        Py_DECREF(py_result);
+        throw;
+    }
+
+    Py_DECREF(py_result);
+    INFO("Finished guarded python module with content bytes: %lu", content.size());
+
+    return content;
+}
+
+/*
+ * The result object of the data handler, a new reference
+ */
+PyObject*
+PyProcessor::invoke(PyInterpreterPoolGuard& ipg,
+                    const string& identifier,
+                    const MapString2String& messages,
+                    const MultimapString2String& parameters,
+                    PyHandlerId handler)
+{
+    FRAME;
 
     // prepare parameters
-    PyObject* py_key = Py_BuildValue("s", identifier.c_str());
-    PyObject* py_messages = map2dict(messages);
-    PyObject* py_parameters = multimap2dict(parameters);
-    PyObject* py_argv = PyTuple_Pack(3, py_key, py_messages, py_parameters);
-    if (!py_key || !py_messages || !py_parameters || !py_argv) {
+    PyProcessorSlot& slot = slots[ipg.lease];
+    unsigned long started_ns = PyMetrics_Clock();
+    bool prepared = prepare_arguments(slot, identifier, messages, parameters);
+    ip->record(METRIC_MARSHAL, PyMetrics_Clock() - started_ns);
+    if (!prepared) {
+        release_arguments(slot);
         string error_message("Empty value in python build value");
         throw runtime_error(error_message);
     }
 
     // call data handler with parametrers
-    INFO("Calling guarded python module: " + module_name);
-    PyObject* py_result = ipg(py_argv);
+    INFO("Calling guarded python module handler: %lu", handler);
+    PyObject* py_result = NULL;
+    try {
+        py_result = ipg(handler, slot.argv);
+    } catch (...) {
+        release_arguments(slot);
+        throw;
+    }
+
+    release_arguments(slot);
     if (!py_result) {
         string error_message("NULL value received from processor");
         throw runtime_error(error_message);
     }
-	
-    string content = PyString_AsString(py_result);
 
-    Py_DecrefAll(5, py_key, py_messages, py_parameters, py_argv, py_result);
-    INFO("Finished guarded python module: "
-		 + module_name
-		 + " with content:\n"
-		 + content);
-	
-    // get result releasing the guard
-    return content;
+    return py_result;
 }
 
 /*
- * Creator of python dict from a map of messages
+ * The key of the map interned at its first use. The keys of a map come
+ * in order so the one after the previous key is tried first.
  */
-PyObject*
-PyProcessor::map2dict(const MapString2String& messages)
+static PyObject* intern_key(PyInternedKeys& keys,
+                            PyInternedKeys::iterator& next,
+                            const string& k)
 {
-    PyObject* pDict = PyDict_New();
-    for (MapString2StringConstIterator it = messages.begin();
-         it != messages.end();
-         ++it) {
-        PyObject* value = Py_BuildValue("s", it->second.c_str());
-        if (!value) {
-            return NULL;
+    if (next == keys.end() || next->first != k) {
+        next = keys.lower_bound(k);
+    }
+
+    if (next != keys.end() && next->first == k) {
+        PyObject* key = next->second;
+        ++next;
+        Py_INCREF(key);
+        return key;
+    }
+
+    PyObject* key = PyString_FromStringAndSize(k.data(), k.size());
+    if (!key) {
+        return NULL;
+    }
+
+    PyString_InternInPlace(&key);
+    if (keys.size() < MAX_INTERNED_KEYS) {
+        Py_INCREF(key);
+        next = keys.insert(next, make_pair(k, key));
+        ++next;
+    }
+
+    return key;
+}
+
+/*
+ * Refill the dict of the previous call with the map. The values are
+ * replaced in place, the dict is cleared only if it has keys the map
+ * has not. Of the values of a key in a multimap the last one is kept.
+ */
+template <typename M>
+static bool fill_dict(PyObject* dict, const M& m, PyInternedKeys& keys)
+{
+    for (int pass = 0; pass < 2; pass++) {
+        Py_ssize_t distinct = 0;
+        const string* last = NULL;
+        PyInternedKeys::iterator next = keys.begin();
+        for (typename M::const_iterator it = m.begin(); it != m.end(); ++it) {
+            PyObject* key = intern_key(keys, next, it->first);
+            PyObject* value = key ?
+                PyString_FromStringAndSize(it->second.data(), it->second.size()) : NULL;
+            if (!value || PyDict_SetItem(dict, key, value) != 0) {
+                Py_XDECREF(key);
+                Py_XDECREF(value);
+                return false;
+            }
+
+            Py_DECREF(key);
+            Py_DECREF(value);
+            if (!last || *last != it->first) {
+                distinct++;
+            }
+
+            last = &it->first;
+        }
+
+        if (PyDict_Size(dict) == distinct) {
+            break;
+        }
+
+        PyDict_Clear(dict);
+    }
+
+    return true;
+}
+
+/*
+ * Put the arguments of a call in the tuple of the slot, made at the
+ * first call as the containers of the maps
+ */
+bool PyProcessor::prepare_arguments(PyProcessorSlot& slot,
+                                    const string& identifier,
+                                    const MapString2String& messages,
+                                    const MultimapString2String& parameters)
+{
+    if (!slot.argv) {
+        slot.argv = PyTuple_New(3);
+        if (!slot.argv) {
+            return false;
+        }
+    }
+
+    PyObject* py_key = PyString_FromStringAndSize(identifier.data(), identifier.size());
+    if (!py_key) {
+        return false;
+    }
+
+    PyTuple_SET_ITEM(slot.argv, 0, py_key);
+
+    if (marshalling == MARSHAL_VIEW) {
+        if (!slot.map_view_type) {
+            slot.map_view_type = PyMapView_NewType();
+            if (!slot.map_view_type) {
+                return false;
+            }
+        }
+
+        if (slot.messages) {
+            PyMapView_AttachMap(slot.messages, &messages);
+        } else {
+            slot.messages = PyMapView_FromMap(slot.map_view_type, &messages);
+        }
+
+        if (slot.parameters) {
+            PyMapView_AttachMultimap(slot.parameters, &parameters);
         } else {
-            PyDict_SetItemString(pDict, it->first.c_str(), value);
+            slot.parameters = PyMapView_FromMultimap(slot.map_view_type, &parameters);
+        }
+
+        if (!slot.messages || !slot.parameters) {
+            return false;
+        }
+    } else {
+        if (!slot.messages) {
+            slot.messages = PyDict_New();
+        }
+
+        if (!slot.parameters) {
+            slot.parameters = PyDict_New();
+        }
+
+        if (!slot.messages
+            || !slot.parameters
+            || !fill_dict(slot.messages, messages, slot.message_keys)
+            || !fill_dict(slot.parameters, parameters, slot.parameter_keys)) {
+            return false;
         }
     }
 
-    return pDict;
+    Py_INCREF(slot.messages);
+    PyTuple_SET_ITEM(slot.argv, 1, slot.messages);
+    Py_INCREF(slot.parameters);
+    PyTuple_SET_ITEM(slot.argv, 2, slot.parameters);
+
+    return true;
 }
 
 /*
- * Creator of python dict from a multimap of messages
+ * Empty the tuple of a call. The objects the handler kept are left to
+ * it and made anew for the next call. The views no longer see the maps
+ * of the caller.
  */
-PyObject*
-PyProcessor::multimap2dict(const MultimapString2String& messages)
+void PyProcessor::release_arguments(PyProcessorSlot& slot)
 {
-    PyObject* pDict = PyDict_New();
-    for (MultimapString2StringConstIterator it = messages.begin();
-         it != messages.end();
-         ++it) {
-        PyObject* value = Py_BuildValue("s", it->second.c_str());
-        if (!value) {
-            return NULL;
+    if (marshalling == MARSHAL_VIEW) {
+        if (slot.messages) {
+            PyMapView_Detach(slot.messages);
+        }
+
+        if (slot.parameters) {
+            PyMapView_Detach(slot.parameters);
+        }
+    }
+
+    if (slot.argv) {
+        if (Py_REFCNT(slot.argv) == 1) {
+            for (Py_ssize_t i = 0; i < 3; i++) {
+                PyObject* item = PyTuple_GET_ITEM(slot.argv, i);
+                PyTuple_SET_ITEM(slot.argv, i, NULL);
+                Py_XDECREF(item);
+            }
         } else {
-            PyDict_SetItemString(pDict, it->first.c_str(), value);
+            Py_DECREF(slot.argv);
+            slot.argv = NULL;
+        }
+    }
+
+    if (slot.messages && Py_REFCNT(slot.messages) > 1) {
+        Py_DECREF(slot.messages);
+        slot.messages = NULL;
+    }
+
+    if (slot.parameters && Py_REFCNT(slot.parameters) > 1) {
+        Py_DECREF(slot.parameters);
+        slot.parameters = NULL;
+    }
+}
+
+/*
+ * Start the handlers of the pool, one slot for each interpreter it
+ * may ever have. A retired interpreter has its slot cleaned first.
+ */
+void PyProcessor::start_pool()
+{
+    FRAME;
+
+    slots.resize(ip->capacity());
+    ip->on_retire(retire_slot, this);
+    if (handler_names.empty()) {
+        handler_names.push_back(PyHandlerName(module_name, PYTHON_DATA_HANDLER));
+    }
+
+    ip->start(handler_names);
+}
+
+/*
+ * Called by the pool with the interpreter current and the global pool
+ * mutex taken, the slots are cleared under it too
+ */
+void PyProcessor::retire_slot(void* arg, PyInterpreterLease lease)
+{
+    PyProcessor* p = (PyProcessor*)arg;
+    if (lease < p->slots.size()) {
+        p->clean_slot(p->slots[lease]);
+    }
+}
+
+/*
+ * Drop the objects of the slot, with its interpreter current
+ */
+void PyProcessor::clean_slot(PyProcessorSlot& slot)
+{
+    Py_DecrefAll(4, slot.argv, slot.messages, slot.parameters, slot.map_view_type);
+    for (PyInternedKeys::iterator it = slot.message_keys.begin();
+         it != slot.message_keys.end();
+         ++it) {
+        Py_DECREF(it->second);
+    }
+
+    for (PyInternedKeys::iterator it = slot.parameter_keys.begin();
+         it != slot.parameter_keys.end();
+         ++it) {
+        Py_DECREF(it->second);
+    }
+
+    slot = PyProcessorSlot();
+}
+
+/*
+ * Drop the objects of the slots, each one in its interpreter. The
+ * pool is not used any more but it may still retire interpreters.
+ */
+void PyProcessor::clean_slots()
+{
+    LockGuard<pthread_mutex_t> gpm(&global_pool_mutex);
+
+    for (size_t i = 0; i < slots.size(); i++) {
+        PyProcessorSlot& slot = slots[i];
+        if (!slot.argv && !slot.messages && !slot.parameters && !slot.map_view_type
+            && slot.message_keys.empty() && slot.parameter_keys.empty()) {
+            continue;
         }
+
+        PyGILGuard g(ip->get_interpreter(i));
+        clean_slot(slot);
+    }
+
+    slots.clear();
+}
+
+/*
+ * Number of calls which may run in parallel
+ */
+size_t PyProcessor::size() const
+{
+    return wp.get() ? wp->size() : ip->size();
+}
+
+/*
+ * Counters and timings of the interpreter pool. The worker processes
+ * keep theirs, all of them are zero for the workers backend.
+ */
+PyInterpreterPoolMetrics PyProcessor::Metrics() const
+{
+    if (wp.get()) {
+        return PyInterpreterPoolMetrics();
+    }
+
+    return ip->metrics();
+}
+
+/*
+ * Reloads the handlers from the current files while serving. Only the
+ * interpreters backend does it, and not with the executors running as
+ * they keep their interpreters.
+ */
+void PyProcessor::Reload()
+{
+    FRAME;
+
+    if (wp.get()) {
+        throw logic_error(error_info("Reload not supported by the workers backend"));
+    }
+
+    if (!executors.empty()) {
+        throw logic_error(error_info("Reload not possible with executors running"));
+    }
+
+    ip->reload();
+}
+
+/*
+ * What the interpreters of the pool hold, with the same limits as the
+ * reloading
+ */
+PyPoolFootprint PyProcessor::Footprint()
+{
+    FRAME;
+
+    if (wp.get()) {
+        throw logic_error(error_info("Footprint not supported by the workers backend"));
+    }
+
+    if (!executors.empty()) {
+        throw logic_error(error_info("Footprint not possible with executors running"));
     }
 
-    return pDict;
+    return ip->footprint();
 }
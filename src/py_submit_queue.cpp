@@ -0,0 +1,232 @@
+#include <stdexcept>
+#include <string>
+
+#include "config.h"
+
+#include "lock_guard.h"
+#include "py_error.h"
+#include "py_submit_queue.h"
+#include "trace.h"
+
+using namespace std;
+
+/*
+ * Task referenced by the queue and, if there is one, by a future
+ */
+PyProcessorTask::PyProcessorTask(const string& identifier,
+                                 const MapString2String& messages,
+                                 const MultimapString2String& parameters,
+                                 PyProcessorCallback cb,
+                                 void* a,
+                                 unsigned int r,
+                                 unsigned long timeout_ns):
+    request(identifier, messages, parameters, timeout_ns),
+    callback(cb),
+    arg(a),
+    done(false),
+    refs(r)
+{
+    int rc = pthread_mutex_init(&mutex, NULL);
+    if (rc != 0) {
+        throw runtime_error(sys_error_info(rc, "pthread_mutex_init"));
+    }
+
+    rc = pthread_cond_init(&done_cond, NULL);
+    if (rc != 0) {
+        pthread_mutex_destroy(&mutex);
+        throw runtime_error(sys_error_info(rc, "pthread_cond_init"));
+    }
+}
+
+PyProcessorTask::~PyProcessorTask()
+{
+    pthread_cond_destroy(&done_cond);
+    pthread_mutex_destroy(&mutex);
+}
+
+/*
+ * The result is set, tell the submitter
+ */
+void PyProcessorTask::complete()
+{
+    if (callback) {
+        callback(result, arg);
+    }
+
+    LockGuard<pthread_mutex_t> m(&mutex);
+    done = true;
+    pthread_cond_broadcast(&done_cond);
+}
+
+void PyProcessorTask::wait()
+{
+    LockGuard<pthread_mutex_t> m(&mutex);
+    while (!done) {
+        pthread_cond_wait(&done_cond, &mutex);
+    }
+}
+
+void PyProcessorTask::release()
+{
+    if (__atomic_sub_fetch(&refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        delete this;
+    }
+}
+
+/*
+ * Futures share the task counting the references
+ */
+PyProcessorFuture::PyProcessorFuture(PyProcessorTask* t): task(t)
+{
+}
+
+PyProcessorFuture::PyProcessorFuture(const PyProcessorFuture& other):
+    task(other.task)
+{
+    if (task) {
+        __atomic_add_fetch(&task->refs, 1, __ATOMIC_RELAXED);
+    }
+}
+
+PyProcessorFuture& PyProcessorFuture::operator=(const PyProcessorFuture& other)
+{
+    if (other.task) {
+        __atomic_add_fetch(&other.task->refs, 1, __ATOMIC_RELAXED);
+    }
+
+    if (task) {
+        task->release();
+    }
+
+    task = other.task;
+
+    return *this;
+}
+
+PyProcessorFuture::~PyProcessorFuture()
+{
+    if (task) {
+        task->release();
+    }
+}
+
+bool PyProcessorFuture::valid() const
+{
+    return task != NULL;
+}
+
+bool PyProcessorFuture::ready() const
+{
+    if (!task) {
+        throw logic_error(error_info("No task of the future"));
+    }
+
+    LockGuard<pthread_mutex_t> m(&task->mutex);
+    return task->done;
+}
+
+/*
+ * Waits until the task is done, the result is not changed afterwards
+ */
+const PyProcessorResult& PyProcessorFuture::get() const
+{
+    if (!task) {
+        throw logic_error(error_info("No task of the future"));
+    }
+
+    task->wait();
+
+    return task->result;
+}
+
+/*
+ * Ring of the given capacity
+ */
+PySubmitQueue::PySubmitQueue(unsigned int n):
+    capacity(n),
+    ring(n, (PyProcessorTask*)NULL),
+    head(0),
+    tail(0),
+    stopped(false)
+{
+    FRAME;
+
+    if (n == 0) {
+        throw logic_error(error_info("Invalid submit queue size: 0"));
+    }
+
+    int rc = pthread_mutex_init(&mutex, NULL);
+    if (rc != 0) {
+        throw runtime_error(sys_error_info(rc, "pthread_mutex_init"));
+    }
+
+    rc = pthread_cond_init(&not_empty_cond, NULL);
+    if (rc != 0) {
+        pthread_mutex_destroy(&mutex);
+        throw runtime_error(sys_error_info(rc, "pthread_cond_init"));
+    }
+}
+
+PySubmitQueue::~PySubmitQueue()
+{
+    FRAME;
+
+    pthread_cond_destroy(&not_empty_cond);
+    pthread_mutex_destroy(&mutex);
+}
+
+/*
+ * Adds a task unless the queue is full or stopped, never waits
+ */
+bool PySubmitQueue::push(PyProcessorTask* task)
+{
+    LockGuard<pthread_mutex_t> m(&mutex);
+
+    if (stopped || head - tail == capacity) {
+        return false;
+    }
+
+    ring[head % capacity] = task;
+    head++;
+    pthread_cond_signal(&not_empty_cond);
+
+    return true;
+}
+
+/*
+ * Waits for tasks and takes up to max_tasks of them. Once the queue is
+ * stopped the remaining tasks are still taken, then false is returned.
+ */
+bool PySubmitQueue::pop(PyProcessorTasks& tasks, size_t max_tasks)
+{
+    LockGuard<pthread_mutex_t> m(&mutex);
+
+    while (head == tail && !stopped) {
+        pthread_cond_wait(&not_empty_cond, &mutex);
+    }
+
+    if (head == tail) {
+        return false;
+    }
+
+    size_t n = head - tail < max_tasks ? head - tail : max_tasks;
+    for (size_t i = 0; i < n; i++) {
+        tasks.push_back(ring[tail % capacity]);
+        tail++;
+    }
+
+    if (head != tail) {
+        // more left for the other executors
+        pthread_cond_signal(&not_empty_cond);
+    }
+
+    return true;
+}
+
+void PySubmitQueue::stop()
+{
+    LockGuard<pthread_mutex_t> m(&mutex);
+
+    stopped = true;
+    pthread_cond_broadcast(&not_empty_cond);
+}
@@ -1,6 +1,6 @@
 #include "config.h"
 
-#include <python2.7/Python.h>
+#include "py_python.h"
 #include <stdarg.h>
 
 #include "py_tools.h"
@@ -15,3 +15,26 @@ void Py_DecrefAll(int count, ...)
     }
     va_end(args);
 }
+
+/*
+ * Blocks allocated by the current interpreter, of its own allocator
+ * only with a GIL per interpreter. Negative on error, which is
+ * cleared, or when not counted, as in python 2.
+ */
+long Py_HeapSize()
+{
+    PyObject* blocks = PySys_GetObject((char*)"getallocatedblocks");
+    if (!blocks) {
+        return -1;
+    }
+
+    PyObject* rv = PyObject_CallObject(blocks, NULL);
+    long size = rv ? PyLong_AsLong(rv) : -1;
+    Py_XDECREF(rv);
+    if (PyErr_Occurred()) {
+        PyErr_Clear();
+        size = -1;
+    }
+
+    return size;
+}
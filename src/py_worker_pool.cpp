@@ -0,0 +1,949 @@
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+#include "config.h"
+
+#include "py_python.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cxx_compatibility.h"
+#include "trace.h"
+#include "lexical_cast.h"
+#include "lock_guard.h"
+#include "py_error.h"
+#include "py_gil_guard.h"
+#include "py_interpreter_pool.h"
+#include "py_metrics.h"
+#include "py_processor.h"
+#include "py_worker_pool.h"
+
+using namespace std;
+
+#define RESPONSE_OK 0
+#define RESPONSE_ERROR 1
+
+/*
+ * Context of a serving thread of a worker process
+ */
+struct PyWorkerServer
+{
+    PyProcessor* processor;
+    PyWorkerChannel* channel;
+    pid_t parent;
+};
+
+/*
+ * Encoding of the messages put on the rings: 32 bit lengths and counts
+ * followed by the bytes.
+ */
+static void put_u32(string& buf, uint32_t n)
+{
+    buf.append(reinterpret_cast<const char*>(&n), sizeof(n));
+}
+
+static void put_string(string& buf, const string& s)
+{
+    put_u32(buf, s.size());
+    buf.append(s);
+}
+
+/*
+ * Absolute deadline of one poll period on the monotonic clock, or the
+ * deadline of the call if it comes first
+ */
+static void make_poll_deadline(struct timespec& ts, unsigned long deadline_ns = NO_DEADLINE)
+{
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_nsec += WORKER_POLL_NS;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+
+    if (deadline_ns != NO_DEADLINE &&
+        deadline_ns < (unsigned long)ts.tv_sec * 1000000000ul + ts.tv_nsec) {
+        ts.tv_sec = deadline_ns / 1000000000ul;
+        ts.tv_nsec = deadline_ns % 1000000000ul;
+    }
+}
+
+/*
+ * The process shared mutexes are robust. When the owner died with one
+ * the data it protects is taken over as it is: the peer finds the
+ * owner dead and the channel is reset before it is used again.
+ */
+static void lock_shared(pthread_mutex_t* m)
+{
+    if (pthread_mutex_lock(m) == EOWNERDEAD) {
+        pthread_mutex_consistent(m);
+    }
+}
+
+static int wait_shared(pthread_cond_t* c, pthread_mutex_t* m, const struct timespec* ts)
+{
+    int rc = pthread_cond_timedwait(c, m, ts);
+    if (rc == EOWNERDEAD) {
+        pthread_mutex_consistent(m);
+        rc = 0;
+    }
+
+    return rc;
+}
+
+struct PySharedLockGuard
+{
+    PySharedLockGuard(pthread_mutex_t* m): mutex(m) {
+        lock_shared(mutex);
+    }
+
+    ~PySharedLockGuard() {
+        pthread_mutex_unlock(mutex);
+    }
+
+private:
+    pthread_mutex_t* mutex;
+};
+
+/*
+ * Make the pool of workers, each one forked with its own python or
+ * from the zygote
+ */
+PyWorkerPool::PyWorkerPool(const string& mn,
+                           unsigned int n,
+                           unsigned int k,
+                           PyWorkerSpawn sm,
+                           const PyProcessorRequests& wu):
+    module_name(mn),
+    workers_no(n > 0 ? n : 1),
+    interpreters_no(k > 0 ? k : 1),
+    channels_no(workers_no * interpreters_no),
+    spawn_mode(sm),
+    warmup(wu),
+    channels(NULL),
+    zygote(NULL),
+    spawns(NULL),
+    zygote_pid(0),
+    broken(workers_no, 0)
+{
+    FRAME;
+
+#ifdef PY_OWN_GIL
+    // a worker can't take over interpreters with their own GIL
+    if (spawn_mode == SPAWN_ZYGOTE) {
+        throw logic_error(error_info("zygote needs interpreters sharing the GIL"));
+    }
+#endif
+
+    int rc = pthread_mutex_init(&mutex, NULL);
+    if (rc != 0) {
+        throw runtime_error(sys_error_info(rc, "pthread_mutex_init"));
+    }
+
+    rc = pthread_cond_init(&not_empty_free_cond, NULL);
+    if (rc != 0) {
+        throw runtime_error(sys_error_info(rc, "pthread_cond_init"));
+    }
+
+    try {
+        init_channels();
+        init_workers();
+    } catch(exception& e) {
+        INFO(string("Got exception: ") + e.what());
+        clean_workers();
+        clean_zygote();
+        clean_channels();
+        throw;
+    }
+
+    INFO("Started workers: " + lexical_cast<string>(workers_no) +
+         " for: " + module_name);
+}
+
+/*
+ * Stop all workers and release the shared memory
+ */
+PyWorkerPool::~PyWorkerPool()
+{
+    FRAME;
+
+    clean_workers();
+    clean_zygote();
+    clean_channels();
+    pthread_cond_destroy(&not_empty_free_cond);
+    pthread_mutex_destroy(&mutex);
+}
+
+/*
+ * Number of calls which may run in parallel
+ */
+size_t PyWorkerPool::size() const
+{
+    return channels_no;
+}
+
+/*
+ * Send the request to the worker on a free channel and wait for its
+ * response, until the timeout or, if none, the default one. A worker
+ * not responding in time is killed. A dead worker is replaced once
+ * all its channels are back.
+ */
+string
+PyWorkerPool::process(const string& identifier,
+                      const MapString2String& messages,
+                      const MultimapString2String& parameters,
+                      unsigned long timeout_ns)
+{
+    FRAME;
+
+    if (timeout_ns == 0) {
+        timeout_ns = WORKER_RESPONSE_TIMEOUT_NS;
+    }
+
+    unsigned long deadline_ns = PyMetrics_Clock() + timeout_ns;
+
+    string request;
+    put_string(request, identifier);
+    put_u32(request, messages.size());
+    for (MapString2StringConstIterator it = messages.begin();
+         it != messages.end();
+         ++it) {
+        put_string(request, it->first);
+        put_string(request, it->second);
+    }
+
+    put_u32(request, parameters.size());
+    for (MultimapString2StringConstIterator it = parameters.begin();
+         it != parameters.end();
+         ++it) {
+        put_string(request, it->first);
+        put_string(request, it->second);
+    }
+
+    unsigned int c = alloc();
+    PyWorkerChannel& ch = channels[c];
+    pid_t worker = workers[c / interpreters_no];
+
+    uint32_t status = 0;
+    string response;
+    try {
+        send(ch, ch.request, request, worker, false, deadline_ns);
+
+        uint32_t n = 0;
+        if (!receive(ch, ch.response, reinterpret_cast<char*>(&status), sizeof(status),
+                     worker, false, deadline_ns) ||
+            !receive(ch, ch.response, reinterpret_cast<char*>(&n), sizeof(n),
+                     worker, false, deadline_ns)) {
+            throw runtime_error(error_info("worker stopped: " + lexical_cast<string>(worker)));
+        }
+
+        response.resize(n);
+        if (n > 0 && !receive(ch, ch.response, &response[0], n, worker, false, deadline_ns)) {
+            throw runtime_error(error_info("worker stopped: " + lexical_cast<string>(worker)));
+        }
+    } catch(PyTimeoutError& e) {
+        // it may be stuck in the handler, the channel is of no use
+        INFO("Killing worker: %ld", worker);
+        kill(worker, SIGKILL);
+        replace_worker(c);
+        throw PyTimeoutError(error_info("Handler timed out after " +
+                                        lexical_cast<string>(timeout_ns) +
+                                        " ns in worker: " + lexical_cast<string>(worker)));
+    } catch(runtime_error& e) {
+        if (!peer_alive(worker, false)) {
+            replace_worker(c);
+        }
+
+        throw;
+    }
+
+    dealloc(c);
+
+    if (status != RESPONSE_OK) {
+        throw runtime_error(response);
+    }
+
+    return response;
+}
+
+/*
+ * Map anonymous shared memory inherited by the workers and initialize
+ * process shared synchronization in it
+ */
+void PyWorkerPool::init_channels()
+{
+    FRAME;
+
+    size_t length = channels_no * sizeof(PyWorkerChannel);
+    void* p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        throw runtime_error(sys_error_info(errno, "mmap"));
+    }
+
+    channels = static_cast<PyWorkerChannel*>(p);
+
+    for (size_t i = 0; i < channels_no; i++) {
+        init_channel(channels[i]);
+        free.push_back(i);
+    }
+}
+
+/*
+ * Empty rings and process shared synchronization of the channel, also
+ * of the one a dead worker may have left locked
+ */
+void PyWorkerPool::init_channel(PyWorkerChannel& ch)
+{
+    pthread_mutexattr_t ma;
+    pthread_mutexattr_init(&ma);
+    pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST);
+    pthread_condattr_t ca;
+    pthread_condattr_init(&ca);
+    pthread_condattr_setpshared(&ca, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+
+    ch.stop = 0;
+    ch.request.head = ch.request.tail = 0;
+    ch.response.head = ch.response.tail = 0;
+    pthread_mutex_init(&ch.mutex, &ma);
+    pthread_cond_init(&ch.request.cond, &ca);
+    pthread_cond_init(&ch.response.cond, &ca);
+
+    pthread_condattr_destroy(&ca);
+    pthread_mutexattr_destroy(&ma);
+}
+
+/*
+ * Map the control block shared with the zygote and fork it. Its pid is
+ * known as soon as it runs, the workers only once it has warmed up.
+ */
+void PyWorkerPool::init_zygote()
+{
+    FRAME;
+
+    size_t length = sizeof(PyWorkerZygote) + workers_no * sizeof(PyWorkerSpawnSlot);
+    void* p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        throw runtime_error(sys_error_info(errno, "mmap"));
+    }
+
+    zygote = static_cast<PyWorkerZygote*>(p);
+    spawns = reinterpret_cast<PyWorkerSpawnSlot*>(zygote + 1);
+
+    pthread_mutexattr_t ma;
+    pthread_mutexattr_init(&ma);
+    pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST);
+    pthread_condattr_t ca;
+    pthread_condattr_init(&ca);
+    pthread_condattr_setpshared(&ca, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+
+    zygote->stop = 0;
+    pthread_mutex_init(&zygote->mutex, &ma);
+    pthread_cond_init(&zygote->cond, &ca);
+    for (unsigned int w = 0; w < workers_no; w++) {
+        spawns[w].pid = 0;
+        spawns[w].requested = 0;
+    }
+
+    pthread_condattr_destroy(&ca);
+    pthread_mutexattr_destroy(&ma);
+
+    pid_t pid = fork_python();
+    if (pid == 0) {
+        serve_zygote();
+    }
+
+    if (pid < 0) {
+        throw runtime_error(sys_error_info(errno, "fork"));
+    }
+
+    zygote_pid = pid;
+    INFO("Forked zygote: %ld", pid);
+}
+
+/*
+ * Fork the workers, by this process or by the zygote
+ */
+void PyWorkerPool::init_workers()
+{
+    FRAME;
+
+    if (spawn_mode == SPAWN_ZYGOTE) {
+        init_zygote();
+    }
+
+    for (unsigned int w = 0; w < workers_no; w++) {
+        pid_t pid = 0;
+        if (spawn_mode == SPAWN_ZYGOTE) {
+            pid = spawn(w);
+        } else {
+            pid = fork_worker(w);
+        }
+
+        workers.push_back(pid);
+        INFO("Forked worker: %ld", pid);
+    }
+}
+
+/*
+ * Fork the process. No pool may be changing python meanwhile and, if
+ * python is running already in this process, the GIL is held across
+ * the fork so that the child may take over the interpreter state. It
+ * is not possible with interpreters having their own GIL. On failure
+ * -1 is returned with errno set.
+ */
+pid_t PyWorkerPool::fork_python()
+{
+    pthread_mutex_lock(&global_pool_mutex);
+    bool has_python = Py_IsInitialized();
+#ifdef PY_OWN_GIL
+    // the child can't take over interpreters with their own GIL
+    if (has_python) {
+        pthread_mutex_unlock(&global_pool_mutex);
+        throw logic_error(error_info("workers must be forked before python runs"));
+    }
+#endif
+    PyGILState_STATE gstate = PyGILState_UNLOCKED;
+    if (has_python) {
+        gstate = PyGILState_Ensure();
+#if PY_MAJOR_VERSION >= 3
+        PyOS_BeforeFork();
+#endif
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (has_python) {
+            PyOS_AfterFork();
+            PyGILState_Release(gstate);
+        }
+
+        pthread_mutex_unlock(&global_pool_mutex);
+        return 0;
+    }
+
+    int error = errno;
+    if (has_python) {
+#if PY_MAJOR_VERSION >= 3
+        PyOS_AfterFork_Parent();
+#endif
+        PyGILState_Release(gstate);
+    }
+
+    pthread_mutex_unlock(&global_pool_mutex);
+    errno = error;
+
+    return pid;
+}
+
+/*
+ * Ask all the serving threads to stop and reap the workers
+ */
+void PyWorkerPool::clean_workers()
+{
+    FRAME;
+
+    if (!channels) {
+        return;
+    }
+
+    for (size_t i = 0; i < channels_no; i++) {
+        PySharedLockGuard m(&channels[i].mutex);
+        channels[i].stop = 1;
+        pthread_cond_broadcast(&channels[i].request.cond);
+    }
+
+    for (Pids::iterator it = workers.begin(); it != workers.end(); ++it) {
+        int status = 0;
+        while (waitpid(*it, &status, 0) < 0 && errno == EINTR) {}
+    }
+
+    workers.clear();
+}
+
+/*
+ * Stop the zygote, it waits for its workers already stopping
+ */
+void PyWorkerPool::clean_zygote()
+{
+    FRAME;
+
+    if (!zygote) {
+        return;
+    }
+
+    if (zygote_pid > 0) {
+        {
+            PySharedLockGuard m(&zygote->mutex);
+            zygote->stop = 1;
+            pthread_cond_broadcast(&zygote->cond);
+        }
+
+        int status = 0;
+        while (waitpid(zygote_pid, &status, 0) < 0 && errno == EINTR) {}
+        zygote_pid = 0;
+    }
+
+    pthread_cond_destroy(&zygote->cond);
+    pthread_mutex_destroy(&zygote->mutex);
+    munmap(zygote, sizeof(PyWorkerZygote) + workers_no * sizeof(PyWorkerSpawnSlot));
+    zygote = NULL;
+    spawns = NULL;
+}
+
+void PyWorkerPool::clean_channels()
+{
+    FRAME;
+
+    if (!channels) {
+        return;
+    }
+
+    for (size_t i = 0; i < channels_no; i++) {
+        pthread_cond_destroy(&channels[i].request.cond);
+        pthread_cond_destroy(&channels[i].response.cond);
+        pthread_mutex_destroy(&channels[i].mutex);
+    }
+
+    munmap(channels, channels_no * sizeof(PyWorkerChannel));
+    channels = NULL;
+}
+
+/*
+ * Book a free channel, waiting until some call returns one
+ */
+unsigned int PyWorkerPool::alloc()
+{
+    LockGuard<pthread_mutex_t> m(&mutex);
+
+    while (free.empty()) {
+        pthread_cond_wait(&not_empty_free_cond, &mutex);
+    }
+
+    unsigned int c = free.back();
+    free.pop_back();
+
+    return c;
+}
+
+void PyWorkerPool::dealloc(unsigned int c)
+{
+    LockGuard<pthread_mutex_t> m(&mutex);
+
+    free.push_back(c);
+    pthread_cond_signal(&not_empty_free_cond);
+}
+
+/*
+ * Take back the channel of a dead worker. The first client finding it
+ * dead takes the free channels of the worker too, so nobody uses them.
+ * Once all of them are back and the worker is gone their rings are
+ * emptied and a new worker is made to serve them.
+ */
+void PyWorkerPool::replace_worker(unsigned int c)
+{
+    FRAME;
+
+    LockGuard<pthread_mutex_t> m(&mutex);
+
+    unsigned int w = c / interpreters_no;
+    if (broken[w] == 0) {
+        for (ChannelIndexes::iterator it = free.begin(); it != free.end();) {
+            if (*it / interpreters_no == w) {
+                it = free.erase(it);
+                broken[w]++;
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    if (++broken[w] < interpreters_no) {
+        return;
+    }
+
+    broken[w] = 0;
+    reap_worker(workers[w]);
+    for (unsigned int k = 0; k < interpreters_no; k++) {
+        init_channel(channels[w * interpreters_no + k]);
+    }
+
+    try {
+        workers[w] = spawn_mode == SPAWN_ZYGOTE ? spawn(w) : fork_worker(w);
+    } catch(exception& e) {
+        // the channels of the worker are lost
+        INFO(string("Got exception: ") + e.what());
+        return;
+    }
+
+    INFO("Replaced worker: %ld", workers[w]);
+
+    for (unsigned int k = 0; k < interpreters_no; k++) {
+        free.push_back(w * interpreters_no + k);
+    }
+
+    pthread_cond_broadcast(&not_empty_free_cond);
+}
+
+/*
+ * Wait until the dead worker is reaped, by this process or else by the
+ * zygote, woken up for that. It does not touch its channels any more.
+ */
+void PyWorkerPool::reap_worker(pid_t pid)
+{
+    FRAME;
+
+    if (spawn_mode != SPAWN_ZYGOTE) {
+        while (waitpid(pid, NULL, 0) < 0 && errno == EINTR) {}
+        return;
+    }
+
+    while (peer_alive(pid, false) && peer_alive(zygote_pid, false)) {
+        {
+            PySharedLockGuard m(&zygote->mutex);
+            pthread_cond_broadcast(&zygote->cond);
+        }
+
+        usleep(1000);
+    }
+}
+
+/*
+ * Request the worker from the zygote and wait until it is forked
+ */
+pid_t PyWorkerPool::spawn(unsigned int w)
+{
+    FRAME;
+
+    PySharedLockGuard m(&zygote->mutex);
+
+    spawns[w].pid = 0;
+    spawns[w].requested = 1;
+    pthread_cond_broadcast(&zygote->cond);
+
+    while (spawns[w].pid == 0) {
+        struct timespec ts;
+        make_poll_deadline(ts);
+        int rc = wait_shared(&zygote->cond, &zygote->mutex, &ts);
+        if (rc == ETIMEDOUT && !peer_alive(zygote_pid, false)) {
+            throw runtime_error(error_info("zygote died: " + lexical_cast<string>(zygote_pid)));
+        }
+    }
+
+    if (spawns[w].pid < 0) {
+        throw runtime_error(error_info("zygote failed to fork worker: " + lexical_cast<string>(w)));
+    }
+
+    return spawns[w].pid;
+}
+
+/*
+ * Fork a worker from this process
+ */
+pid_t PyWorkerPool::fork_worker(unsigned int w)
+{
+    pid_t pid = fork_python();
+    if (pid == 0) {
+        serve(w);
+    }
+
+    if (pid < 0) {
+        throw runtime_error(sys_error_info(errno, "fork"));
+    }
+
+    return pid;
+}
+
+/*
+ * Body of a worker process forked by the client: a processor of the
+ * module of its own. It never returns.
+ */
+void PyWorkerPool::serve(unsigned int w)
+{
+    int rc = 0;
+    try {
+        PyProcessor processor(module_name, interpreters_no);
+        run_servers(processor, w);
+    } catch(exception& e) {
+        cerr << error_info(string("worker: ") + e.what()) << endl;
+        rc = 1;
+    }
+
+    _exit(rc);
+}
+
+/*
+ * Body of the zygote: a processor of the module warmed by the warm up
+ * calls, then a worker forked with it for each request of the client.
+ * The zygote stops when asked to or when the client is gone, it never
+ * returns.
+ */
+void PyWorkerPool::serve_zygote()
+{
+    FRAME;
+
+    int rc = 0;
+    try {
+        PyProcessor processor(module_name, interpreters_no);
+        for (PyProcessorRequests::const_iterator it = warmup.begin(); it != warmup.end(); ++it) {
+            try {
+                string content;
+                processor.Process(it->identifier, it->messages, it->parameters, content);
+            } catch(exception& e) {
+                INFO(string("Got exception: ") + e.what());
+            }
+        }
+
+        pid_t client = getppid();
+        lock_shared(&zygote->mutex);
+        while (!zygote->stop && getppid() == client) {
+            for (unsigned int w = 0; w < workers_no; w++) {
+                if (!spawns[w].requested) {
+                    continue;
+                }
+
+                spawns[w].requested = 0;
+                pthread_mutex_unlock(&zygote->mutex);
+                pid_t pid = fork_python();
+                if (pid == 0) {
+                    try {
+                        run_servers(processor, w);
+                    } catch(exception& e) {
+                        cerr << error_info(string("worker: ") + e.what()) << endl;
+                        _exit(1);
+                    }
+
+                    _exit(0);
+                }
+
+                lock_shared(&zygote->mutex);
+                spawns[w].pid = pid;
+                pthread_cond_broadcast(&zygote->cond);
+            }
+
+            struct timespec ts;
+            make_poll_deadline(ts);
+            wait_shared(&zygote->cond, &zygote->mutex, &ts);
+
+            // the dead workers are reaped, the client sees them gone
+            while (waitpid(-1, NULL, WNOHANG) > 0) {}
+        }
+
+        bool stopped = zygote->stop;
+        pthread_mutex_unlock(&zygote->mutex);
+
+        // the workers stop with their channels, or with their parent
+        // if the client is gone
+        while (stopped && (wait(NULL) > 0 || errno == EINTR)) {}
+    } catch(exception& e) {
+        cerr << error_info(string("zygote: ") + e.what()) << endl;
+        rc = 1;
+    }
+
+    _exit(rc);
+}
+
+/*
+ * Serve the channels of the worker with the processor, one thread per
+ * interpreter, until they are stopped
+ */
+void PyWorkerPool::run_servers(PyProcessor& processor, unsigned int w)
+{
+    vector<PyWorkerServer> servers(interpreters_no);
+    vector<pthread_t> threads(interpreters_no);
+    for (unsigned int k = 0; k < interpreters_no; k++) {
+        servers[k].processor = &processor;
+        servers[k].channel = &channels[w * interpreters_no + k];
+        servers[k].parent = getppid();
+        if (k > 0) {
+            pthread_create(&threads[k], NULL, serve_channel, &servers[k]);
+        }
+    }
+
+    serve_channel(&servers[0]);
+    for (unsigned int k = 1; k < interpreters_no; k++) {
+        pthread_join(threads[k], NULL);
+    }
+}
+
+/*
+ * Serving loop of one channel: decode the request, process it and
+ * encode the result or the error as response
+ */
+void* PyWorkerPool::serve_channel(void* arg)
+{
+    PyWorkerServer* s = static_cast<PyWorkerServer*>(arg);
+    PyWorkerChannel& ch = *s->channel;
+
+    for (;;) {
+        uint32_t n = 0;
+        string identifier;
+        MapString2String messages;
+        MultimapString2String parameters;
+
+        if (!receive(ch, ch.request, reinterpret_cast<char*>(&n), sizeof(n), s->parent, true)) {
+            break;
+        }
+
+        identifier.resize(n);
+        if (n > 0 && !receive(ch, ch.request, &identifier[0], n, s->parent, true)) {
+            break;
+        }
+
+        bool stopped = false;
+        for (int map = 0; map < 2 && !stopped; map++) {
+            uint32_t count = 0;
+            stopped = !receive(ch, ch.request, reinterpret_cast<char*>(&count), sizeof(count), s->parent, true);
+            for (uint32_t i = 0; i < count && !stopped; i++) {
+                string kv[2];
+                for (int j = 0; j < 2 && !stopped; j++) {
+                    stopped = !receive(ch, ch.request, reinterpret_cast<char*>(&n), sizeof(n), s->parent, true);
+                    kv[j].resize(n);
+                    if (!stopped && n > 0) {
+                        stopped = !receive(ch, ch.request, &kv[j][0], n, s->parent, true);
+                    }
+                }
+
+                if (map == 0) {
+                    messages[kv[0]] = kv[1];
+                } else {
+                    parameters.insert(make_pair(kv[0], kv[1]));
+                }
+            }
+        }
+
+        if (stopped) {
+            break;
+        }
+
+        string response;
+        try {
+            string content = s->processor->Process(identifier, messages, parameters);
+            put_u32(response, RESPONSE_OK);
+            put_string(response, content);
+        } catch(exception& e) {
+            put_u32(response, RESPONSE_ERROR);
+            put_string(response, e.what());
+        }
+
+        send(ch, ch.response, response, s->parent, true);
+    }
+
+    return NULL;
+}
+
+/*
+ * The client side checks if the worker has not exited, without
+ * reaping it, the worker side if its parent is still there. A worker
+ * of the zygote is not a child of the client, it is alive as long as
+ * it is not reaped by the zygote.
+ */
+bool PyWorkerPool::peer_alive(pid_t peer, bool is_worker)
+{
+    if (is_worker) {
+        return getppid() == peer;
+    }
+
+    siginfo_t info;
+    memset(&info, 0, sizeof(info));
+    if (waitid(P_PID, peer, &info, WEXITED | WNOHANG | WNOWAIT) != 0) {
+        return errno == ECHILD && (kill(peer, 0) == 0 || errno == EPERM);
+    }
+
+    return info.si_pid != peer;
+}
+
+/*
+ * Write all the data on the ring, waiting for space as needed, until
+ * the deadline if any
+ */
+void PyWorkerPool::send(PyWorkerChannel& ch, PyWorkerRing& r,
+                        const string& data, pid_t peer, bool is_worker,
+                        unsigned long deadline_ns)
+{
+    PySharedLockGuard m(&ch.mutex);
+
+    size_t done = 0;
+    while (done < data.size()) {
+        while (r.head - r.tail == WORKER_RING_SIZE) {
+            struct timespec ts;
+            make_poll_deadline(ts, deadline_ns);
+            int rc = wait_shared(&r.cond, &ch.mutex, &ts);
+            if (rc == ETIMEDOUT && !peer_alive(peer, is_worker)) {
+                if (is_worker) {
+                    _exit(1);
+                }
+
+                throw runtime_error(error_info("worker died: " + lexical_cast<string>(peer)));
+            }
+
+            if (deadline_ns != NO_DEADLINE && PyMetrics_Clock() >= deadline_ns) {
+                throw PyTimeoutError(error_info("no response of worker: " +
+                                                lexical_cast<string>(peer)));
+            }
+        }
+
+        size_t at = r.head % WORKER_RING_SIZE;
+        size_t n = min(data.size() - done,
+                       min(WORKER_RING_SIZE - (r.head - r.tail), (size_t)WORKER_RING_SIZE - at));
+        memcpy(r.data + at, data.data() + done, n);
+        r.head += n;
+        done += n;
+        pthread_cond_broadcast(&r.cond);
+    }
+}
+
+/*
+ * Read exactly n bytes from the ring, waiting for them as needed,
+ * until the deadline if any. False is returned if the channel is
+ * stopped.
+ */
+bool PyWorkerPool::receive(PyWorkerChannel& ch, PyWorkerRing& r,
+                           char* data, size_t n, pid_t peer, bool is_worker,
+                           unsigned long deadline_ns)
+{
+    PySharedLockGuard m(&ch.mutex);
+
+    size_t done = 0;
+    while (done < n) {
+        while (r.head == r.tail) {
+            if (ch.stop) {
+                return false;
+            }
+
+            struct timespec ts;
+            make_poll_deadline(ts, deadline_ns);
+            int rc = wait_shared(&r.cond, &ch.mutex, &ts);
+            if (rc == ETIMEDOUT && !peer_alive(peer, is_worker)) {
+                if (is_worker) {
+                    _exit(1);
+                }
+
+                throw runtime_error(error_info("worker died: " + lexical_cast<string>(peer)));
+            }
+
+            if (deadline_ns != NO_DEADLINE && PyMetrics_Clock() >= deadline_ns) {
+                throw PyTimeoutError(error_info("no response of worker: " +
+                                                lexical_cast<string>(peer)));
+            }
+        }
+
+        size_t at = r.tail % WORKER_RING_SIZE;
+        size_t k = min(n - done, min(r.head - r.tail, (size_t)WORKER_RING_SIZE - at));
+        memcpy(data + done, r.data + at, k);
+        r.tail += k;
+        done += k;
+        pthread_cond_broadcast(&r.cond);
+    }
+
+    return true;
+}
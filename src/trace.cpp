@@ -1,5 +1,384 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
 #include "config.h"
+
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aligned_allocator.h"
 #include "trace.h"
 
+#define TRACE_DRAIN_PERIOD_US 1000
+#define TRACE_LINE_SIZE (TRACE_MESSAGE_SIZE + 256)
+
+/*
+ * One traced event as written by the thread, turned to text only by
+ * the drain thread. It has either a message copied, maybe cut, or the
+ * format literal of the message and its arguments.
+ */
+struct __TraceRecord__
+{
+    unsigned long time_ns;
+    pthread_t thread;
+    const char* frame;
+    const char* format;
+    unsigned short level;
+    unsigned char kind;
+    unsigned char size;
+    bool cut;
+    union {
+        char message[TRACE_MESSAGE_SIZE];
+        unsigned long args[TRACE_ARGS];
+    };
+};
+
+/*
+ * Ring of a thread: the thread only moves the head, the drain only the
+ * tail, each on its own cache line. A ring is given to another thread
+ * when its thread is gone.
+ */
+struct __TraceRing__
+{
+    __TraceRing__(): next(NULL), in_use(true), dropped(0), reported(0), head(0), tail(0) {}
+
+    __TraceRing__* next;
+    bool in_use;
+    unsigned long dropped;
+    unsigned long reported;
+    unsigned long head __attribute__((aligned(64)));
+    unsigned long tail __attribute__((aligned(64)));
+    __TraceRecord__ records[TRACE_RING_SIZE];
+};
+
 bool __Frame__::is_trace = __IS_TRACE__;
-unsigned int __Frame__::call_level = 0;
+__thread unsigned int __Frame__::call_level = 0;
+
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_ring_key;
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __TraceRing__* trace_rings = NULL;
+static __thread __TraceRing__* own_ring = NULL;
+static int trace_fd = STDERR_FILENO;
+static bool drain_running = false;
+
+static void drain_start();
+
+/*
+ * The ring of a thread ended is free for the next thread
+ */
+static void release_ring(void* arg)
+{
+    __atomic_store_n(&((__TraceRing__*)arg)->in_use, false, __ATOMIC_RELEASE);
+}
+
+/*
+ * The drain of the parent does not run in a forked child: the records
+ * of the parent are left to it and the child starts its own drain
+ */
+static void fork_prepare()
+{
+    pthread_mutex_lock(&drain_mutex);
+}
+
+static void fork_parent()
+{
+    pthread_mutex_unlock(&drain_mutex);
+}
+
+static void fork_child()
+{
+    for (__TraceRing__* r = trace_rings; r; r = r->next) {
+        r->tail = r->head;
+        r->reported = r->dropped;
+        if (r != own_ring) {
+            r->in_use = false;
+        }
+    }
+
+    drain_running = false;
+    pthread_mutex_init(&drain_mutex, NULL);
+    if (__Frame__::enabled()) {
+        pthread_mutex_lock(&drain_mutex);
+        drain_start();
+        pthread_mutex_unlock(&drain_mutex);
+    }
+}
+
+static void trace_init()
+{
+    pthread_key_create(&trace_ring_key, release_ring);
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+    atexit(__Frame__::flush);
+}
+
+/*
+ * Tracing asked for in the environment is on from the start
+ */
+static struct __TraceEnvironment__
+{
+    __TraceEnvironment__() {
+        if (__IS_TRACE__ || getenv("PYINTERP_TRACE")) {
+            __Frame__::on();
+        }
+    }
+} trace_environment;
+
+/*
+ * A free ring of a thread gone, else a new one linked to the list
+ */
+static __TraceRing__* claim_ring()
+{
+    pthread_once(&trace_once, trace_init);
+
+    __TraceRing__* r = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE);
+    for (; r; r = r->next) {
+        bool free = false;
+        if (!__atomic_load_n(&r->in_use, __ATOMIC_RELAXED) &&
+            __atomic_compare_exchange_n(&r->in_use, &free, true, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    if (!r) {
+        r = aligned_new<__TraceRing__>();
+        r->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&trace_rings, &r->next, r, true,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+    }
+
+    pthread_setspecific(trace_ring_key, r);
+
+    return r;
+}
+
+/*
+ * Next record of the ring of the calling thread, NULL if it is full.
+ * It is made visible to the drain by commit_record.
+ */
+static __TraceRecord__* next_record(__TraceRing__*& r)
+{
+    r = own_ring;
+    if (__builtin_expect(!r, 0)) {
+        r = own_ring = claim_ring();
+    }
+
+    unsigned long head = r->head;
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= TRACE_RING_SIZE) {
+        __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    __TraceRecord__& rec = r->records[head & (TRACE_RING_SIZE - 1)];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec.time_ns = (unsigned long)ts.tv_sec * 1000000000ul + ts.tv_nsec;
+    rec.thread = pthread_self();
+
+    return &rec;
+}
+
+static void commit_record(__TraceRing__* r)
+{
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+void __Frame__::record(__TraceKind__ kind, const char* frame, unsigned int level,
+                       const char* msg, size_t size)
+{
+    __TraceRing__* r = NULL;
+    __TraceRecord__* rec = next_record(r);
+    if (!rec) {
+        return;
+    }
+
+    rec->frame = frame;
+    rec->format = NULL;
+    rec->level = level;
+    rec->kind = kind;
+    rec->size = size < TRACE_MESSAGE_SIZE ? size : TRACE_MESSAGE_SIZE;
+    rec->cut = size > TRACE_MESSAGE_SIZE;
+    memcpy(rec->message, msg, rec->size);
+    commit_record(r);
+}
+
+void __Frame__::record(const char* frame, unsigned int level,
+                       const char* format, const unsigned long* args)
+{
+    __TraceRing__* r = NULL;
+    __TraceRecord__* rec = next_record(r);
+    if (!rec) {
+        return;
+    }
+
+    rec->frame = frame;
+    rec->format = format;
+    rec->level = level;
+    rec->kind = TRACE_INFO;
+    rec->size = 0;
+    rec->cut = false;
+    memcpy(rec->args, args, sizeof(rec->args));
+    commit_record(r);
+}
+
+static void write_all(const std::string& text)
+{
+    size_t done = 0;
+    while (done < text.size()) {
+        ssize_t n = write(trace_fd, text.data() + done, text.size() - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            return;
+        }
+
+        done += n;
+    }
+}
+
+/*
+ * The lines of a record, in the format of the former tracer with the
+ * time in front
+ */
+static void format_record(std::string& text, pid_t pid, const __TraceRecord__& rec)
+{
+    static const char* kinds[] = {"Enter", "Leave", ""};
+    static const char indent[] = "                                ";
+
+    unsigned int level = rec.level < sizeof(indent) - 1 ? rec.level : sizeof(indent) - 1;
+    char message[TRACE_MESSAGE_SIZE + 1];
+    const char* text_message = rec.message;
+    int size = rec.size;
+    bool cut = rec.cut;
+    if (rec.format) {
+        size = snprintf(message, sizeof(message), rec.format,
+                        rec.args[0], rec.args[1], rec.args[2]);
+        cut = size >= (int)sizeof(message);
+        size = size < 0 ? 0 : cut ? sizeof(message) - 1 : size;
+        text_message = message;
+    }
+
+    char line[TRACE_LINE_SIZE];
+    int n = snprintf(line, sizeof(line), "[%lu.%06lu][%d][%lu] TRACE %.*s%s %s%.*s%s\n",
+                     rec.time_ns / 1000000000ul, rec.time_ns % 1000000000ul / 1000,
+                     (int)pid, (unsigned long)rec.thread,
+                     (int)level, indent, rec.frame,
+                     kinds[rec.kind], size, text_message, cut ? "..." : "");
+    if (n > 0) {
+        text.append(line, (size_t)n < sizeof(line) ? n : sizeof(line) - 1);
+    }
+}
+
+/*
+ * Format and write all the records there, under the drain mutex.
+ * Returns the number of records written.
+ */
+static unsigned long drain_rings()
+{
+    std::string text;
+    unsigned long drained = 0;
+    pid_t pid = getpid();
+    for (__TraceRing__* r = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        unsigned long tail = r->tail;
+        unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        for (; tail != head; tail++) {
+            format_record(text, pid, r->records[tail & (TRACE_RING_SIZE - 1)]);
+        }
+
+        drained += head - r->tail;
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+
+        unsigned long dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+        if (dropped != r->reported) {
+            text += "[" + lexical_cast<std::string>(pid) + "] TRACE dropped records: " +
+                lexical_cast<std::string>(dropped - r->reported) + "\n";
+            r->reported = dropped;
+        }
+    }
+
+    write_all(text);
+
+    return drained;
+}
+
+/*
+ * Drain thread, ending once the tracing is off and all is written
+ */
+static void* drain(void* arg)
+{
+    while (true) {
+        pthread_mutex_lock(&drain_mutex);
+        unsigned long drained = drain_rings();
+        if (drained == 0 && !__Frame__::enabled()) {
+            drain_running = false;
+            pthread_mutex_unlock(&drain_mutex);
+            return NULL;
+        }
+
+        pthread_mutex_unlock(&drain_mutex);
+        if (drained == 0) {
+            usleep(TRACE_DRAIN_PERIOD_US);
+        }
+    }
+}
+
+/*
+ * Under the drain mutex
+ */
+static void drain_start()
+{
+    if (drain_running) {
+        return;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    drain_running = pthread_create(&thread, &attr, drain, NULL) == 0;
+    pthread_attr_destroy(&attr);
+}
+
+/*
+ * Turn the tracing on, to the given file
+ */
+void __Frame__::on(int fd)
+{
+    pthread_once(&trace_once, trace_init);
+
+    pthread_mutex_lock(&drain_mutex);
+    trace_fd = fd;
+    __atomic_store_n(&is_trace, true, __ATOMIC_RELAXED);
+    drain_start();
+    pthread_mutex_unlock(&drain_mutex);
+}
+
+/*
+ * Write all the records traced so far, in the calling thread
+ */
+void __Frame__::flush()
+{
+    pthread_mutex_lock(&drain_mutex);
+    drain_rings();
+    pthread_mutex_unlock(&drain_mutex);
+}
+
+/*
+ * Records lost on full rings since the start
+ */
+unsigned long __Frame__::dropped()
+{
+    unsigned long n = 0;
+    for (__TraceRing__* r = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        n += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+    }
+
+    return n;
+}
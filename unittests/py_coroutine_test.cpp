@@ -0,0 +1,120 @@
+#include <string>
+#include <vector>
+
+#include "config.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "gtest/gtest.h"
+#include "py_coroutine.h"
+
+#if defined(__cpp_impl_coroutine)
+
+using namespace std;
+
+//
+// Coroutine started at once and destroyed when it ends
+//
+struct Detached
+{
+    struct promise_type
+    {
+        Detached get_return_object() { return Detached(); }
+        suspend_never initial_suspend() noexcept { return suspend_never(); }
+        suspend_never final_suspend() noexcept { return suspend_never(); }
+        void return_void() {}
+        void unhandled_exception() { terminate(); }
+    };
+};
+
+static Detached acquire_and_release(PyInterpreterPool& pool, int& done)
+{
+    PyInterpreterLease lease = co_await pool.acquire();
+    done++;
+    pool.dealloc(lease);
+}
+
+static Detached process(PyProcessor& processor,
+                        const MapString2String& messages,
+                        const MultimapString2String& parameters,
+                        const string& key,
+                        vector<string>& results)
+{
+    try {
+        results.push_back(co_await processor.ProcessAsync(key, messages, parameters));
+    } catch (runtime_error& e) {
+        results.push_back("error");
+    }
+}
+
+TEST(coroutine, testAcquire)
+{
+    PyInterpreterPool pool(1);
+    pool.start("test_handler", "upper");
+
+    int done = 0;
+    acquire_and_release(pool, done);
+    ASSERT_EQ(1, done);
+
+    // suspended while the only interpreter is held
+    PyInterpreterLease lease = pool.alloc();
+    acquire_and_release(pool, done);
+    acquire_and_release(pool, done);
+    ASSERT_EQ(1, done);
+
+    // both resumed in turn by the release
+    pool.dealloc(lease);
+    ASSERT_EQ(3, done);
+    ASSERT_EQ(1u, pool.size());
+}
+
+struct SleepingCall
+{
+    PyProcessor* processor;
+    const MapString2String* messages;
+    const MultimapString2String* parameters;
+};
+
+static void* sleeping_call(void* arg)
+{
+    SleepingCall* c = (SleepingCall*)arg;
+    c->processor->Process("sleep", *(MapString2String*)c->messages,
+                          *(MultimapString2String*)c->parameters);
+    return NULL;
+}
+
+TEST(coroutine, testProcessAsync)
+{
+    PyProcessor processor("test_handler", 1);
+    MapString2String messages;
+    MultimapString2String parameters;
+    messages.insert(MapString2String::value_type("a", "1"));
+    vector<string> results;
+
+    process(processor, messages, parameters, "id", results);
+    ASSERT_EQ(1u, results.size());
+    ASSERT_EQ("id:a=1:", results[0]);
+
+    // the coroutines wait for the interpreter held by the sleeping call
+    // and are resumed by its release, in its thread
+    SleepingCall c = { &processor, &messages, &parameters };
+    pthread_t t;
+    ASSERT_EQ(0, pthread_create(&t, NULL, sleeping_call, &c));
+    for (int i = 0; i < 200 && processor.Metrics().pool.busy == 0; i++) {
+        usleep(1000);
+    }
+
+    ASSERT_EQ(1u, processor.Metrics().pool.busy);
+    process(processor, messages, parameters, "one", results);
+    process(processor, messages, parameters, "fail", results);
+    process(processor, messages, parameters, "two", results);
+    pthread_join(t, NULL);
+
+    ASSERT_EQ(4u, results.size());
+    ASSERT_EQ("one:a=1:", results[1]);
+    ASSERT_EQ("error", results[2]);
+    ASSERT_EQ("two:a=1:", results[3]);
+}
+
+#endif /* __cpp_impl_coroutine */
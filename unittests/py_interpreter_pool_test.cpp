@@ -1,9 +1,15 @@
+#include <fstream>
 #include <string>
+#include <vector>
 
 #include "config.h"
 
-#include <python2.7/Python.h>
+#include "py_python.h"
 #include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
 
 #include "gtest/gtest.h"
 #include "lexical_cast.h"
@@ -16,6 +22,19 @@
 
 using namespace std;
 
+// python 3 has no string functions, the test module has the same ones
+#if PY_MAJOR_VERSION >= 3
+#define STRING_MODULE "test_handler"
+#else
+#define STRING_MODULE "string"
+#endif
+
+#if PY_MAJOR_VERSION >= 3
+#define BUILTINS_MODULE "builtins"
+#else
+#define BUILTINS_MODULE "__builtin__"
+#endif
+
 class interpreter_pool_fixture: public testing::Test
 {
 public:
@@ -25,7 +44,7 @@ public:
     interpreter_pool_fixture(): pool_size(50) {}
 
     void SetUp() {
-        ip.start("string", "upper");
+        ip.start(STRING_MODULE, "upper");
     }
 
     void TearDown() {}
@@ -52,7 +71,7 @@ TEST_F(interpreter_pool_fixture, testPoolCallAll)
 TEST_F(interpreter_pool_fixture, testPoolNew)
 {
     PyInterpreterPool* ip2 = new PyInterpreterPool(pool_size * 2);
-    ip2->start("string", "lower");
+    ip2->start(STRING_MODULE, "lower");
     ASSERT_EQ(pool_size * 2, ip2->size());
     delete ip2;
 }
@@ -60,7 +79,7 @@ TEST_F(interpreter_pool_fixture, testPoolNew)
 TEST_F(interpreter_pool_fixture, testPoolNewLocalRun)
 {
     PyInterpreterPool* ip3 = new PyInterpreterPool();
-    ip3->start("string", "lower");
+    ip3->start(STRING_MODULE, "lower");
     for (unsigned int i = 0; i < ip3->size(); ++i) {
         PyInterpreterPoolGuard ipg(*ip3);
         string value("ABC");
@@ -73,3 +92,634 @@ TEST_F(interpreter_pool_fixture, testPoolNewLocalRun)
 
     delete ip3;
 }
+
+TEST_F(interpreter_pool_fixture, testPoolLeaseAll)
+{
+    vector<PyInterpreterLease> leases;
+    for (unsigned int i = 0; i < pool_size; ++i) {
+        PyInterpreterLease lease = ip.alloc();
+        ASSERT_LT(lease, pool_size);
+        ASSERT_TRUE(ip.get_interpreter(lease) != NULL);
+        ASSERT_TRUE(ip.get_handler(lease) != NULL);
+        for (unsigned int j = 0; j < leases.size(); ++j) {
+            ASSERT_NE(lease, leases[j]);
+        }
+        leases.push_back(lease);
+    }
+
+    for (unsigned int i = 0; i < leases.size(); ++i) {
+        ip.dealloc(leases[i]);
+    }
+
+    ASSERT_EQ(pool_size, ip.size());
+}
+
+TEST_F(interpreter_pool_fixture, testPoolDeallocTwice)
+{
+    PyInterpreterLease lease = ip.alloc();
+    ip.dealloc(lease);
+    ASSERT_THROW(ip.dealloc(lease), logic_error);
+    ASSERT_THROW(ip.dealloc(pool_size), logic_error);
+}
+
+TEST_F(interpreter_pool_fixture, testPoolSharded)
+{
+    PyInterpreterPool* ip4 = new PyInterpreterPool(pool_size, 4);
+    ip4->start(STRING_MODULE, "upper");
+    ASSERT_EQ(4u, ip4->shards());
+    ASSERT_EQ(pool_size, ip4->size());
+
+    vector<PyInterpreterLease> leases;
+    for (unsigned int i = 0; i < pool_size; ++i) {
+        leases.push_back(ip4->alloc());
+    }
+
+    ASSERT_THROW(ip4->alloc(), runtime_error);
+
+    for (unsigned int i = 0; i < leases.size(); ++i) {
+        ip4->dealloc(leases[i]);
+    }
+
+    ASSERT_EQ(pool_size, ip4->size());
+    delete ip4;
+}
+
+struct delayed_dealloc
+{
+    PyInterpreterPool* pool;
+    PyInterpreterLease lease;
+    unsigned int delay_us;
+};
+
+static void* delayed_dealloc_run(void* arg)
+{
+    delayed_dealloc* d = static_cast<delayed_dealloc*>(arg);
+    usleep(d->delay_us);
+    d->pool->dealloc(d->lease);
+    return NULL;
+}
+
+TEST_F(interpreter_pool_fixture, testPoolWaiterHandOff)
+{
+    vector<PyInterpreterLease> leases;
+    for (unsigned int i = 0; i < pool_size; ++i) {
+        leases.push_back(ip.alloc());
+    }
+
+    // deadline beyond one second must be normalized
+    ASSERT_THROW(ip.alloc(1000000), runtime_error);
+
+    delayed_dealloc d = { &ip, leases.back(), 50000 };
+    leases.pop_back();
+    pthread_t t;
+    ASSERT_EQ(0, pthread_create(&t, NULL, delayed_dealloc_run, &d));
+    PyInterpreterLease lease = ip.alloc(1500000000u);
+    ASSERT_EQ(d.lease, lease);
+    pthread_join(t, NULL);
+    leases.push_back(lease);
+
+    for (unsigned int i = 0; i < leases.size(); ++i) {
+        ip.dealloc(leases[i]);
+    }
+
+    ASSERT_EQ(pool_size, ip.size());
+}
+
+TEST(interpreter_pool, testPoolReuseLifo)
+{
+    PyInterpreterPool* ip5 = new PyInterpreterPool(4, 1, REUSE_LIFO);
+    ip5->start(STRING_MODULE, "upper");
+    PyInterpreterLease first = ip5->alloc();
+    PyInterpreterLease second = ip5->alloc();
+    ip5->dealloc(first);
+    ip5->dealloc(second);
+    ASSERT_EQ(second, ip5->alloc());
+    ASSERT_EQ(first, ip5->alloc());
+    ASSERT_TRUE(ip5->get_handler(first) != ip5->get_handler(second));
+    ip5->dealloc(first);
+    ip5->dealloc(second);
+    delete ip5;
+}
+
+// each of two threads books one interpreter and puts it back, in turns
+struct reuse_run
+{
+    PyInterpreterPool* pool;
+    pthread_barrier_t turn;
+    PyInterpreterLease first;
+    PyInterpreterLease again;
+};
+
+static void* reuse_other(void* arg)
+{
+    reuse_run& r = *static_cast<reuse_run*>(arg);
+    pthread_barrier_wait(&r.turn);
+    r.first = r.pool->alloc();
+    pthread_barrier_wait(&r.turn);
+    pthread_barrier_wait(&r.turn);
+    r.pool->dealloc(r.first);
+    pthread_barrier_wait(&r.turn);
+    pthread_barrier_wait(&r.turn);
+    r.again = r.pool->alloc();
+    r.pool->dealloc(r.again);
+    return NULL;
+}
+
+static void reuse_two_threads(PyInterpreterReusePolicy policy, reuse_run& mine, reuse_run& other)
+{
+    PyInterpreterPool pool(4, 1, policy);
+    pool.start(STRING_MODULE, "upper");
+    other.pool = &pool;
+    pthread_barrier_init(&other.turn, NULL, 2);
+    pthread_t t;
+    pthread_create(&t, NULL, reuse_other, &other);
+    mine.first = pool.alloc();
+    pthread_barrier_wait(&other.turn);
+    pthread_barrier_wait(&other.turn);
+    pool.dealloc(mine.first);
+    pthread_barrier_wait(&other.turn);
+    pthread_barrier_wait(&other.turn);
+    mine.again = pool.alloc();
+    pthread_barrier_wait(&other.turn);
+    pthread_join(t, NULL);
+    pool.dealloc(mine.again);
+    pthread_barrier_destroy(&other.turn);
+}
+
+TEST(interpreter_pool, testPoolReuseAffinity)
+{
+    reuse_run mine;
+    reuse_run other;
+
+    // each thread gets back the one it used last
+    reuse_two_threads(REUSE_AFFINITY, mine, other);
+    ASSERT_NE(mine.first, other.first);
+    ASSERT_EQ(mine.first, mine.again);
+    ASSERT_EQ(other.first, other.again);
+
+    // the last released goes to whoever comes first
+    reuse_two_threads(REUSE_LIFO, mine, other);
+    ASSERT_EQ(other.first, mine.again);
+    ASSERT_EQ(mine.first, other.again);
+}
+
+TEST(interpreter_pool, testPoolElastic)
+{
+    ASSERT_THROW(PyInterpreterPool(PyInterpreterScaling(3, 2)), logic_error);
+
+    PyInterpreterScaling scaling(1, 3);
+    scaling.period_ms = 10;
+    scaling.idle_ms = 50;
+    scaling.grow_wait_ns = 1000000000u;
+    PyInterpreterPool* ip7 = new PyInterpreterPool(scaling);
+    ip7->start(STRING_MODULE, "upper");
+    ASSERT_EQ(1u, ip7->size());
+    ASSERT_EQ(3u, ip7->capacity());
+
+    // the waiting client gets a new interpreter
+    PyInterpreterLease first = ip7->alloc();
+    PyInterpreterLease second = ip7->alloc(1000000000u);
+    ASSERT_NE(first, second);
+    ASSERT_TRUE(ip7->get_handler(second) != NULL);
+    ASSERT_EQ(2u, ip7->size());
+
+    PyInterpreterPoolStats st = ip7->stats();
+    ASSERT_EQ(1u, st.grown);
+    ASSERT_EQ(1u, st.waits);
+    ASSERT_EQ(2u, st.busy);
+
+    ip7->dealloc(first);
+    ip7->dealloc(second);
+
+    // idle ones are ended down to the lower bound
+    for (unsigned int i = 0; i < 200 && ip7->size() > 1; i++) {
+        usleep(10000);
+    }
+
+    ASSERT_EQ(1u, ip7->size());
+    ASSERT_EQ(1u, ip7->stats().retired);
+
+    {
+        PyInterpreterPoolGuard ipg(*ip7);
+        PyObject* arg = Py_BuildValue("s", "abc");
+        PyObject* argv = PyTuple_Pack(1, arg);
+        PyObject* rv = ipg(argv);
+        ASSERT_EQ(string("ABC"), string(PyString_AsString(rv)));
+    }
+
+    delete ip7;
+}
+
+static void pool_ready(void* arg, size_t size)
+{
+    __atomic_store_n((size_t*)arg, size, __ATOMIC_RELEASE);
+}
+
+TEST(interpreter_pool, testPoolProgressive)
+{
+    size_t ready_size = 0;
+    PyInterpreterScaling scaling(4, 4);
+    scaling.progressive = true;
+    scaling.on_ready = pool_ready;
+    scaling.ready_arg = &ready_size;
+    PyInterpreterPool* ip8 = new PyInterpreterPool(scaling);
+    ip8->start(STRING_MODULE, "upper");
+    ASSERT_LE(1u, ip8->size());
+
+    // the first one is served at once
+    PyInterpreterLease first = ip8->alloc();
+    ASSERT_TRUE(ip8->get_handler(first) != NULL);
+    ip8->dealloc(first);
+
+    for (unsigned int i = 0; i < 200 && !__atomic_load_n(&ready_size, __ATOMIC_ACQUIRE); i++) {
+        usleep(10000);
+    }
+
+    ASSERT_EQ(4u, ready_size);
+    ASSERT_EQ(4u, ip8->size());
+    ASSERT_EQ(0u, ip8->stats().grown);
+
+    vector<PyInterpreterLease> leases;
+    for (unsigned int i = 0; i < 4; ++i) {
+        leases.push_back(ip8->alloc());
+        ASSERT_TRUE(ip8->get_handler(leases.back()) != NULL);
+    }
+
+    for (unsigned int i = 0; i < leases.size(); ++i) {
+        ip8->dealloc(leases[i]);
+    }
+
+    delete ip8;
+}
+
+static unsigned int count_preloaded(bool preload)
+{
+    PyInterpreterPool pool(3);
+    pool.preload_modules(preload);
+    pool.start("test_handler", "loader");
+
+    vector<PyInterpreterLease> leases;
+    unsigned int preloaded = 0;
+    for (unsigned int i = 0; i < 3; ++i) {
+        leases.push_back(pool.alloc());
+        PyInterpreterPoolGuard ipg(pool, leases.back());
+        PyObject* arg = Py_BuildValue("s", "");
+        PyObject* argv = PyTuple_Pack(1, arg);
+        PyObject* rv = ipg(argv);
+        if (string(PyString_AsString(rv)) == "PyPreloadImporter") {
+            preloaded++;
+        }
+        Py_DecrefAll(3, arg, argv, rv);
+    }
+
+    for (unsigned int i = 0; i < leases.size(); ++i) {
+        pool.dealloc(leases[i]);
+    }
+
+    return preloaded;
+}
+
+TEST(interpreter_pool, testPoolPreload)
+{
+    // the first interpreter imports the module from its file
+    ASSERT_EQ(2u, count_preloaded(true));
+    ASSERT_EQ(0u, count_preloaded(false));
+}
+
+TEST(interpreter_pool, testPoolMetrics)
+{
+    PyInterpreterPool* ip9 = new PyInterpreterPool(2);
+    ip9->start(STRING_MODULE, "upper");
+    PyInterpreterLease held = ip9->alloc();
+    for (unsigned int i = 0; i < 3; ++i) {
+        PyInterpreterPoolGuard ipg(*ip9);
+        PyObject* arg = Py_BuildValue("s", "abc");
+        PyObject* argv = PyTuple_Pack(1, arg);
+        PyObject* rv = ipg(argv);
+        Py_DecrefAll(3, arg, argv, rv);
+    }
+
+    PyInterpreterPoolMetrics m = ip9->metrics();
+    ASSERT_EQ(2u, m.pool.size);
+    ASSERT_EQ(1u, m.pool.busy);
+    ASSERT_EQ(1u, m.free);
+    ASSERT_EQ(4u, m.histograms[METRIC_ALLOC_WAIT].count);
+    ASSERT_EQ(3u, m.histograms[METRIC_GIL_ACQUIRE].count);
+    ASSERT_EQ(3u, m.histograms[METRIC_HANDLER].count);
+    ASSERT_GT(m.histograms[METRIC_HANDLER].max, 0u);
+    ASSERT_EQ(0u, m.histograms[METRIC_MARSHAL].count);
+
+    // the one waiting to the deadline is counted
+    PyInterpreterLease other = ip9->alloc();
+    ASSERT_THROW(ip9->alloc(1000000u), runtime_error);
+    ASSERT_EQ(1u, ip9->metrics().pool.timeouts);
+    ASSERT_EQ(0u, ip9->metrics().free);
+
+    ip9->dealloc(other);
+    ip9->dealloc(held);
+    delete ip9;
+}
+
+TEST(interpreter_pool, testPoolHandlers)
+{
+    PyHandlerNames names;
+    names.push_back(PyHandlerName("test_handler", "upper"));
+    names.push_back(PyHandlerName("test_handler", "lower"));
+    PyInterpreterPool pool(2);
+    pool.start(names);
+    ASSERT_EQ(2u, pool.handlers());
+
+    for (unsigned int i = 0; i < 2; ++i) {
+        PyInterpreterPoolGuard ipg(pool);
+        PyObject* arg = Py_BuildValue("s", "aBc");
+        PyObject* argv = PyTuple_Pack(1, arg);
+        PyObject* upper = ipg(DEFAULT_HANDLER, argv);
+        PyObject* lower = ipg(1, argv);
+        ASSERT_EQ(string("ABC"), string(PyString_AsString(upper)));
+        ASSERT_EQ(string("abc"), string(PyString_AsString(lower)));
+        ASSERT_THROW(ipg(2, argv), logic_error);
+        Py_DecrefAll(4, arg, argv, upper, lower);
+    }
+
+    PyHandlerNames missing(1, PyHandlerName("test_handler", "missing"));
+    PyInterpreterPool other(1);
+    ASSERT_THROW(other.start(missing), runtime_error);
+    ASSERT_THROW(other.start(PyHandlerNames()), logic_error);
+}
+
+#define RELOAD_MODULE "reload_handler"
+
+// the modules written by the tests are kept out of the source tree
+static const string module_dir = string(P_tmpdir) + "/pyinterp_test." +
+                                 lexical_cast<string>(getpid());
+
+static int add_module_dir()
+{
+    const char* path = getenv("PYTHONPATH");
+    return setenv("PYTHONPATH",
+                  (string(path ? path : TEST_MODULE_PATH) + ":" + module_dir).c_str(), 1);
+}
+
+static int module_path = add_module_dir();
+
+// a new mtime, the compiled files of the former code are then stale
+static void write_module(const string& source, time_t mtime)
+{
+    mkdir(module_dir.c_str(), 0700);
+    string path = module_dir + "/" RELOAD_MODULE ".py";
+    ofstream(path.c_str()) << source;
+    struct utimbuf times = { mtime, mtime };
+    utime(path.c_str(), &times);
+}
+
+static void remove_module()
+{
+    string path = module_dir + "/";
+    unlink((path + RELOAD_MODULE ".py").c_str());
+    unlink((path + RELOAD_MODULE ".pyc").c_str());
+    unlink((path + "__pycache__/" RELOAD_MODULE ".cpython-" +
+            lexical_cast<string>(PY_MAJOR_VERSION) +
+            lexical_cast<string>(PY_MINOR_VERSION) + ".pyc").c_str());
+    rmdir((path + "__pycache__").c_str());
+    rmdir(module_dir.c_str());
+}
+
+static string call_module(PyInterpreterPool& pool, PyInterpreterLease lease)
+{
+    PyInterpreterPoolGuard ipg(pool, lease);
+    PyObject* arg = Py_BuildValue("s", "key");
+    PyObject* argv = PyTuple_Pack(1, arg);
+    PyObject* rv = ipg(argv);
+    string result(PyString_AsString(rv));
+    Py_DecrefAll(3, arg, argv, rv);
+
+    return result;
+}
+
+static void* reload_run(void* arg)
+{
+    static_cast<PyInterpreterPool*>(arg)->reload();
+    return NULL;
+}
+
+TEST(interpreter_pool, testPoolReload)
+{
+    time_t now = time(NULL);
+    write_module("def handler(key):\n    return 'v1:' + key\n", now - 20);
+    PyInterpreterPool pool(2);
+    pool.start(RELOAD_MODULE, "handler");
+    ASSERT_EQ(0u, pool.version());
+
+    // the busy interpreter is rebuilt once released, its call ends on v1
+    PyInterpreterLease busy = pool.alloc();
+    PyInterpreterLease other = 1 - busy;
+    write_module("def handler(key):\n    return 'v2:' + key\n", now - 10);
+    pthread_t t;
+    ASSERT_EQ(0, pthread_create(&t, NULL, reload_run, &pool));
+    for (unsigned int i = 0; i < 200 && pool.get_version(other) != 1; i++) {
+        usleep(10000);
+    }
+
+    ASSERT_EQ(1u, pool.get_version(other));
+    ASSERT_EQ(1u, pool.version());
+    ASSERT_EQ(0u, pool.get_version(busy));
+    ASSERT_EQ(string("v1:key"), call_module(pool, busy));
+    pool.dealloc(busy);
+    pthread_join(t, NULL);
+
+    vector<PyInterpreterLease> leases;
+    for (unsigned int i = 0; i < 2; ++i) {
+        leases.push_back(pool.alloc());
+        ASSERT_EQ(1u, pool.get_version(leases.back()));
+        ASSERT_EQ(string("v2:key"), call_module(pool, leases.back()));
+    }
+
+    for (unsigned int i = 0; i < leases.size(); ++i) {
+        pool.dealloc(leases[i]);
+    }
+
+    // broken code is not taken, the pool keeps serving v2
+    write_module("def handler(key):\n    return 'v3:' +\n", now);
+    ASSERT_THROW(pool.reload(), runtime_error);
+    ASSERT_EQ(1u, pool.version());
+    ASSERT_EQ(2u, pool.size());
+    for (unsigned int i = 0; i < 2; ++i) {
+        PyInterpreterLease lease = pool.alloc();
+        leases[i] = lease;
+        ASSERT_EQ(string("v2:key"), call_module(pool, lease));
+    }
+
+    for (unsigned int i = 0; i < leases.size(); ++i) {
+        pool.dealloc(leases[i]);
+    }
+
+    // a lease kept for good fails the walks at their timeout
+    write_module("def handler(key):\n    return 'v4:' + key\n", now + 10);
+    PyInterpreterLease kept = pool.alloc();
+    ASSERT_THROW(pool.reload(50000000ul), PyTimeoutError);
+    ASSERT_THROW(pool.footprint(50000000ul), PyTimeoutError);
+    ASSERT_EQ(string("v2:key"), call_module(pool, kept));
+    pool.dealloc(kept);
+
+    remove_module();
+}
+
+// false if not done within two seconds
+static bool wait_recycled(PyInterpreterPool& pool, unsigned long n)
+{
+    for (unsigned int i = 0; i < 200; i++) {
+        if (pool.stats().recycled >= n && pool.stats().busy == 0) {
+            return true;
+        }
+
+        usleep(10000);
+    }
+
+    return false;
+}
+
+static void call_handler(PyInterpreterPool& pool, PyInterpreterLease lease, PyHandlerId id)
+{
+    PyInterpreterPoolGuard ipg(pool, lease);
+    PyObject* arg = Py_BuildValue("s", "abc");
+    PyObject* argv = PyTuple_Pack(1, arg);
+    PyObject* rv = NULL;
+    try {
+        rv = ipg(id, argv);
+    } catch (...) {
+        Py_DecrefAll(2, arg, argv);
+        throw;
+    }
+
+    Py_DecrefAll(3, arg, argv, rv);
+}
+
+TEST(interpreter_pool, testPoolRecycle)
+{
+    PyHandlerNames names;
+    names.push_back(PyHandlerName("test_handler", "upper"));
+    names.push_back(PyHandlerName("test_handler", "leak"));
+    names.push_back(PyHandlerName("test_handler", "exit"));
+    PyInterpreterScaling scaling(2, 2);
+    scaling.recycling.max_calls = 3;
+    scaling.recycling.max_heap_growth = 1000;
+    scaling.recycling.heap_check_calls = 1;
+    scaling.recycling.on_error = true;
+#ifndef PY_OWN_GIL
+    // the heap of an interpreter is not known with a shared allocator
+    ASSERT_THROW(PyInterpreterPool shared(scaling), logic_error);
+    scaling.recycling.max_heap_growth = 0;
+#endif
+    PyInterpreterPool pool(scaling);
+    pool.start(names);
+
+    // quarantined once released, not before
+    PyInterpreterLease lease = pool.alloc();
+    for (unsigned int i = 0; i < 3; ++i) {
+        call_handler(pool, lease, DEFAULT_HANDLER);
+    }
+
+    ASSERT_EQ(0u, pool.stats().recycled);
+    pool.dealloc(lease);
+    ASSERT_TRUE(wait_recycled(pool, 1));
+    ASSERT_EQ(2u, pool.size());
+
+    // the new one counts from zero
+    lease = pool.alloc();
+    call_handler(pool, lease, DEFAULT_HANDLER);
+    call_handler(pool, lease, DEFAULT_HANDLER);
+    pool.dealloc(lease);
+    ASSERT_EQ(1u, pool.stats().recycled);
+
+    unsigned long recycled = 1;
+#ifdef PY_OWN_GIL
+    lease = pool.alloc();
+    call_handler(pool, lease, 1);
+    pool.dealloc(lease);
+    ASSERT_TRUE(wait_recycled(pool, ++recycled));
+#endif
+
+    // nor is its state known after the handler exits
+    lease = pool.alloc();
+    ASSERT_THROW(call_handler(pool, lease, 2), runtime_error);
+    pool.dealloc(lease);
+    ASSERT_TRUE(wait_recycled(pool, ++recycled));
+    ASSERT_EQ(2u, pool.size());
+    ASSERT_EQ(0u, pool.stats().busy);
+
+    PyInterpreterScaling invalid(1, 1);
+    invalid.recycling.max_heap_growth = 1;
+    invalid.recycling.heap_check_calls = 0;
+    ASSERT_THROW(PyInterpreterPool other(invalid), logic_error);
+}
+
+TEST(interpreter_pool, testPoolFootprint)
+{
+    PyInterpreterPool pool(2);
+    pool.start("test_handler", "upper");
+    PyPoolFootprint f = pool.footprint();
+    ASSERT_EQ(2u, f.interpreters.size());
+    for (unsigned int i = 0; i < f.interpreters.size(); ++i) {
+        const PyInterpreterFootprint& fi = f.interpreters[i];
+        ASSERT_GT(fi.objects, 0u);
+        ASSERT_GT(fi.bytes, 0u);
+        ASSERT_FALSE(fi.types.empty());
+        ASSERT_GE(fi.types.front().bytes, fi.types.back().bytes);
+        bool found = false;
+        for (unsigned int j = 0; j < fi.modules.size(); ++j) {
+            if (fi.modules[j].name == "test_handler") {
+                ASSERT_GT(fi.modules[j].entries, 0u);
+                ASSERT_GT(fi.modules[j].dict_bytes, 0u);
+                found = true;
+            }
+
+            // charged with its own contents, not the first importer
+            if (fi.modules[j].name == BUILTINS_MODULE) {
+                ASSERT_GT(fi.modules[j].bytes, fi.modules[j].dict_bytes);
+            }
+        }
+        ASSERT_TRUE(found);
+    }
+
+    ASSERT_EQ(f.interpreters[0].bytes + f.interpreters[1].bytes, f.bytes);
+    ASSERT_GT(f.handler_bytes, 0u);
+    ASSERT_FALSE(f.duplicated.empty());
+    bool duplicated = false;
+    for (unsigned int i = 0; i < f.duplicated.size(); ++i) {
+        if (f.duplicated[i].name == "test_handler") {
+            ASSERT_EQ(2u, f.duplicated[i].copies);
+            duplicated = true;
+        }
+    }
+    ASSERT_TRUE(duplicated);
+}
+
+TEST(interpreter_pool, testPoolWatchdog)
+{
+    PyHandlerNames names;
+    names.push_back(PyHandlerName("test_handler", "upper"));
+    names.push_back(PyHandlerName("test_handler", "spin"));
+    PyInterpreterScaling scaling(2, 2);
+    scaling.recycling.on_error = true;
+    PyInterpreterPool pool(scaling);
+    pool.start(names);
+
+    PyInterpreterLease lease = pool.alloc();
+    {
+        PyInterpreterPoolGuard ipg(pool, lease);
+        ipg.set_timeout(50000000ul);
+        PyObject* arg = Py_BuildValue("s", "abc");
+        PyObject* argv = PyTuple_Pack(1, arg);
+        ASSERT_THROW(ipg(1, argv), PyTimeoutError);
+
+        // the exception is not left for the next call
+        PyObject* rv = ipg(DEFAULT_HANDLER, argv);
+        ASSERT_EQ(string("ABC"), string(PyString_AsString(rv)));
+        Py_DecrefAll(3, arg, argv, rv);
+    }
+
+    ASSERT_EQ(1u, pool.stats().expired);
+    pool.dealloc(lease);
+    ASSERT_TRUE(wait_recycled(pool, 1));
+    ASSERT_EQ(2u, pool.size());
+}
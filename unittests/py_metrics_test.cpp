@@ -0,0 +1,95 @@
+#include <string>
+
+#include <pthread.h>
+
+#include "gtest/gtest.h"
+#include "py_metrics.h"
+
+using namespace std;
+
+TEST(py_metrics, testHistogramBuckets)
+{
+    // exact below 16, then 16 buckets per power of two
+    ASSERT_EQ(0u, PyHistogram::bucket(0));
+    ASSERT_EQ(15u, PyHistogram::bucket(15));
+    ASSERT_EQ(16u, PyHistogram::bucket(16));
+    ASSERT_EQ(31u, PyHistogram::bucket(31));
+    ASSERT_EQ(32u, PyHistogram::bucket(32));
+    ASSERT_EQ(32u, PyHistogram::bucket(33));
+    ASSERT_EQ(METRICS_BUCKETS - 1, PyHistogram::bucket((unsigned long)-1));
+
+    for (unsigned long v = 1; v < (1ul << 40); v = v * 3 + 1) {
+        unsigned int b = PyHistogram::bucket(v);
+        ASSERT_GE(PyHistogram::bucket_value(b), v);
+        ASSERT_LE(PyHistogram::bucket_value(b) - v, v / 16);
+        ASSERT_EQ(b, PyHistogram::bucket(PyHistogram::bucket_value(b)));
+    }
+}
+
+TEST(py_metrics, testHistogramPercentile)
+{
+    PyMetrics metrics;
+    for (unsigned long v = 1; v <= 1000; v++) {
+        metrics.record(METRIC_HANDLER, v * 1000);
+    }
+
+    PyHistogram h[METRICS_NO];
+    metrics.snapshot(h);
+    ASSERT_EQ(0u, h[METRIC_ALLOC_WAIT].count);
+    ASSERT_EQ(0u, h[METRIC_ALLOC_WAIT].percentile(99));
+    ASSERT_EQ(1000u, h[METRIC_HANDLER].count);
+    ASSERT_EQ(1000000u, h[METRIC_HANDLER].max);
+    ASSERT_DOUBLE_EQ(500500.0, h[METRIC_HANDLER].mean());
+    ASSERT_NEAR(500000.0, (double)h[METRIC_HANDLER].percentile(50), 500000.0 / 16);
+    ASSERT_NEAR(990000.0, (double)h[METRIC_HANDLER].percentile(99), 990000.0 / 16);
+    ASSERT_EQ(1000000u, h[METRIC_HANDLER].percentile(100));
+}
+
+static void* record_many(void* arg)
+{
+    PyMetrics* metrics = (PyMetrics*)arg;
+    for (unsigned int i = 0; i < 10000; i++) {
+        metrics->record(METRIC_GIL_ACQUIRE, i);
+    }
+
+    return NULL;
+}
+
+TEST(py_metrics, testMetricsThreads)
+{
+    PyMetrics metrics;
+    pthread_t threads[4];
+    for (unsigned int i = 0; i < 4; i++) {
+        ASSERT_EQ(0, pthread_create(&threads[i], NULL, record_many, &metrics));
+    }
+
+    for (unsigned int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // a recorder made after another one does not see its counts
+    PyMetrics other;
+    other.record(METRIC_GIL_ACQUIRE, 1);
+
+    PyHistogram h[METRICS_NO];
+    metrics.snapshot(h);
+    ASSERT_EQ(40000u, h[METRIC_GIL_ACQUIRE].count);
+    ASSERT_EQ(9999u, h[METRIC_GIL_ACQUIRE].max);
+    other.snapshot(h);
+    ASSERT_EQ(1u, h[METRIC_GIL_ACQUIRE].count);
+}
+
+TEST(py_metrics, testHistogramAdd)
+{
+    PyHistogram a;
+    PyHistogram b;
+    a.record(100);
+    b.record(1000);
+    b.record(10000);
+    a.add(b);
+    ASSERT_EQ(3u, a.count);
+    ASSERT_EQ(11100u, a.sum);
+    ASSERT_EQ(10000u, a.max);
+    ASSERT_EQ(PyHistogram::bucket_value(PyHistogram::bucket(100)), a.percentile(1));
+    ASSERT_EQ(10000u, a.percentile(100));
+}
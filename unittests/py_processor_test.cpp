@@ -0,0 +1,440 @@
+#include <string>
+
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#include "py_python.h"
+
+#include "gtest/gtest.h"
+#include "py_processor.h"
+#include "py_worker_pool.h"
+
+using namespace std;
+
+// python takes its path once, at the first initialization
+static int python_path = setenv("PYTHONPATH", TEST_MODULE_PATH, 0);
+
+class processor_fixture: public testing::Test
+{
+public:
+    MapString2String messages;
+    MultimapString2String parameters;
+
+    void SetUp() {
+        messages["b"] = "2";
+        messages["a"] = "1";
+        parameters.insert(make_pair(string("p"), string("x")));
+        parameters.insert(make_pair(string("q"), string("y")));
+    }
+};
+
+TEST_F(processor_fixture, testProcess)
+{
+    PyProcessor processor("test_handler", 4);
+    ASSERT_EQ(4u, processor.size());
+    ASSERT_EQ("id:a=1,b=2:p,q", processor.Process("id", messages, parameters));
+}
+
+TEST_F(processor_fixture, testProcessError)
+{
+    PyProcessor processor("test_handler", 4);
+    ASSERT_THROW(processor.Process("fail", messages, parameters), runtime_error);
+}
+
+TEST_F(processor_fixture, testProcessHandlers)
+{
+    PyHandlerNames handlers;
+    handlers.push_back(PyHandlerName("test_handler", PYTHON_DATA_HANDLER));
+    handlers.push_back(PyHandlerName("test_handler", "count"));
+    PyProcessor processor(handlers, PyInterpreterScaling(2, 2));
+    ASSERT_EQ("id:a=1,b=2:p,q", processor.Process("id", messages, parameters));
+    ASSERT_EQ("id:a=1,b=2:p,q", processor.Process(DEFAULT_HANDLER, "id", messages, parameters));
+    ASSERT_EQ("id:4", processor.Process(1, "id", messages, parameters));
+
+    string output;
+    processor.Process(1, "key", messages, parameters, output);
+    ASSERT_EQ("key:4", output);
+    ASSERT_THROW(processor.Process(2, "id", messages, parameters), logic_error);
+}
+
+TEST_F(processor_fixture, testProcessTimeout)
+{
+    PyHandlerNames handlers;
+    handlers.push_back(PyHandlerName("test_handler", PYTHON_DATA_HANDLER));
+    handlers.push_back(PyHandlerName("test_handler", "spin"));
+    PyProcessor processor(handlers, PyInterpreterScaling(1, 1));
+    ASSERT_THROW(processor.Process(1, "id", messages, parameters, 50000000ul), PyTimeoutError);
+    ASSERT_EQ("id:a=1,b=2:p,q", processor.Process(DEFAULT_HANDLER, "id", messages, parameters,
+                                                  1000000000ul));
+    ASSERT_EQ(1u, processor.Metrics().pool.expired);
+
+    ASSERT_THROW(processor.Process("spin", messages, parameters, 50000000ul), PyTimeoutError);
+    PyProcessorRequests requests;
+    requests.push_back(PyProcessorRequest("spin", messages, parameters, 50000000ul));
+    requests.push_back(PyProcessorRequest("id", messages, parameters));
+    PyProcessorResults results = processor.ProcessBatch(requests);
+    ASSERT_EQ(PROCESS_ERROR, results[0].status);
+    ASSERT_EQ(PROCESS_OK, results[1].status);
+
+    processor.StartExecutors(1);
+    PyProcessorFuture f = processor.Submit("spin", messages, parameters, 50000000ul);
+    ASSERT_EQ(PROCESS_ERROR, f.get().status);
+    ASSERT_EQ(4u, processor.Metrics().pool.expired);
+}
+
+TEST_F(processor_fixture, testProcessMetrics)
+{
+    PyProcessor processor("test_handler", 2);
+    for (int i = 0; i < 5; i++) {
+        processor.Process("id", messages, parameters);
+    }
+
+    PyInterpreterPoolMetrics m = processor.Metrics();
+    ASSERT_EQ(2u, m.free);
+    ASSERT_EQ(0u, m.pool.busy);
+    ASSERT_EQ(5u, m.histograms[METRIC_MARSHAL].count);
+    ASSERT_EQ(5u, m.histograms[METRIC_HANDLER].count);
+    ASSERT_LE(m.histograms[METRIC_HANDLER].percentile(50),
+              m.histograms[METRIC_HANDLER].percentile(99));
+
+#ifndef PY_OWN_GIL
+    PyProcessor workers("test_handler", BACKEND_WORKERS, 1, 1);
+    workers.Process("id", messages, parameters);
+    ASSERT_EQ(0u, workers.Metrics().histograms[METRIC_HANDLER].count);
+#endif
+}
+
+TEST_F(processor_fixture, testProcessWorkers)
+{
+    PyProcessor processor("test_handler", BACKEND_WORKERS, 2, 2);
+    ASSERT_EQ(4u, processor.size());
+    for (int i = 0; i < 10; i++) {
+        ASSERT_EQ("id:a=1,b=2:p,q", processor.Process("id", messages, parameters));
+    }
+
+    ASSERT_THROW(processor.Process("fail", messages, parameters), runtime_error);
+    ASSERT_EQ("id:a=1,b=2:p,q", processor.Process("id", messages, parameters));
+}
+
+TEST_F(processor_fixture, testProcessWorkersLarge)
+{
+    PyProcessor processor("test_handler", BACKEND_WORKERS, 1);
+    string large(3 * WORKER_RING_SIZE + 7, 'v');
+    messages["a"] = large;
+    ASSERT_EQ("id:a=" + large + ",b=2:p,q", processor.Process("id", messages, parameters));
+}
+
+TEST_F(processor_fixture, testProcessWorkersForkedFromPython)
+{
+    PyProcessor local("test_handler", 2);
+#ifdef PY_OWN_GIL
+    ASSERT_THROW(PyProcessor("test_handler", BACKEND_WORKERS, 2), logic_error);
+#else
+    PyProcessor remote("test_handler", BACKEND_WORKERS, 2);
+    ASSERT_EQ(local.Process("id", messages, parameters),
+              remote.Process("id", messages, parameters));
+#endif
+}
+
+TEST_F(processor_fixture, testProcessZygote)
+{
+#ifdef PY_OWN_GIL
+    ASSERT_THROW(PyProcessor("test_handler", BACKEND_ZYGOTE, 1), logic_error);
+#else
+    // the state left by the warm up call is inherited by the workers
+    PyProcessorRequests warmup(1, PyProcessorRequest("keep", messages, parameters));
+    PyProcessor processor("test_handler", BACKEND_ZYGOTE, 2, 1, warmup);
+    ASSERT_EQ(2u, processor.size());
+    ASSERT_EQ("1", processor.Process("kept", messages, parameters));
+    ASSERT_EQ("id:a=1,b=2:p,q", processor.Process("id", messages, parameters));
+    ASSERT_THROW(processor.Process("fail", messages, parameters), runtime_error);
+#endif
+}
+
+TEST_F(processor_fixture, testProcessZygoteRespawn)
+{
+#ifndef PY_OWN_GIL
+    PyProcessor processor("test_handler", BACKEND_ZYGOTE, 1);
+    string pid = processor.Process("pid", messages, parameters);
+    ASSERT_EQ(0, kill(atoi(pid.c_str()), SIGKILL));
+
+    // the call finding it dead fails, the next one has a new worker
+    ASSERT_THROW(processor.Process("id", messages, parameters), runtime_error);
+    string respawned = processor.Process("pid", messages, parameters);
+    ASSERT_NE(pid, respawned);
+    ASSERT_EQ("id:a=1,b=2:p,q", processor.Process("id", messages, parameters));
+#endif
+}
+
+TEST_F(processor_fixture, testProcessWorkersTimeout)
+{
+    // the worker stuck in the handler is killed and forked again
+    PyWorkerPool workers("test_handler", 1);
+    string pid = workers.process("pid", messages, parameters);
+    ASSERT_THROW(workers.process("spin", messages, parameters, 50000000ul), PyTimeoutError);
+    string respawned = workers.process("pid", messages, parameters);
+    ASSERT_NE(pid, respawned);
+
+    // so is a dead one
+    ASSERT_EQ(0, kill(atoi(respawned.c_str()), SIGKILL));
+    ASSERT_THROW(workers.process("id", messages, parameters), runtime_error);
+    ASSERT_NE(respawned, workers.process("pid", messages, parameters));
+    ASSERT_EQ("id:a=1,b=2:p,q", workers.process("id", messages, parameters));
+
+#ifndef PY_OWN_GIL
+    PyWorkerPool spawned("test_handler", 1, 1, SPAWN_ZYGOTE);
+    pid = spawned.process("pid", messages, parameters);
+    ASSERT_THROW(spawned.process("spin", messages, parameters, 50000000ul), PyTimeoutError);
+    ASSERT_NE(pid, spawned.process("pid", messages, parameters));
+#endif
+}
+
+TEST_F(processor_fixture, testProcessBatch)
+{
+    PyProcessor processor("test_handler", 2);
+    PyProcessorRequests requests;
+    requests.push_back(PyProcessorRequest("id", messages, parameters));
+    requests.push_back(PyProcessorRequest("fail", messages, parameters));
+    requests.push_back(PyProcessorRequest("other", messages, parameters));
+
+    PyProcessorResults results = processor.ProcessBatch(requests);
+    ASSERT_EQ(3u, results.size());
+    ASSERT_EQ(PROCESS_OK, results[0].status);
+    ASSERT_EQ("id:a=1,b=2:p,q", results[0].content);
+    ASSERT_EQ(PROCESS_ERROR, results[1].status);
+    ASSERT_NE(string::npos, results[1].content.find("failed on request"));
+    ASSERT_EQ(PROCESS_OK, results[2].status);
+    ASSERT_EQ("other:a=1,b=2:p,q", results[2].content);
+    ASSERT_TRUE(processor.ProcessBatch(PyProcessorRequests()).empty());
+}
+
+TEST_F(processor_fixture, testProcessBatchWorkers)
+{
+    PyProcessor processor("test_handler", BACKEND_WORKERS, 1);
+    PyProcessorRequests requests(2, PyProcessorRequest("id", messages, parameters));
+    requests[1].identifier = "fail";
+
+    PyProcessorResults results = processor.ProcessBatch(requests);
+    ASSERT_EQ(PROCESS_OK, results[0].status);
+    ASSERT_EQ("id:a=1,b=2:p,q", results[0].content);
+    ASSERT_EQ(PROCESS_ERROR, results[1].status);
+}
+
+static void count_result(const PyProcessorResult& result, void* arg)
+{
+    if (result.status == PROCESS_OK) {
+        __atomic_add_fetch((int*)arg, 1, __ATOMIC_RELAXED);
+    }
+}
+
+TEST_F(processor_fixture, testSubmit)
+{
+    PyProcessor processor("test_handler", 4);
+    ASSERT_THROW(processor.Submit("id", messages, parameters), logic_error);
+    ASSERT_THROW(processor.StartExecutors(5), logic_error);
+    processor.StartExecutors(2);
+    ASSERT_THROW(processor.StartExecutors(1), logic_error);
+
+    vector<PyProcessorFuture> futures;
+    for (int i = 0; i < 20; i++) {
+        futures.push_back(processor.Submit(i % 2 ? "id" : "fail", messages, parameters));
+    }
+
+    for (int i = 0; i < 20; i++) {
+        const PyProcessorResult& result = futures[i].get();
+        ASSERT_TRUE(futures[i].ready());
+        if (i % 2) {
+            ASSERT_EQ(PROCESS_OK, result.status);
+            ASSERT_EQ("id:a=1,b=2:p,q", result.content);
+        } else {
+            ASSERT_EQ(PROCESS_ERROR, result.status);
+        }
+    }
+
+    // the other interpreters remain for the synchronous calls
+    ASSERT_EQ("id:a=1,b=2:p,q", processor.Process("id", messages, parameters));
+
+    // an executor keeps its thread state, and its thread locals, between bunches
+    PyProcessor single("test_handler", 1);
+    single.StartExecutors(1);
+    ASSERT_EQ("1", single.Submit("local", messages, parameters).get().content);
+    ASSERT_EQ("2", single.Submit("local", messages, parameters).get().content);
+}
+
+TEST_F(processor_fixture, testSubmitCallback)
+{
+    int completed = 0;
+    {
+        PyProcessor processor("test_handler", 2);
+        processor.StartExecutors(2);
+        for (int i = 0; i < 10; i++) {
+            processor.Submit("id", messages, parameters, count_result, &completed);
+        }
+    }
+
+    // the queued calls are done before the processor is gone
+    ASSERT_EQ(10, completed);
+}
+
+TEST_F(processor_fixture, testSubmitRejected)
+{
+    PyProcessor processor("test_handler", 1);
+    processor.StartExecutors(1, 1);
+
+    // one call sleeping in the executor, the queue takes one more
+    vector<PyProcessorFuture> futures;
+    for (int i = 0; i < 3; i++) {
+        futures.push_back(processor.Submit("sleep", messages, parameters));
+    }
+
+    int rejected = 0;
+    for (int i = 0; i < 3; i++) {
+        if (futures[i].get().status == PROCESS_REJECTED) {
+            rejected++;
+        } else {
+            ASSERT_EQ(PROCESS_OK, futures[i].get().status);
+        }
+    }
+
+    ASSERT_GE(rejected, 1);
+}
+
+TEST_F(processor_fixture, testSubmitWorkers)
+{
+    PyProcessor processor("test_handler", BACKEND_WORKERS, 1, 2);
+    processor.StartExecutors(2);
+    PyProcessorFuture future = processor.Submit("id", messages, parameters);
+    PyProcessorFuture copy;
+    copy = future;
+    ASSERT_EQ("id:a=1,b=2:p,q", copy.get().content);
+}
+
+TEST_F(processor_fixture, testProcessMapView)
+{
+    PyProcessor processor("test_handler", 1, DEFAULT_POOL_SHARDS, REUSE_FIFO, MARSHAL_VIEW);
+    ASSERT_EQ("id:a=1,b=2:p,q", processor.Process("id", messages, parameters));
+
+    // the multimap reads as a dict of the last values
+    parameters.insert(make_pair(string("p"), string("z")));
+    ASSERT_EQ("id:a=1,b=2:p,q", processor.Process("id", messages, parameters));
+    ASSERT_EQ("x,z", processor.Process("all", messages, parameters));
+
+    PyProcessor dicts("test_handler", 1);
+    ASSERT_EQ(dicts.Process("api", messages, parameters),
+              processor.Process("api", messages, parameters));
+
+    // a view kept by the handler is detached from the map
+    processor.Process("keep", messages, parameters);
+    ASSERT_THROW(processor.Process("kept", messages, parameters), runtime_error);
+    ASSERT_THROW(processor.Process("fail", messages, parameters), runtime_error);
+}
+
+TEST_F(processor_fixture, testProcessReusedArguments)
+{
+    PyProcessor processor("test_handler", 1);
+
+    // the containers are refilled by the next call
+    string ids = processor.Process("ids", messages, parameters);
+    ASSERT_EQ(ids, processor.Process("ids", messages, parameters));
+
+    // with no keys of the previous call left
+    MapString2String fewer;
+    fewer["a"] = "3";
+    ASSERT_EQ("id:a=3:p,q", processor.Process("id", fewer, parameters));
+    ASSERT_EQ("id:a=1,b=2:p,q", processor.Process("id", messages, parameters));
+    MapString2String no_messages;
+    MultimapString2String no_parameters;
+    ASSERT_EQ("id::", processor.Process("id", no_messages, no_parameters));
+
+    // the dict kept by the handler is not changed by the next call
+    processor.Process("keep", messages, parameters);
+    ASSERT_NE(ids, processor.Process("ids", messages, parameters));
+    ASSERT_EQ("1", processor.Process("kept", fewer, parameters));
+}
+
+static void read_result(const char* data, size_t size, void* arg)
+{
+    ((string*)arg)->assign(data, size);
+}
+
+TEST_F(processor_fixture, testProcessResultSinks)
+{
+    PyProcessor processor("test_handler", 2);
+
+    // the buffer of the caller is reused
+    string output;
+    output.reserve(8000000);
+    const char* buffer = output.data();
+    processor.Process("big", messages, parameters, output);
+    ASSERT_EQ(4000000u, output.size());
+    ASSERT_EQ(buffer, output.data());
+    processor.Process("bytes", messages, parameters, output);
+    ASSERT_EQ("raw", output);
+
+    string read;
+    processor.Process("id", messages, parameters, read_result, &read);
+    ASSERT_EQ("id:a=1,b=2:p,q", read);
+
+    MapString2String dict;
+    dict["stale"] = "x";
+    processor.Process("dict", messages, parameters, dict);
+    ASSERT_EQ(3u, dict.size());
+    ASSERT_EQ("1", dict["a"]);
+    ASSERT_EQ("1", dict["n"]);
+    ASSERT_EQ("v", dict["u"]);
+
+    vector<string> list;
+    processor.Process("list", messages, parameters, list);
+    ASSERT_EQ(3u, list.size());
+    ASSERT_EQ("x", list[0]);
+    ASSERT_EQ("y", list[1]);
+    ASSERT_EQ("2", list[2]);
+    processor.Process("tuple", messages, parameters, list);
+    ASSERT_EQ(1u, list.size());
+
+    // results of other types are errors, not crashes
+    ASSERT_THROW(processor.Process("int", messages, parameters), runtime_error);
+    ASSERT_THROW(processor.Process("id", messages, parameters, dict), runtime_error);
+    ASSERT_THROW(processor.Process("dict", messages, parameters, list), runtime_error);
+    ASSERT_EQ("id:a=1,b=2:p,q", processor.Process("id", messages, parameters));
+}
+
+static string process_retried(PyProcessor& processor,
+                              const string& identifier,
+                              MapString2String& messages,
+                              MultimapString2String& parameters)
+{
+    for (unsigned int i = 0; ; i++) {
+        try {
+            return processor.Process(identifier, messages, parameters);
+        } catch (runtime_error& e) {
+            if (i == 200) {
+                throw;
+            }
+            usleep(10000);
+        }
+    }
+}
+
+TEST_F(processor_fixture, testProcessElastic)
+{
+    PyInterpreterScaling scaling(0, 1);
+    scaling.period_ms = 10;
+    scaling.idle_ms = 20;
+    PyProcessor processor("test_handler", scaling);
+    ASSERT_EQ(0u, processor.size());
+
+    // no interpreter until the timeouts make the pool grow
+    ASSERT_EQ("id:a=1,b=2:p,q", process_retried(processor, "id", messages, parameters));
+
+    // the arguments of the retired one are not used by the next one
+    for (unsigned int i = 0; i < 200 && processor.size() > 0; i++) {
+        usleep(10000);
+    }
+
+    ASSERT_EQ(0u, processor.size());
+    ASSERT_EQ("id:a=1,b=2:p,q", process_retried(processor, "id", messages, parameters));
+}
@@ -0,0 +1,74 @@
+#
+# Handlers used by the unit tests
+#
+
+import os
+import sys
+import threading
+import time
+
+kept = []
+calls = threading.local()
+
+def process_data_logic(key, messages, parameters):
+    if key == 'fail':
+        raise ValueError('failed on request')
+    if key == 'sleep':
+        time.sleep(0.1)
+    if key == 'keep':
+        kept.append(messages)
+    if key == 'kept':
+        return kept[0]['a']
+    if key == 'api':
+        return '%d:%s:%s:%s:%s:%s' % (len(messages), 'a' in messages, 'z' in messages,
+                                      messages.get('z', '-'), sorted(messages.items()),
+                                      sorted(parameters.values()))
+    if key == 'pid':
+        return str(os.getpid())
+    if key == 'ids':
+        return '%d,%d' % (id(messages), id(parameters))
+    if key == 'dict':
+        return {'a': messages['a'], 'n': 1, u'u': u'v'}
+    if key == 'list':
+        return ['x', u'y', 2]
+    if key == 'tuple':
+        return ('x',)
+    if key == 'bytes':
+        return bytearray(b'raw')
+    if key == 'int':
+        return 5
+    if key == 'big':
+        return 'v' * 4000000
+    if key == 'all':
+        return ','.join(parameters.getall('p'))
+    if key == 'spin':
+        spin()
+    if key == 'local':
+        calls.n = getattr(calls, 'n', 0) + 1
+        return str(calls.n)
+    values = ','.join('%s=%s' % (k, messages[k]) for k in sorted(messages))
+    names = ','.join(sorted(parameters))
+    return key + ':' + values + ':' + names
+
+def upper(s):
+    return s.upper()
+
+def lower(s):
+    return s.lower()
+
+def loader(s):
+    return type(getattr(sys.modules[__name__], '__loader__', None)).__name__
+
+def count(key, messages, parameters):
+    return '%s:%d' % (key, len(messages) + len(parameters))
+
+def leak(s):
+    kept.append([[] for i in range(2000)])
+    return s
+
+def exit(s):
+    raise SystemExit(s)
+
+def spin(*args):
+    while True:
+        pass
@@ -0,0 +1,99 @@
+#include <cstdio>
+#include <string>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "gtest/gtest.h"
+#include "trace.h"
+
+using namespace std;
+
+static unsigned int made = 0;
+
+static string message(const string& text)
+{
+    made++;
+    return text;
+}
+
+static void traced(const string& text)
+{
+    FRAME;
+
+    INFO(message(text));
+}
+
+static void traced_format(unsigned long n, const void* p)
+{
+    FRAME;
+
+    INFO("formatted %lu of %#lx", n, p);
+}
+
+static void* traced_thread(void* arg)
+{
+    for (unsigned int i = 0; i < 100; i++) {
+        traced("thread");
+    }
+
+    return NULL;
+}
+
+static string read_trace(FILE* f)
+{
+    __Frame__::flush();
+    string text;
+    char buffer[4096];
+    size_t n = 0;
+    rewind(f);
+    while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+        text.append(buffer, n);
+    }
+
+    return text;
+}
+
+TEST(trace, testTraceOff)
+{
+    bool was = __Frame__::enabled();
+    __Frame__::on(-1);
+    __Frame__::off();
+    ASSERT_FALSE(__Frame__::enabled());
+
+    // the message is not even made
+    made = 0;
+    traced("off");
+    ASSERT_EQ(0u, made);
+
+    if (was) {
+        __Frame__::on();
+    }
+}
+
+TEST(trace, testTraceOn)
+{
+    FILE* f = tmpfile();
+    ASSERT_TRUE(f != NULL);
+    unsigned long dropped = __Frame__::dropped();
+    __Frame__::on(fileno(f));
+    traced("message");
+    traced(string(200, 'x'));
+    traced_format(42, (const void*)0x10);
+    pthread_t thread;
+    ASSERT_EQ(0, pthread_create(&thread, NULL, traced_thread, NULL));
+    pthread_join(thread, NULL);
+    __Frame__::off();
+
+    string text = read_trace(f);
+    ASSERT_NE(string::npos, text.find(" TRACE  traced Enter"));
+    ASSERT_NE(string::npos, text.find(" TRACE  traced message"));
+    ASSERT_NE(string::npos, text.find(" TRACE  traced Leave"));
+    // formatted by the drain, a message too long is marked cut
+    ASSERT_NE(string::npos, text.find(" TRACE  traced_format formatted 42 of 0x10\n"));
+    ASSERT_NE(string::npos, text.find(" TRACE  traced " + string(96, 'x') + "...\n"));
+    // each thread has its own depth
+    ASSERT_NE(string::npos, text.find(" TRACE  traced thread"));
+    ASSERT_EQ(string::npos, text.find(" TRACE   traced"));
+    ASSERT_EQ(dropped, __Frame__::dropped());
+}